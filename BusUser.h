@@ -0,0 +1,105 @@
+#pragma once
+
+#include "systemd_sd-bus.h"
+#include <chrono>
+#include "debug.h"
+
+namespace dbus {
+
+// What to do with method calls that are waiting for a reply when the connection is lost.
+enum class InFlightPolicy
+{
+  fail,                 // Let them fail (the reply callback receives org.freedesktop.DBus.Error.NoReply).
+  retry                 // Send them again after reconnecting.
+};
+
+// How to deal with losing the connection to the bus.
+struct ReconnectPolicy
+{
+  bool m_enabled = false;                                               // Reconnect at all; when false the I/O task aborts when the connection is lost.
+  std::chrono::microseconds m_initial_backoff{1000};                    // The time to wait after the first failed attempt to reconnect.
+  std::chrono::microseconds m_max_backoff{1000000};                     // The backoff doubles after every failed attempt, up till this value.
+  bool m_warm_standby = false;                                          // Keep a second, already connected, socket ready to switch to.
+  InFlightPolicy m_in_flight = InFlightPolicy::fail;                    // What to do with calls that are waiting for a reply.
+};
+
+class BusUserList;
+
+// Base class of objects that need to know when the bus of their connection is replaced.
+//
+// Objects register themselves (see task::DBusConnection::register_bus_user) when they
+// put something on the bus that needs to be restored after reconnecting (an object, a match
+// or a pending method call). Both virtual functions are called by task::DBusHandleIO while
+// it holds the connection lock.
+class BusUser
+{
+ private:
+  friend class BusUserList;
+  BusUser* m_prev;
+  BusUser* m_next;
+  bool m_registered;
+
+ protected:
+  BusUser() : m_prev(nullptr), m_next(nullptr), m_registered(false) { }
+  ~BusUser() = default;
+
+ public:
+  bool is_registered() const { return m_registered; }
+
+  // The connection was lost. Drop everything that refers to the old bus (slots, messages).
+  // Pending method calls that are not dropped receive an error reply after this call.
+  virtual void bus_lost(ReconnectPolicy const& policy) = 0;
+
+  // The connection was restored; bus is the new bus. Install everything again.
+  virtual void bus_restored(sd_bus* bus) = 0;
+};
+
+// An intrusive list of BusUser objects.
+// Must only be accessed while holding the connection lock.
+class BusUserList
+{
+ private:
+  BusUser* m_head;
+
+ public:
+  BusUserList() : m_head(nullptr) { }
+
+  void insert(BusUser* bus_user)
+  {
+    // Don't register twice.
+    ASSERT(!bus_user->m_registered);
+    bus_user->m_prev = nullptr;
+    bus_user->m_next = m_head;
+    if (m_head)
+      m_head->m_prev = bus_user;
+    m_head = bus_user;
+    bus_user->m_registered = true;
+  }
+
+  void erase(BusUser* bus_user)
+  {
+    // Only erase registered objects.
+    ASSERT(bus_user->m_registered);
+    if (bus_user->m_prev)
+      bus_user->m_prev->m_next = bus_user->m_next;
+    else
+      m_head = bus_user->m_next;
+    if (bus_user->m_next)
+      bus_user->m_next->m_prev = bus_user->m_prev;
+    bus_user->m_registered = false;
+  }
+
+  // Call func for every element. func may erase the element that it is called for.
+  template<typename FUNC>
+  void for_each(FUNC func)
+  {
+    BusUser* next;
+    for (BusUser* bus_user = m_head; bus_user; bus_user = next)
+    {
+      next = bus_user->m_next;
+      func(bus_user);
+    }
+  }
+};
+
+} // namespace dbus
@@ -0,0 +1,43 @@
+#include "sys.h"
+#include "CancellationGroup.h"
+#include "DBusMethodCall.h"
+
+namespace dbus {
+
+void CancellationGroup::cancel()
+{
+  DoutEntering(dc::notice, "CancellationGroup::cancel()");
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_cancelled = true;
+  // Calls erase themselves from m_calls in their finish_impl, which needs m_mutex; so they stay valid here.
+  for (task::DBusMethodCall* call : m_calls)
+    call->cancel();
+}
+
+void CancellationGroup::reset()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_cancelled = false;
+}
+
+size_t CancellationGroup::size()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_calls.size();
+}
+
+void CancellationGroup::insert(task::DBusMethodCall* call)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_calls.insert(call);
+  if (m_cancelled)
+    call->cancel();
+}
+
+void CancellationGroup::erase(task::DBusMethodCall* call)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_calls.erase(call);
+}
+
+} // namespace dbus
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <mutex>
+#include <unordered_set>
+#include "debug.h"
+
+namespace task {
+class DBusMethodCall;
+} // namespace task
+
+namespace dbus {
+
+// A set of method calls that can be cancelled together, for example all calls made on behalf of one user session.
+//
+// Calls become a member with task::DBusMethodCall::set_cancellation_group and stop being one when they finish.
+// The group must outlive its members.
+class CancellationGroup
+{
+ private:
+  std::mutex m_mutex;                                           // Protects the members below.
+  std::unordered_set<task::DBusMethodCall*> m_calls;            // The running calls of this group.
+  bool m_cancelled;                                             // Set by cancel; calls that are added afterwards are cancelled immediately.
+
+ public:
+  CancellationGroup() : m_cancelled(false) { }
+
+  // Cancel all calls of the group (see task::DBusMethodCall::cancel). This function does not block on any connection.
+  void cancel();
+
+  // Stop cancelling calls that are added to the group from now on.
+  void reset();
+
+  size_t size();
+
+ private:
+  friend class task::DBusMethodCall;
+  void insert(task::DBusMethodCall* call);
+  void erase(task::DBusMethodCall* call);
+};
+
+} // namespace dbus
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Destination.h"
+#include "Signature.h"
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <variant>
+#include "debug.h"
+
+namespace dbus {
+
+// Functions to build the key that identifies identical method calls (see task::DBusMethodCall::set_coalesced_params).
+// Two calls have the same key if and only if they call the same destination with the same arguments.
+
+inline void append_coalescing_key(std::string& key, std::string_view value)
+{
+  size_t const size = value.size();
+  key.append(reinterpret_cast<char const*>(&size), sizeof(size));
+  key.append(value);
+}
+
+inline void append_coalescing_key(std::string& key, char const* value)
+{
+  append_coalescing_key(key, std::string_view{value});
+}
+
+// Any type that can be appended to a message, except file descriptors, can be used as argument.
+// Note that the elements of a std::unordered_map are appended in iteration order: equal maps
+// might result in different keys, in which case the calls simply aren't coalesced.
+template<typename T>
+void append_coalescing_key(std::string& key, T const& value)
+{
+  static_assert(DBusType<T>, "Only types that can be appended to a message (see dbus::DBusType) can be used as coalesced arguments.");
+  constexpr detail::Kind kind = detail::kind_of<T>();
+  if constexpr (kind == detail::Kind::basic)
+  {
+    static_assert(!std::is_same_v<T, UnixFd>, "A file descriptor can't be used as coalesced argument.");
+    if constexpr (std::is_arithmetic_v<T>)
+      key.append(reinterpret_cast<char const*>(&value), sizeof(value));
+    else
+      append_coalescing_key(key, std::string_view{value});
+  }
+  else if constexpr (kind == detail::Kind::array || kind == detail::Kind::dict)
+  {
+    size_t const size = value.size();
+    key.append(reinterpret_cast<char const*>(&size), sizeof(size));
+    for (auto const& element : value)
+    {
+      if constexpr (kind == detail::Kind::dict)
+      {
+        append_coalescing_key(key, element.first);
+        append_coalescing_key(key, element.second);
+      }
+      else
+        append_coalescing_key(key, element);
+    }
+  }
+  else if constexpr (kind == detail::Kind::optional)
+  {
+    key.push_back(value.has_value());
+    if (value)
+      append_coalescing_key(key, *value);
+  }
+  else if constexpr (kind == detail::Kind::structure)
+  {
+    auto append_members = [&key](auto const&... members){ (append_coalescing_key(key, members), ...); };
+    if constexpr (detail::is_std_tuple<T>::value)
+      std::apply(append_members, value);
+    else
+      std::apply(append_members, detail::tie_aggregate(value));
+  }
+  else
+  {
+    // A variant: the alternative is part of the key.
+    size_t const index = value.index();
+    key.append(reinterpret_cast<char const*>(&index), sizeof(index));
+    std::visit([&key](auto const& alternative){ append_coalescing_key(key, alternative); }, value);
+  }
+}
+
+// The part of the key that identifies the destination.
+inline std::string coalescing_key_prefix(Destination const& destination)
+{
+  std::string prefix;
+  // Include the terminating zeroes, so that the names can't run into each other.
+  for (char const* name : { destination.service_name(), destination.object_path(), destination.interface_name(), destination.method_name() })
+    prefix.append(name ? name : "", name ? std::strlen(name) + 1 : 1);
+  return prefix;
+}
+
+template<typename... Args>
+std::string coalescing_key(Destination const& destination, Args const&... args)
+{
+  std::string key = destination.key_prefix() ? *destination.key_prefix() : coalescing_key_prefix(destination);
+  (append_coalescing_key(key, args), ...);
+  return key;
+}
+
+} // namespace dbus
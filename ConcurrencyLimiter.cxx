@@ -0,0 +1,100 @@
+#include "sys.h"
+#include "ConcurrencyLimiter.h"
+#include <algorithm>
+
+namespace dbus {
+
+ConcurrencyLimiter::ConcurrencyLimiter(ConcurrencyPolicy const& policy) :
+  m_policy(policy), m_limit(policy.m_initial_limit), m_in_flight(0)
+{
+  // The limits must make sense.
+  ASSERT(0 < policy.m_min_limit && policy.m_min_limit <= policy.m_initial_limit && policy.m_initial_limit <= policy.m_max_limit);
+  ASSERT(0.0 < policy.m_backoff && policy.m_backoff < 1.0);
+}
+
+bool ConcurrencyLimiter::acquire(AIStatefulTask* task, condition_type condition)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  // Don't let new calls overtake calls that are already waiting.
+  if (m_waiters.empty() && m_in_flight < static_cast<unsigned int>(m_limit))
+  {
+    ++m_in_flight;
+    return true;
+  }
+  m_waiters.push_back({task, condition});
+  return false;
+}
+
+// Hand out permits while below the limit. Called while holding m_mutex.
+void ConcurrencyLimiter::grant()
+{
+  while (!m_waiters.empty() && m_in_flight < static_cast<unsigned int>(m_limit))
+  {
+    Waiter waiter = m_waiters.front();
+    m_waiters.pop_front();
+    ++m_in_flight;
+    waiter.m_task->signal(waiter.m_condition);
+  }
+}
+
+void ConcurrencyLimiter::release(clock_type::duration latency, bool overloaded)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  // Calls to release must match successful calls to acquire.
+  ASSERT(m_in_flight > 0);
+  bool const limited = m_in_flight >= static_cast<unsigned int>(m_limit);
+  --m_in_flight;
+  if (overloaded || latency > m_policy.m_latency_threshold)
+  {
+    // All calls that were sent before the first decrease took effect are also slow; only react to them once.
+    auto now = clock_type::now();
+    if (now - m_last_decrease > latency)
+    {
+      m_limit = std::max<double>(m_limit * m_policy.m_backoff, m_policy.m_min_limit);
+      m_last_decrease = now;
+      Dout(dc::notice, "ConcurrencyLimiter: limit decreased to " << m_limit);
+    }
+  }
+  else if (limited)
+    m_limit = std::min<double>(m_limit + 1.0 / m_limit, m_policy.m_max_limit);
+  grant();
+}
+
+void ConcurrencyLimiter::release()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  // Calls to release must match successful calls to acquire.
+  ASSERT(m_in_flight > 0);
+  --m_in_flight;
+  grant();
+}
+
+bool ConcurrencyLimiter::cancel(AIStatefulTask* task)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto iter = std::find_if(m_waiters.begin(), m_waiters.end(), [task](Waiter const& waiter){ return waiter.m_task == task; });
+  if (iter == m_waiters.end())
+    return false;
+  m_waiters.erase(iter);
+  return true;
+}
+
+unsigned int ConcurrencyLimiter::limit()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_limit;
+}
+
+unsigned int ConcurrencyLimiter::in_flight()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_in_flight;
+}
+
+size_t ConcurrencyLimiter::queued()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_waiters.size();
+}
+
+} // namespace dbus
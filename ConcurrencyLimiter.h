@@ -0,0 +1,75 @@
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include "debug.h"
+
+namespace dbus {
+
+// How the limit of a ConcurrencyLimiter adapts.
+struct ConcurrencyPolicy
+{
+  unsigned int m_initial_limit = 16;                                    // The number of calls that may be in flight at first.
+  unsigned int m_min_limit = 1;                                         // The limit never drops below this value.
+  unsigned int m_max_limit = 1024;                                      // The limit never grows beyond this value.
+  std::chrono::microseconds m_latency_threshold{100000};                // Calls that take longer than this count as a sign of overload.
+  double m_backoff = 0.9;                                               // The factor that the limit is multiplied with upon overload.
+};
+
+// Limit the number of method calls to one destination that are in flight at the same time.
+//
+// The limit adapts with AIMD: while calls complete in time and the limit is actually reached,
+// the limit grows by one per limit completed calls (roughly one per round trip); when a call
+// takes longer than the latency threshold or fails because the peer is overloaded, the limit
+// is multiplied with the backoff factor, at most once per round trip.
+//
+// Calls beyond the limit wait in a FIFO queue, before they request a connection
+// (see task::DBusMethodCall::set_concurrency_limiter).
+class ConcurrencyLimiter
+{
+  using condition_type = AIStatefulTask::condition_type;
+  using clock_type = std::chrono::steady_clock;
+
+  struct Waiter
+  {
+    AIStatefulTask* m_task;                                             // The task to signal when it may proceed.
+    condition_type m_condition;                                         // The condition to signal it with.
+  };
+
+ private:
+  ConcurrencyPolicy const m_policy;
+  std::mutex m_mutex;                                                   // Protects the members below.
+  double m_limit;                                                       // The current limit.
+  unsigned int m_in_flight;                                             // The number of calls that hold a permit.
+  std::deque<Waiter> m_waiters;                                         // Calls waiting for a permit.
+  clock_type::time_point m_last_decrease;                               // When the limit was last decreased.
+
+ public:
+  ConcurrencyLimiter(ConcurrencyPolicy const& policy = {});
+
+  // Obtain a permit. Returns true if the call may proceed immediately.
+  // Otherwise task is signalled with condition once it holds a permit.
+  bool acquire(AIStatefulTask* task, condition_type condition);
+
+  // Give up the permit of a call that finished; latency is the time it held the permit.
+  // Set overloaded when the call failed with an error that means that the peer can't keep up.
+  void release(clock_type::duration latency, bool overloaded);
+
+  // Give up the permit of a call that was aborted; this doesn't change the limit.
+  void release();
+
+  // Remove task from the queue. Returns false if it was already given a permit
+  // (and was signalled); the caller must then still call release().
+  bool cancel(AIStatefulTask* task);
+
+  unsigned int limit();
+  unsigned int in_flight();
+  size_t queued();
+
+ private:
+  void grant();
+};
+
+} // namespace dbus
@@ -1,31 +1,288 @@
 #include "sys.h"
 #include "dbus-task/Connection.h"
 #include "dbus-task/DBusConnection.h"
+#include "utils/AIAlert.h"
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <ctime>
 
 namespace dbus {
 
+namespace {
+// Set to the Connection whose pinned I/O thread this is.
+thread_local Connection* tl_pinned_connection;
+
+// Escape value for use in a D-Bus address (see the D-Bus specification, section "Server Addresses").
+std::string escape_address_value(char const* value)
+{
+  static char const hexdigits[] = "0123456789abcdef";
+  std::string result;
+  for (char const* p = value; *p; ++p)
+  {
+    unsigned char c = *p;
+    if (std::isalnum(c) || std::strchr("-_/.\\", c))
+      result += c;
+    else
+    {
+      result += '%';
+      result += hexdigits[c >> 4];
+      result += hexdigits[c & 0xf];
+    }
+  }
+  return result;
+}
+
+} // namespace
+
+void Connection::connect_user(std::string description)
+{
+  DoutEntering(dc::dbus, "dbus::Connection::connect_user()");
+  // Use the same logic as sd_bus_open_user to determine the address.
+  std::string address;
+  if (char const* env = secure_getenv("DBUS_SESSION_BUS_ADDRESS"))
+    address = env;
+  else
+  {
+    char const* runtime_dir = secure_getenv("XDG_RUNTIME_DIR");
+    if (!runtime_dir)
+      THROW_ALERT("Can't determine the address of the user bus: neither DBUS_SESSION_BUS_ADDRESS nor XDG_RUNTIME_DIR is set.");
+    address = "unix:path=" + escape_address_value(runtime_dir) + "/bus";
+  }
+  connect(address, description, true, true);
+}
+
+void Connection::connect_system(std::string description)
+{
+  DoutEntering(dc::dbus, "dbus::Connection::connect_system()");
+  // Use the same logic as sd_bus_open_system to determine the address.
+  char const* env = secure_getenv("DBUS_SYSTEM_BUS_ADDRESS");
+  connect(env ? env : "unix:path=/run/dbus/system_bus_socket", description, false, true);
+}
+
+void Connection::connect_address(std::string const& address, bool bus_client, std::string description)
+{
+  DoutEntering(dc::dbus, "dbus::Connection::connect_address(\"" << address << "\", " << std::boolalpha << bus_client << ")");
+  connect(address, description, false, bus_client);
+}
+
+void Connection::accept(int fd, sd_id128_t server_id, std::string description)
+{
+  DoutEntering(dc::dbus, "dbus::Connection::accept(" << fd << ")");
+  int ret;
+  try
+  {
+    new_bus(description);
+    if ((ret = sd_bus_set_fd(m_bus, fd, fd)) < 0)
+      THROW_ALERTC(-ret, "sd_bus_set_fd");
+  }
+  catch (AIAlert::Error const&)
+  {
+    // The fd is only owned by the bus when sd_bus_set_fd succeeded.
+    ::close(fd);
+    throw;
+  }
+  if ((ret = sd_bus_set_server(m_bus, true, server_id)) < 0)
+    THROW_ALERTC(-ret, "sd_bus_set_server");
+  m_bus_client = false;
+  // A client disconnecting is normal: let handle_dbus_io return connection_lost, after which task::DBusHandleIO finishes.
+  enable_reconnect();
+  // This only queues the authentication.
+  start();
+}
+
+void Connection::new_bus(std::string const& description)
+{
+  int ret = sd_bus_new(&m_bus);
+  if (ret < 0)
+    THROW_ALERTC(-ret, "sd_bus_new");
+  if ((ret = sd_bus_set_description(m_bus, description.c_str())) < 0)
+    THROW_ALERTC(-ret, "sd_bus_set_description");
+}
+
+void Connection::connect(std::string const& address, std::string const& description, bool trusted, bool bus_client)
+{
+  DoutEntering(dc::dbus, "dbus::Connection::connect(\"" << address << "\", \"" << description << "\", " << std::boolalpha << trusted << ", " << bus_client << ")");
+  new_bus(description);
+  int ret;
+  if ((ret = sd_bus_set_address(m_bus, address.c_str())) < 0)
+    THROW_ALERTC(-ret, "sd_bus_set_address");
+  if ((ret = sd_bus_set_bus_client(m_bus, bus_client)) < 0)
+    THROW_ALERTC(-ret, "sd_bus_set_bus_client");
+  m_bus_client = bus_client;
+  if ((ret = sd_bus_set_trusted(m_bus, trusted)) < 0)
+    THROW_ALERTC(-ret, "sd_bus_set_trusted");
+  // For unix sockets this does a non-blocking connect and queues the authentication and the Hello call.
+  // Note that "unixexec:" and "tcp:" addresses still might block (on fork/exec and name resolution respectively).
+  start();
+}
+
+void Connection::start()
+{
+  int ret;
+  if ((ret = sd_bus_set_connected_signal(m_bus, true)) < 0)
+    THROW_ALERTC(-ret, "sd_bus_set_connected_signal");
+  if ((ret = sd_bus_start(m_bus)) < 0)
+    THROW_ALERTC(-ret, "sd_bus_start");
+  // Count the incoming messages and keep track of whether or not the connection was fully set up (see is_established).
+  if ((ret = sd_bus_add_filter(m_bus, nullptr, &Connection::s_filter, this)) < 0)
+    THROW_ALERTC(-ret, "sd_bus_add_filter");
+  int fd = ret = sd_bus_get_fd(m_bus);
+  if (ret < 0)
+    THROW_ALERTC(-ret, "sd_bus_get_fd");
+  m_bus_fd = fd;
+  // Both evio and sd_bus close the fd that they are given; use a duplicate so that close_bus() can be called.
+  int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (dup_fd == -1)
+    THROW_ALERTC(errno, "fcntl");
+  fd_init(dup_fd);
+  // sd_bus only handles timeouts (of method calls) from sd_bus_process; make sure that is called in time, also when nothing is received.
+  m_timeout_timer = evio::create<TimerFd>(m_handle_io, task::DBusHandleIO::have_dbus_io);
+  m_timeout_timer->init();
+  // Do not start the output device yet!
+  // Doing so would cause write_to_fd to be called simply because we can write,
+  // but that function calls task::DBusHandleIO::signal(task::DBusHandleIO::have_dbus_io)
+  // which would be lost if task::DBusHandleIO hasn't reached the corresponding
+  // wait(have_dbus_io) yet.
+  //
+  // Once task::DBusHandleIO has reached state DBusHandleIO_start it will
+  // call handle_io_ready(), which will start the output device.
+}
+
+int Connection::s_filter(sd_bus_message* message, void* userdata, sd_bus_error* UNUSED_ARG(ret_error))
+{
+  Connection* self = static_cast<Connection*>(userdata);
+  uint8_t type = 0;
+  if (sd_bus_message_get_type(message, &type) >= 0)
+    self->m_handle_io->metrics().received(type);
+  if (type == SD_BUS_MESSAGE_SIGNAL && sd_bus_message_is_signal(message, "org.freedesktop.DBus.Local", "Connected") > 0)
+    self->m_established = true;
+  // Let others see the message too.
+  return 0;
+}
+
+uint64_t Connection::budget_exhausted_count() const
+{
+  return m_handle_io->metrics().budget_exhausted_count();
+}
+
+void Connection::close_bus()
+{
+  if (m_timeout_timer)
+  {
+    m_timeout_timer->close();
+    m_timeout_timer.reset();
+  }
+  if (!m_bus)
+    return;
+  DoutEntering(dc::dbus, "dbus::Connection::close_bus()");
+  sd_bus_close(m_bus);
+  sd_bus_unref(m_bus);
+  m_bus = nullptr;
+}
+
 Connection::HandleIOResult Connection::handle_dbus_io()
 {
   DoutEntering(dc::notice|continued_cf, "Connection::handle_dbus_io() = ");
   ASSERT(m_magic == 0x12345678abcdef99);
   int ret;
+  bool const reconnect = m_reconnect.load(std::memory_order_relaxed);
+  ConnectionMetrics& metrics = m_handle_io->metrics();
+  uint64_t iterations = 0;
+  unsigned int processed = 0;
+  using clock_type = std::chrono::steady_clock;
+  clock_type::time_point const deadline = m_max_time_per_wakeup.count() ? clock_type::now() + m_max_time_per_wakeup : clock_type::time_point::max();
+  if (m_pinned)
+  {
+    // Nobody is watching the socket anymore if the I/O thread terminated because poll failed.
+    int err = m_pinned_io_thread_errno.load(std::memory_order_relaxed);
+    if (AI_UNLIKELY(err))
+    {
+      if (reconnect)
+      {
+        Dout(dc::finish, "connection_lost (poll: " << strerror(err) << ")");
+        return connection_lost;
+      }
+      THROW_ALERTC(err, "poll");
+    }
+  }
   do
   {
     ret = sd_bus_process(m_bus, nullptr);
     ASSERT(m_magic == 0x12345678abcdef99);
+    ++iterations;
     if (ret < 0)
     {
+      metrics.wakeup(iterations);
+      if (reconnect)
+      {
+        Dout(dc::finish, "connection_lost (" << strerror(-ret) << ")");
+        return connection_lost;
+      }
       THROW_ALERTC(-ret, "sd_bus_process");
     }
+    // Leave dispatching the errors of pending method calls to task::DBusHandleIO when the connection was lost.
+    if (reconnect && sd_bus_is_open(m_bus) <= 0)
+    {
+      metrics.wakeup(iterations);
+      Dout(dc::finish, "connection_lost");
+      return connection_lost;
+    }
     if (ret && m_unlocked_in_callback)
     {
+      metrics.wakeup(iterations);
       Dout(dc::finish, "needs_relock");
       return needs_relock;
     }
+    // Do not hog the connection lock when there is a flood of incoming messages.
+    if (ret && ((m_max_messages_per_wakeup && ++processed == m_max_messages_per_wakeup) || clock_type::now() >= deadline))
+    {
+      metrics.wakeup(iterations);
+      metrics.budget_exhausted();
+      Dout(dc::finish, "budget_exhausted");
+      return budget_exhausted;
+    }
   }
   while (ret);
+  metrics.wakeup(iterations);
+  uint64_t read_queue_depth = 0;
+  uint64_t write_queue_depth = 0;
+  sd_bus_get_n_queued_read(m_bus, &read_queue_depth);
+  sd_bus_get_n_queued_write(m_bus, &write_queue_depth);
+  metrics.queue_depths(read_queue_depth, write_queue_depth);
   int flags = sd_bus_get_events(m_bus);
+  // The time at which the first pending method call times out (or another internal timeout of sd_bus expires).
+  uint64_t timeout_usec;
+  if (sd_bus_get_timeout(m_bus, &timeout_usec) < 0)
+    timeout_usec = UINT64_MAX;
+
+  if (m_pinned)
+  {
+    m_pinned_timeout_usec.store(timeout_usec, std::memory_order_relaxed);
+    m_pinned_poll_events.store(flags, std::memory_order_release);
+    // If we're not running in the I/O thread then it might be blocked in poll with the wrong events or timeout.
+    if (tl_pinned_connection != this)
+      wake_up_pinned_io_thread();
+    Dout(dc::finish, (m_unlocked_in_callback ? "unlocked_and_io_handled" : "io_handled"));
+    return m_unlocked_in_callback ? unlocked_and_io_handled : io_handled;
+  }
+
+  // Only touch the timerfd when the earliest timeout changed.
+  if (timeout_usec != m_timeout_timer->expiration_usec())
+  {
+    if (timeout_usec == UINT64_MAX)
+      m_timeout_timer->disarm();
+    else
+      m_timeout_timer->arm_at(timeout_usec);
+  }
 
   // If POLLOUT is set, reset POLLIN.
   flags &= ~((flags & POLLOUT) ? POLLIN : 0);
@@ -66,4 +323,133 @@ void Connection::write_to_fd(int& UNUSED_ARG(allow_deletion_count), int UNUSED_A
   m_handle_io->signal(task::DBusHandleIO::have_dbus_io);
 }
 
+void Connection::hup(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd))
+{
+  DoutEntering(dc::notice, "dbus::Connection::hup");
+  // Let task::DBusHandleIO find out that the connection was lost (sd_bus_process reads the EOF).
+  if (m_reconnect.load(std::memory_order_relaxed))
+    m_handle_io->signal(task::DBusHandleIO::have_dbus_io);
+}
+
+void Connection::err(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd))
+{
+  DoutEntering(dc::notice, "dbus::Connection::err");
+  // When reconnecting task::DBusHandleIO closes this device after it handled the error.
+  if (m_reconnect.load(std::memory_order_relaxed))
+    m_handle_io->signal(task::DBusHandleIO::have_dbus_io);
+  else
+    close();
+}
+
+void Connection::start_pinned_io_thread()
+{
+  DoutEntering(dc::notice, "Connection::start_pinned_io_thread()");
+  // We don't know yet what sd_bus wants; poll for both and let the first call to handle_dbus_io correct that.
+  m_pinned_poll_events.store(POLLIN | POLLOUT, std::memory_order_relaxed);
+  // The thread keeps this Connection and the task::DBusHandleIO (and therefore the eventfd) alive until it terminates.
+  m_pinned_io_thread = std::thread(&Connection::pinned_io_thread_main, this, boost::intrusive_ptr<Connection>(this), boost::intrusive_ptr<task::DBusHandleIO>(m_handle_io));
+}
+
+void Connection::wake_up_pinned_io_thread()
+{
+  uint64_t one = 1;
+  [[maybe_unused]] ssize_t len = ::write(m_wakeup_fd, &one, sizeof(one));
+}
+
+void Connection::stop_pinned_io_thread()
+{
+  if (!m_pinned_io_thread.joinable())
+    return;
+  DoutEntering(dc::notice, "Connection::stop_pinned_io_thread()");
+  m_stop_pinned_io_thread.store(true, std::memory_order_relaxed);
+  wake_up_pinned_io_thread();
+  // This is also called from the I/O thread itself: from task::DBusHandleIO, or from ~Connection when the thread released the last reference.
+  if (m_pinned_io_thread.get_id() == std::this_thread::get_id())
+    // We can't join ourselves; the thread terminates as soon as it returns to its loop.
+    m_pinned_io_thread.detach();
+  else
+    m_pinned_io_thread.join();
+}
+
+void Connection::pinned_io_thread_main(boost::intrusive_ptr<Connection> UNUSED_ARG(self), boost::intrusive_ptr<task::DBusHandleIO> handle_io)
+{
+  Debug(NAMESPACE_DEBUG::init_thread("DBusIO"));
+  Dout(dc::notice, "Entering Connection::pinned_io_thread_main()");
+  tl_pinned_connection = this;
+
+  if (m_pinned_cpu != -1)
+  {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(m_pinned_cpu, &cpuset);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (err)
+      Dout(dc::warning, "pthread_setaffinity_np(" << m_pinned_cpu << ") failed: " << strerror(err));
+  }
+
+  using clock_type = std::chrono::steady_clock;
+  struct pollfd fds[2];
+  fds[0].fd = m_bus_fd;
+  fds[1].fd = m_wakeup_fd;
+  fds[1].events = POLLIN;
+  while (!m_stop_pinned_io_thread.load(std::memory_order_relaxed))
+  {
+    fds[0].events = m_pinned_poll_events.load(std::memory_order_acquire);
+    // Don't watch the socket at all while handle_dbus_io still has to run (poll reports POLLHUP and POLLERR regardless of events).
+    fds[0].fd = fds[0].events ? m_bus_fd : -1;
+    int ready = 0;
+    if (m_spin_period.count() > 0)
+    {
+      clock_type::time_point const spin_end = clock_type::now() + m_spin_period;
+      do
+        ready = ::poll(fds, 2, 0);
+      while (ready == 0 && clock_type::now() < spin_end);
+    }
+    if (ready == 0)
+    {
+      int timeout_ms = -1;
+      uint64_t timeout_usec = m_pinned_timeout_usec.load(std::memory_order_relaxed);
+      if (timeout_usec != UINT64_MAX)
+      {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t now_usec = static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+        // Round up, so we don't wake up too early.
+        timeout_ms = timeout_usec <= now_usec ? 0 : static_cast<int>(std::min<uint64_t>((timeout_usec - now_usec + 999) / 1000, INT_MAX));
+      }
+      ready = ::poll(fds, 2, timeout_ms);
+    }
+    if (ready < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      int err = errno;
+      Dout(dc::warning, "poll: " << strerror(err));
+      // Let task::DBusHandleIO find out (in handle_dbus_io) that this connection can't be used anymore.
+      m_pinned_io_thread_errno.store(err, std::memory_order_relaxed);
+      handle_io->signal(task::DBusHandleIO::have_dbus_io);
+      break;
+    }
+    if ((fds[1].revents & POLLIN))
+    {
+      uint64_t count;
+      [[maybe_unused]] ssize_t len = ::read(m_wakeup_fd, &count, sizeof(count));
+    }
+    if (m_stop_pinned_io_thread.load(std::memory_order_relaxed))
+      break;
+    // poll is level-triggered: stop watching the socket and the sd_bus timeout until handle_dbus_io
+    // has processed what is pending, otherwise we'd spin while task::DBusHandleIO is waiting for the
+    // connection lock or running in another thread. handle_dbus_io stores new events and a new timeout
+    // when it is done (and wakes us up if that isn't happening in this thread).
+    m_pinned_timeout_usec.store(UINT64_MAX, std::memory_order_relaxed);
+    m_pinned_poll_events.store(0, std::memory_order_release);
+    // This runs task::DBusHandleIO in this thread (it uses an immediate handler), unless it is already running or waiting for the connection lock.
+    handle_io->signal(task::DBusHandleIO::have_dbus_io);
+  }
+
+  tl_pinned_connection = nullptr;
+  Dout(dc::notice, "Leaving Connection::pinned_io_thread_main()");
+  // Releasing self and handle_io might destruct this object.
+}
+
 } // namespace dbus
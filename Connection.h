@@ -2,8 +2,13 @@
 
 #include "evio/RawInputDevice.h"
 #include "evio/RawOutputDevice.h"
+#include <boost/intrusive_ptr.hpp>
 #include "systemd_sd-bus.h"
+#include "TimerFd.h"
 #include "debug.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 namespace task {
 class DBusConnection;
@@ -20,59 +25,141 @@ class Connection : public evio::RawInputDevice, public evio::RawOutputDevice
   sd_bus* m_bus;
   task::DBusHandleIO* m_handle_io;
   bool m_unlocked_in_callback;          // Set to true when m_mutex was unlocked while inside sd_bus_process.
+  unsigned int m_max_messages_per_wakeup;               // The maximum number of messages processed by handle_dbus_io before giving the lock back (0 = unlimited).
+  std::chrono::microseconds m_max_time_per_wakeup;      // The maximum time spent in handle_dbus_io before giving the lock back (0 = unlimited).
+  std::atomic<bool> m_reconnect;                        // Set when task::DBusHandleIO should reconnect when this connection is lost.
+  bool m_established;                                   // Set when the org.freedesktop.DBus.Local.Connected signal was received.
+  bool m_bus_client;                                    // Set when this is a connection to a bus (as opposed to a peer-to-peer connection).
+  boost::intrusive_ptr<TimerFd> m_timeout_timer;        // Wakes up task::DBusHandleIO when sd_bus_process must be called (see sd_bus_get_timeout).
+
+  // Pinned I/O thread mode.
+  bool m_pinned;                                        // Set when use_pinned_io_thread was called.
+  int m_pinned_cpu;                                     // The CPU that the I/O thread is pinned to, or -1 if it isn't pinned.
+  std::chrono::microseconds m_spin_period;              // The time that the I/O thread busy-polls before blocking.
+  int m_bus_fd;                                         // The fd of m_bus.
+  int m_wakeup_fd;                                      // An eventfd that is used to wake up the I/O thread (owned by task::DBusHandleIO).
+  std::thread m_pinned_io_thread;
+  std::atomic<bool> m_stop_pinned_io_thread;
+  std::atomic<short> m_pinned_poll_events;              // The events that the I/O thread should poll for (as returned by sd_bus_get_events), or 0 while handle_dbus_io still has to run.
+  std::atomic<uint64_t> m_pinned_timeout_usec;          // The CLOCK_MONOTONIC time at which sd_bus_process must be called (as returned by sd_bus_get_timeout).
+  std::atomic<int> m_pinned_io_thread_errno;            // Set to the errno of poll when the I/O thread terminated because poll failed.
 
 #if CW_DEBUG
   uint64_t m_magic = 0x12345678abcdef99;
 #endif
 
  public:
-  Connection(task::DBusHandleIO* handle_io) : m_handle_io(handle_io) { }
-  ~Connection() { DEBUG_ONLY(m_magic = 0); }
-
-  void connect_user(std::string description = "Connection")
-  {
-    DoutEntering(dc::dbus, "dbus::Connection::connect_user()");
-    int ret = sd_bus_open_user_with_description(&m_bus, description.c_str());           // Create and connects a socket and writes the initial messages to it.
-    if (ret < 0)
-      THROW_ALERTC(-ret, "sd_bus_open_user_with_description");
-    int fd = ret = sd_bus_get_fd(m_bus);
-    if (ret < 0)
-      THROW_ALERTC(-ret, "sd_bus_get_fd");
-    fd_init(fd);
-    // Do not start the output device yet!
-    // Doing so would cause write_to_fd to be called simply because we can write,
-    // but that function calls task::DBusHandleIO::signal(task::DBusHandleIO::have_dbus_io)
-    // which would be lost if task::DBusHandleIO hasn't reached the corresponding
-    // wait(have_dbus_io) yet.
-    //
-    // Once task::DBusHandleIO has reached state DBusHandleIO_start it will
-    // call handle_io_ready(), which will start the output device.
-  }
+  // The default process budget.
+  static constexpr unsigned int default_max_messages_per_wakeup = 64;
+  static constexpr std::chrono::microseconds default_max_time_per_wakeup{2000};
+
+  Connection(task::DBusHandleIO* handle_io) : m_bus(nullptr), m_handle_io(handle_io), m_unlocked_in_callback(false),
+    m_max_messages_per_wakeup(default_max_messages_per_wakeup), m_max_time_per_wakeup(default_max_time_per_wakeup),
+    m_reconnect(false), m_established(false), m_bus_client(true),
+    m_pinned(false), m_pinned_cpu(-1), m_bus_fd(-1), m_wakeup_fd(-1), m_stop_pinned_io_thread(false), m_pinned_poll_events(0), m_pinned_timeout_usec(UINT64_MAX), m_pinned_io_thread_errno(0) { }
+  ~Connection() { stop_pinned_io_thread(); close_bus(); DEBUG_ONLY(m_magic = 0); }
+
+  // Connect to the user bus, or the system bus, respectively.
+  //
+  // These functions do not block: the socket is connected asynchronously and authentication
+  // and the Hello call are driven by sd_bus_process (see task::DBusHandleIO). Until that
+  // finished the bus is in the "opening" state, which doesn't stop anyone from queuing
+  // messages on it. Once the connection is ready a synthesized
+  // org.freedesktop.DBus.Local.Connected signal is dispatched (use sd_bus_add_filter to see it).
+  void connect_user(std::string description = "Connection");
+  void connect_system(std::string description = "Connection");
+
+  // Connect to address (in D-Bus address syntax, for example "unix:path=/run/my_service.socket").
+  // Pass bus_client = false for a peer-to-peer connection (no Hello call, no unique name).
+  void connect_address(std::string const& address, bool bus_client, std::string description = "Connection");
+
+  // Use fd, an accepted connection of a peer-to-peer server with id server_id. This takes ownership of fd.
+  void accept(int fd, sd_id128_t server_id, std::string description = "Connection");
 
  private:
+  void new_bus(std::string const& description);
+  void connect(std::string const& address, std::string const& description, bool trusted, bool bus_client);
+  void start();
+
+  // Counts the received messages and keeps track of is_established.
+  static int s_filter(sd_bus_message* m, void* userdata, sd_bus_error* ret_error);
+
   friend class task::DBusHandleIO;
   void handle_io_ready()
   {
-    start_output_device();
+    if (m_pinned)
+      start_pinned_io_thread();
+    else
+      start_output_device();
   }
 
+  void start_pinned_io_thread();
+  void pinned_io_thread_main(boost::intrusive_ptr<Connection> self, boost::intrusive_ptr<task::DBusHandleIO> handle_io);
+
  public:
-  void connect_system(std::string description = "Connection")
+  // Set the maximum number of messages and the maximum time that handle_dbus_io may
+  // spend processing incoming messages while holding the connection lock.
+  // Passing zero for either means no limit for that aspect.
+  void set_process_budget(unsigned int max_messages, std::chrono::microseconds max_time)
   {
-    DoutEntering(dc::dbus, "dbus::Connection::connect_system()");
-    int ret = sd_bus_open_system_with_description(&m_bus, description.c_str());
-    if (ret < 0)
-      THROW_ALERTC(-ret, "sd_bus_open_system_with_description");
-    int fd = ret = sd_bus_get_fd(m_bus);
-    if (ret < 0)
-      THROW_ALERTC(-ret, "sd_bus_get_fd");
-    fd_init(fd);
-    // Do not start the output device yet! See above.
+    m_max_messages_per_wakeup = max_messages;
+    m_max_time_per_wakeup = max_time;
+  }
+
+  // Return the number of times that the process budget ran out.
+  uint64_t budget_exhausted_count() const;
+
+  // Let a dedicated thread, pinned to cpu (unless cpu is -1), do the I/O of this connection instead of the EventLoop thread.
+  //
+  // That thread waits for I/O on the socket itself and runs task::DBusHandleIO (which uses an immediate handler)
+  // directly, avoiding the EventLoop and thread pool queues. After each wakeup it keeps polling the socket,
+  // without blocking, for spin_period before going to sleep again. Once it signalled task::DBusHandleIO
+  // the socket isn't watched anymore until handle_dbus_io has run again.
+  //
+  // The thread is woken up by writing to the eventfd wakeup_fd, which is owned by task::DBusHandleIO.
+  //
+  // Use task::DBusHandleIO::use_pinned_io_thread instead of calling this directly.
+  void use_pinned_io_thread(int cpu, std::chrono::microseconds spin_period, int wakeup_fd)
+  {
+    m_pinned = true;
+    m_pinned_cpu = cpu;
+    m_spin_period = spin_period;
+    m_wakeup_fd = wakeup_fd;
   }
 
+  bool is_pinned() const { return m_pinned; }
+
+  // Wake up the pinned I/O thread, causing it to run task::DBusHandleIO.
+  void wake_up_pinned_io_thread();
+
+  // Stop the pinned I/O thread, if any. Called by task::DBusHandleIO when it finishes.
+  void stop_pinned_io_thread();
+
+  // Let handle_dbus_io return connection_lost instead of throwing when the connection is lost.
+  void enable_reconnect() { m_reconnect.store(true, std::memory_order_relaxed); }
+  bool reconnect_enabled() const { return m_reconnect.load(std::memory_order_relaxed); }
+
+  // Return true if this connection was fully set up (authenticated and the Hello call returned).
+  // Only call this while holding the connection lock.
+  bool is_established() const { return m_established; }
+
+  // Copy the process budget from a connection that this connection replaces.
+  // The statistics are kept by task::DBusHandleIO (see dbus::ConnectionMetrics) and therefore survive reconnecting.
+  void inherit_settings(Connection const& lost_connection)
+  {
+    m_max_messages_per_wakeup = lost_connection.m_max_messages_per_wakeup;
+    m_max_time_per_wakeup = lost_connection.m_max_time_per_wakeup;
+  }
+
+  // Close and release the sd_bus (and stop the timeout timer). Pending method calls are dropped without calling their callback.
+  void close_bus();
+
   sd_bus* get_bus() { return m_bus; }
   std::string get_unique_name() const
   {
+    // Peer-to-peer connections don't have a unique name.
+    if (!m_bus_client)
+      return {};
     char const* unique_name;
     int ret = sd_bus_get_unique_name(m_bus, &unique_name);
     if (ret < 0)
@@ -84,7 +171,9 @@ class Connection : public evio::RawInputDevice, public evio::RawOutputDevice
   enum HandleIOResult {
     needs_relock,
     io_handled,
-    unlocked_and_io_handled
+    unlocked_and_io_handled,
+    budget_exhausted,                   // There is (possibly) more to process, but the lock should be given to others first.
+    connection_lost                     // The connection was lost and reconnecting is enabled.
   };
 
   void unset_unlocked_in_callback()
@@ -108,8 +197,8 @@ class Connection : public evio::RawInputDevice, public evio::RawOutputDevice
  protected:
   void read_from_fd(int& allow_deletion_count, int fd) override;
   void write_to_fd(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override;
-  void hup(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override { DoutEntering(dc::notice, "dbus::Connection::hup"); }
-  void err(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override { DoutEntering(dc::notice, "dbus::Connection::err"); close(); }
+  void hup(int& allow_deletion_count, int fd) override;
+  void err(int& allow_deletion_count, int fd) override;
 };
 
 } // namespace dbus
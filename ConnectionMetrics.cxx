@@ -0,0 +1,128 @@
+#include "sys.h"
+#include "ConnectionMetrics.h"
+#include <algorithm>
+#include <mutex>
+#include <ostream>
+
+namespace dbus {
+
+namespace {
+
+// The global list of ConnectionMetrics objects.
+std::mutex s_registry_mutex;
+ConnectionMetrics* s_registry_head;
+
+} // namespace
+
+ConnectionMetrics::ConnectionMetrics() : m_prev(nullptr)
+{
+  for (int type = 0; type < ConnectionMetricsSnapshot::number_of_message_types; ++type)
+  {
+    m_messages_in[type].store(0, std::memory_order_relaxed);
+    m_messages_out[type].store(0, std::memory_order_relaxed);
+  }
+  for (counter_type* counter : { &m_wakeups, &m_process_iterations, &m_max_iterations_per_wakeup, &m_budget_exhausted, &m_lock_acquisitions,
+      &m_lock_handoffs, &m_io_lock_wait_usec, &m_io_lock_hold_usec, &m_reconnects, &m_read_queue_depth, &m_write_queue_depth })
+    counter->store(0, std::memory_order_relaxed);
+  m_outstanding_replies.store(0, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(s_registry_mutex);
+  m_next = s_registry_head;
+  if (m_next)
+    m_next->m_prev = this;
+  s_registry_head = this;
+}
+
+ConnectionMetrics::~ConnectionMetrics()
+{
+  std::lock_guard<std::mutex> lock(s_registry_mutex);
+  if (m_prev)
+    m_prev->m_next = m_next;
+  else
+    s_registry_head = m_next;
+  if (m_next)
+    m_next->m_prev = m_prev;
+}
+
+void ConnectionMetrics::set_description(std::string description)
+{
+  std::lock_guard<std::mutex> lock(s_registry_mutex);
+  m_description = std::move(description);
+}
+
+ConnectionMetricsSnapshot ConnectionMetrics::snapshot() const
+{
+  ConnectionMetricsSnapshot snapshot;
+  for (int type = 0; type < ConnectionMetricsSnapshot::number_of_message_types; ++type)
+  {
+    snapshot.m_messages_in[type] = m_messages_in[type].load(std::memory_order_relaxed);
+    snapshot.m_messages_out[type] = m_messages_out[type].load(std::memory_order_relaxed);
+  }
+  snapshot.m_wakeups = m_wakeups.load(std::memory_order_relaxed);
+  snapshot.m_process_iterations = m_process_iterations.load(std::memory_order_relaxed);
+  snapshot.m_max_iterations_per_wakeup = m_max_iterations_per_wakeup.load(std::memory_order_relaxed);
+  snapshot.m_budget_exhausted = m_budget_exhausted.load(std::memory_order_relaxed);
+  snapshot.m_lock_acquisitions = m_lock_acquisitions.load(std::memory_order_relaxed);
+  snapshot.m_lock_handoffs = m_lock_handoffs.load(std::memory_order_relaxed);
+  snapshot.m_io_lock_wait_usec = m_io_lock_wait_usec.load(std::memory_order_relaxed);
+  snapshot.m_io_lock_hold_usec = m_io_lock_hold_usec.load(std::memory_order_relaxed);
+  snapshot.m_reconnects = m_reconnects.load(std::memory_order_relaxed);
+  snapshot.m_outstanding_replies = m_outstanding_replies.load(std::memory_order_relaxed);
+  snapshot.m_read_queue_depth = m_read_queue_depth.load(std::memory_order_relaxed);
+  snapshot.m_write_queue_depth = m_write_queue_depth.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+//static
+void ConnectionMetrics::for_each(std::function<void(std::string const&, ConnectionMetricsSnapshot const&)> const& func)
+{
+  std::lock_guard<std::mutex> lock(s_registry_mutex);
+  for (ConnectionMetrics* metrics = s_registry_head; metrics; metrics = metrics->m_next)
+    func(metrics->m_description, metrics->snapshot());
+}
+
+ConnectionMetricsSnapshot& ConnectionMetricsSnapshot::operator+=(ConnectionMetricsSnapshot const& other)
+{
+  for (int type = 0; type < number_of_message_types; ++type)
+  {
+    m_messages_in[type] += other.m_messages_in[type];
+    m_messages_out[type] += other.m_messages_out[type];
+  }
+  m_wakeups += other.m_wakeups;
+  m_process_iterations += other.m_process_iterations;
+  m_max_iterations_per_wakeup = std::max(m_max_iterations_per_wakeup, other.m_max_iterations_per_wakeup);
+  m_budget_exhausted += other.m_budget_exhausted;
+  m_lock_acquisitions += other.m_lock_acquisitions;
+  m_lock_handoffs += other.m_lock_handoffs;
+  m_io_lock_wait_usec += other.m_io_lock_wait_usec;
+  m_io_lock_hold_usec += other.m_io_lock_hold_usec;
+  m_reconnects += other.m_reconnects;
+  m_outstanding_replies += other.m_outstanding_replies;
+  m_read_queue_depth += other.m_read_queue_depth;
+  m_write_queue_depth += other.m_write_queue_depth;
+  return *this;
+}
+
+void ConnectionMetricsSnapshot::print_on(std::ostream& os) const
+{
+  static char const* const type_names[number_of_message_types] = { "method_call", "method_return", "method_error", "signal" };
+  os << "{messages_in:{";
+  for (int type = 0; type < number_of_message_types; ++type)
+    os << (type ? ", " : "") << type_names[type] << ':' << m_messages_in[type];
+  os << "}, messages_out:{";
+  for (int type = 0; type < number_of_message_types; ++type)
+    os << (type ? ", " : "") << type_names[type] << ':' << m_messages_out[type];
+  os << "}, wakeups:" << m_wakeups <<
+    ", process_iterations:" << m_process_iterations <<
+    ", max_iterations_per_wakeup:" << m_max_iterations_per_wakeup <<
+    ", budget_exhausted:" << m_budget_exhausted <<
+    ", lock_acquisitions:" << m_lock_acquisitions <<
+    ", lock_handoffs:" << m_lock_handoffs <<
+    ", io_lock_wait_usec:" << m_io_lock_wait_usec <<
+    ", io_lock_hold_usec:" << m_io_lock_hold_usec <<
+    ", reconnects:" << m_reconnects <<
+    ", outstanding_replies:" << m_outstanding_replies <<
+    ", read_queue_depth:" << m_read_queue_depth <<
+    ", write_queue_depth:" << m_write_queue_depth << '}';
+}
+
+} // namespace dbus
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include "debug.h"
+
+namespace dbus {
+
+// A copy of the values of a ConnectionMetrics object.
+struct ConnectionMetricsSnapshot
+{
+  // Indices of m_messages_in and m_messages_out.
+  enum { method_call, method_return, method_error, signal, number_of_message_types };
+
+  // Counters.
+  uint64_t m_messages_in[number_of_message_types];      // Received messages, by type.
+  uint64_t m_messages_out[number_of_message_types];     // Sent messages, by type (only those sent by task::DBusMethodCall and task::DBusHandleIO).
+  uint64_t m_wakeups;                                   // The number of calls to Connection::handle_dbus_io.
+  uint64_t m_process_iterations;                        // The number of calls to sd_bus_process.
+  uint64_t m_max_iterations_per_wakeup;                 // The largest number of calls to sd_bus_process during a single wakeup.
+  uint64_t m_budget_exhausted;                          // The number of times that the process budget ran out.
+  uint64_t m_lock_acquisitions;                         // The number of times the connection lock was requested.
+  uint64_t m_lock_handoffs;                             // The number of times the lock was busy, so that it was handed over later.
+  uint64_t m_io_lock_wait_usec;                         // The total time that task::DBusHandleIO waited for the connection lock.
+  uint64_t m_io_lock_hold_usec;                         // The total time that task::DBusHandleIO held the connection lock.
+  uint64_t m_reconnects;                                // The number of times the connection was replaced after it was lost.
+
+  // Gauges.
+  int64_t m_outstanding_replies;                        // Method calls that are waiting for a reply.
+  uint64_t m_read_queue_depth;                          // Received messages that were not processed yet (as of the last wakeup).
+  uint64_t m_write_queue_depth;                         // Messages that were not written yet (as of the last wakeup).
+
+  // Add other to this; for example to get the totals of a connection pool.
+  // The maximum is taken of m_max_iterations_per_wakeup, everything else is added.
+  ConnectionMetricsSnapshot& operator+=(ConnectionMetricsSnapshot const& other);
+
+  void print_on(std::ostream& os) const;
+};
+
+inline std::ostream& operator<<(std::ostream& os, ConnectionMetricsSnapshot const& snapshot) { snapshot.print_on(os); return os; }
+
+// The metrics of one connection (task::DBusHandleIO).
+//
+// All counters are updated with relaxed atomics, so they are cheap to update but a snapshot
+// is not necessarily consistent between different counters.
+//
+// Every ConnectionMetrics object is registered in a global list, see for_each.
+class ConnectionMetrics
+{
+  using counter_type = std::atomic<uint64_t>;
+
+ private:
+  counter_type m_messages_in[ConnectionMetricsSnapshot::number_of_message_types];
+  counter_type m_messages_out[ConnectionMetricsSnapshot::number_of_message_types];
+  counter_type m_wakeups;
+  counter_type m_process_iterations;
+  counter_type m_max_iterations_per_wakeup;
+  counter_type m_budget_exhausted;
+  counter_type m_lock_acquisitions;
+  counter_type m_lock_handoffs;
+  counter_type m_io_lock_wait_usec;
+  counter_type m_io_lock_hold_usec;
+  counter_type m_reconnects;
+  std::atomic<int64_t> m_outstanding_replies;
+  counter_type m_read_queue_depth;
+  counter_type m_write_queue_depth;
+
+  // The global list of ConnectionMetrics objects; protected by a global mutex.
+  ConnectionMetrics* m_prev;
+  ConnectionMetrics* m_next;
+  std::string m_description;                            // The description of the connection.
+
+  static void add(counter_type& counter, uint64_t n = 1) { counter.fetch_add(n, std::memory_order_relaxed); }
+  static uint64_t usec(std::chrono::steady_clock::duration duration) { return std::chrono::duration_cast<std::chrono::microseconds>(duration).count(); }
+
+ public:
+  ConnectionMetrics();
+  ConnectionMetrics(ConnectionMetrics const&) = delete;
+  ~ConnectionMetrics();
+
+  // Convert the type returned by sd_bus_message_get_type to an index of m_messages_in / m_messages_out.
+  static int index(uint8_t type) { return (type - 1) & 3; }
+
+  void received(uint8_t type) { add(m_messages_in[index(type)]); }
+  void sent(uint8_t type) { add(m_messages_out[index(type)]); }
+
+  // Called at the end of every Connection::handle_dbus_io.
+  void wakeup(uint64_t iterations)
+  {
+    add(m_wakeups);
+    add(m_process_iterations, iterations);
+    uint64_t max = m_max_iterations_per_wakeup.load(std::memory_order_relaxed);
+    while (iterations > max && !m_max_iterations_per_wakeup.compare_exchange_weak(max, iterations, std::memory_order_relaxed))
+      ;
+  }
+  void budget_exhausted() { add(m_budget_exhausted); }
+  uint64_t budget_exhausted_count() const { return m_budget_exhausted.load(std::memory_order_relaxed); }
+
+  void queue_depths(uint64_t read_queue_depth, uint64_t write_queue_depth)
+  {
+    m_read_queue_depth.store(read_queue_depth, std::memory_order_relaxed);
+    m_write_queue_depth.store(write_queue_depth, std::memory_order_relaxed);
+  }
+
+  void lock_requested(bool obtained)
+  {
+    add(m_lock_acquisitions);
+    if (!obtained)
+      add(m_lock_handoffs);
+  }
+  void io_lock_waited(std::chrono::steady_clock::duration duration) { add(m_io_lock_wait_usec, usec(duration)); }
+  void io_lock_held(std::chrono::steady_clock::duration duration) { add(m_io_lock_hold_usec, usec(duration)); }
+
+  void reconnected() { add(m_reconnects); }
+
+  void reply_pending() { m_outstanding_replies.fetch_add(1, std::memory_order_relaxed); }
+  void reply_done() { m_outstanding_replies.fetch_sub(1, std::memory_order_relaxed); }
+
+  // Set the description that is passed to for_each.
+  void set_description(std::string description);
+
+  ConnectionMetricsSnapshot snapshot() const;
+
+  // Call func(description, snapshot) for every existing connection.
+  static void for_each(std::function<void(std::string const&, ConnectionMetricsSnapshot const&)> const& func);
+};
+
+} // namespace dbus
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <limits>
+#include "debug.h"
+
+namespace dbus {
+
+// How a connection of a pool is selected.
+enum class PoolPolicy
+{
+  round_robin,          // Use the connections in turn.
+  least_in_flight       // Use the connection with the least number of tasks that are currently using it.
+};
+
+// The state shared by all copies of a DBusConnectionBrokerKey that uses a connection pool.
+class ConnectionPool
+{
+ private:
+  unsigned int const m_size;                                    // The number of connections in the pool.
+  PoolPolicy const m_policy;                                    // How the next connection is selected.
+  std::atomic<unsigned int> m_next;                             // The next connection to use (round_robin).
+  std::unique_ptr<std::atomic<int>[]> m_in_flight;              // The number of tasks that are using each connection.
+
+ public:
+  ConnectionPool(unsigned int size, PoolPolicy policy) : m_size(size), m_policy(policy), m_next(0), m_in_flight(new std::atomic<int>[size])
+  {
+    // A pool must have at least one connection.
+    ASSERT(size > 0);
+    for (unsigned int shard = 0; shard < size; ++shard)
+      m_in_flight[shard].store(0, std::memory_order_relaxed);
+  }
+
+  unsigned int size() const { return m_size; }
+
+  // Select the connection to use. Every call to acquire must be followed by a call to release(shard).
+  unsigned int acquire()
+  {
+    unsigned int shard;
+    if (m_policy == PoolPolicy::round_robin)
+      shard = m_next.fetch_add(1, std::memory_order_relaxed) % m_size;
+    else
+    {
+      // The counts can change while we're looking at them; that only makes the choice slightly less than optimal.
+      shard = 0;
+      int least = std::numeric_limits<int>::max();
+      for (unsigned int s = 0; s < m_size; ++s)
+      {
+        int in_flight = m_in_flight[s].load(std::memory_order_relaxed);
+        if (in_flight < least)
+        {
+          least = in_flight;
+          shard = s;
+        }
+      }
+    }
+    m_in_flight[shard].fetch_add(1, std::memory_order_relaxed);
+    return shard;
+  }
+
+  void release(unsigned int shard)
+  {
+    m_in_flight[shard].fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  int in_flight(unsigned int shard) const
+  {
+    return m_in_flight[shard].load(std::memory_order_relaxed);
+  }
+};
+
+} // namespace dbus
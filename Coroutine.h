@@ -0,0 +1,39 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include "debug.h"
+
+namespace dbus {
+
+// The return type of a fire-and-forget coroutine.
+//
+// The coroutine starts running immediately and destroys itself when it returns.
+// For example,
+//
+//   dbus::Coroutine pipeline(task::DBusMethodCallPool* pool)
+//   {
+//     uint32_t id = co_await dbus::co_call<uint32_t>(pool, [](dbus::Message& message){ message.append("foo"); });
+//     std::string name = co_await dbus::co_call<std::string>(other_pool, [id](dbus::Message& message){ message.append(id); });
+//     ...
+//   }
+//
+// Exceptions must be caught inside the coroutine: there is nobody to pass them to.
+struct Coroutine
+{
+  struct promise_type
+  {
+    Coroutine get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept { }
+    void unhandled_exception() noexcept
+    {
+      // An exception escaped from a dbus::Coroutine.
+      ASSERT(false);
+      std::terminate();
+    }
+  };
+};
+
+} // namespace dbus
@@ -2,6 +2,7 @@
 #include "DBusConnection.h"
 #include "Message.h"
 #include "Error.h"
+#include <sstream>
 
 namespace task {
 
@@ -10,7 +11,7 @@ char const* DBusConnection::condition_str_impl(condition_type condition) const
   switch (condition)
   {
     AI_CASE_RETURN(request_name_callback);
-    AI_CASE_RETURN(connection_locked);
+    AI_CASE_RETURN(connected);
   }
   return direct_base_type::condition_str_impl(condition);
 }
@@ -20,11 +21,9 @@ char const* DBusConnection::state_str_impl(state_type run_state) const
   switch(run_state)
   {
     AI_CASE_RETURN(DBusConnection_start);
-    AI_CASE_RETURN(DBusConnection_done);
-    AI_CASE_RETURN(DBusConnection_request_name_async_wait_for_lock);
-    AI_CASE_RETURN(DBusConnection_request_name_async);
-    AI_CASE_RETURN(DBusConnection_wait_for_request_name_result_wait_for_lock);
+    AI_CASE_RETURN(DBusConnection_wait_for_connected);
     AI_CASE_RETURN(DBusConnection_wait_for_request_name_result);
+    AI_CASE_RETURN(DBusConnection_done);
   }
   AI_NEVER_REACHED;
 }
@@ -38,7 +37,9 @@ void DBusConnection::initialize_impl()
 {
   DoutEntering(dc::statefultask(mSMDebug), "DBusConnection::initialize_impl() [" << (void*)this << "]");
   m_slot = nullptr;
-  m_request_name_async_callback_message = nullptr;
+  m_connected_slot = nullptr;
+  m_connection_failed = false;
+  m_request_name_error = dbus::Error();
   set_state(DBusConnection_start);
   // This isn't going to work. Please call GetAddrInfo::run() with a non-immediate handler,
   // for example resolver::DnsResolver::instance().get_handler();
@@ -47,8 +48,15 @@ void DBusConnection::initialize_impl()
 
 int DBusConnection::request_name_async_callback(sd_bus_message* message)
 {
-  sd_bus_message_ref(message);
-  m_request_name_async_callback_message = message;
+  DoutEntering(dc::dbus, "DBusConnection::request_name_async_callback()");
+  // Handle the reply here, while we have the lock anyway.
+  int is_error = sd_bus_message_is_method_error(message, nullptr);
+  if (is_error < 0)
+    m_request_name_error = dbus::Error(std::string("org.freedesktop.DBus.Error.Failed"), std::string("sd_bus_message_is_method_error failed"));
+  else if (is_error)
+    m_request_name_error = sd_bus_message_get_error(message);
+  sd_bus_slot_unref(m_slot);
+  m_slot = nullptr;
   signal(request_name_callback);
   return 0;
 }
@@ -58,108 +66,112 @@ int DBusConnection::s_request_name_async_callback(sd_bus_message* message, void*
   return static_cast<DBusConnection*>(userdata)->request_name_async_callback(message);
 }
 
+int DBusConnection::connected_filter(sd_bus_message* message)
+{
+  bool is_connected = sd_bus_message_is_signal(message, "org.freedesktop.DBus.Local", "Connected") > 0;
+  if (is_connected || sd_bus_message_is_signal(message, "org.freedesktop.DBus.Local", "Disconnected") > 0)
+  {
+    Dout(dc::dbus, "DBusConnection::connected_filter: " << (is_connected ? "connected" : "disconnected"));
+    m_connection_failed = !is_connected;
+    sd_bus_slot_unref(m_connected_slot);
+    m_connected_slot = nullptr;
+    signal(connected);
+  }
+  // Let others see the message too.
+  return 0;
+}
+
+int DBusConnection::s_connected_filter(sd_bus_message* message, void* userdata, sd_bus_error* UNUSED_ARG(ret_error))
+{
+  return static_cast<DBusConnection*>(userdata)->connected_filter(message);
+}
+
 // The sd_bus that is created by this task can not be used by other tasks until this tasked finished.
-// Therefore it is not needed to do connection/bus locking.
 void DBusConnection::multiplex_impl(state_type run_state)
 {
   switch (run_state)
   {
     case DBusConnection_start:
-      // FIXME?
-      // This call could be blocking if the environment variable DBUS_SESSION_BUS_ADDRESS is
-      // set to point to remote connection. In that case libsystemd will resolve the host
-      // name and blocking connect to the socket using ssh :/.
+    {
       AI_REACHED_ONCE;
       m_handle_io = statefultask::create<task::DBusHandleIO>(CWDEBUG_ONLY(mSMDebug));
-      if (m_use_system_bus)
-        m_handle_io->connection()->connect_system("DBusConnection - system");
-      else
-        m_handle_io->connection()->connect_user("DBusConnection - user");
-      m_handle_io->run();
-      if (!m_service_name.empty())
       {
-        // Now that m_handle_io is running we can't just start calling sd_bus_* functions anymore,
-        // because sd_bus is single threaded :(. Therefore obtain the task mutex before continuing.
-        set_state(DBusConnection_request_name_async_wait_for_lock);
-        break;
+        // Let the metrics be recognizable in dbus::ConnectionMetrics::for_each.
+        std::ostringstream description;
+        DBusConnectionData::print_on(description);
+        m_handle_io->metrics().set_description(description.str());
       }
-      set_state(DBusConnection_done);
-      [[fallthrough]];
-    case DBusConnection_done:
-      finish();
-      break;
-    case DBusConnection_request_name_async_wait_for_lock:
-      set_state(DBusConnection_request_name_async);
-      if (!m_handle_io->lock(this, connection_locked))
+      m_handle_io->connection()->set_process_budget(m_max_messages_per_wakeup, m_max_time_per_wakeup);
+      // This does not block (for unix socket addresses): it only starts connecting.
+      m_handle_io->set_bus(m_use_system_bus, m_address, m_bus_client);
+      m_handle_io->connect();
+      if (m_use_pinned_io_thread)
+        m_handle_io->use_pinned_io_thread(m_pinned_cpu, m_spin_period);
+      m_handle_io->set_reconnect_policy(m_reconnect_policy, m_service_name, m_flags);
+      // As long as m_handle_io isn't running yet, nobody else uses the bus and we don't need the lock.
+      sd_bus* bus = m_handle_io->connection()->get_bus();
+      int ret = sd_bus_add_filter(bus, &m_connected_slot, &DBusConnection::s_connected_filter, this);
+      if (ret < 0)
+        THROW_ALERTC(-ret, "sd_bus_add_filter");
+      if (!m_service_name.empty())
       {
-        wait(connection_locked);
-        break;
+        // Pipeline the name request right behind the Hello call.
+        ret = sd_bus_request_name_async(bus, &m_slot, m_service_name.c_str(), m_flags, &DBusConnection::s_request_name_async_callback, this);
+        if (ret < 0)
+          THROW_ALERTC(-ret, "sd_bus_request_name_async");
+        m_handle_io->metrics().sent(SD_BUS_MESSAGE_METHOD_CALL);
       }
-      [[fallthrough]];
-    case DBusConnection_request_name_async:
-    {
-      statefultask::AdoptLock lock(mutex());
-      set_state(DBusConnection_wait_for_request_name_result_wait_for_lock);
-      sd_bus_request_name_async(m_handle_io->connection()->get_bus(), &m_slot, m_service_name.c_str(), m_flags, &DBusConnection::s_request_name_async_callback, this);
-      wait(request_name_callback);
+      // From now on sd_bus is driven by m_handle_io and may only be used while holding the lock.
+      m_handle_io->run();
+      set_state(DBusConnection_wait_for_connected);
+      wait(connected);
       break;
     }
-    case DBusConnection_wait_for_request_name_result_wait_for_lock:
-      set_state(DBusConnection_wait_for_request_name_result);
-      if (!m_handle_io->lock(this, connection_locked))
+    case DBusConnection_wait_for_connected:
+      if (m_connection_failed)
       {
-        wait(connection_locked);
-        break;
+        if (!m_address.empty())
+          THROW_FALERT("Failed to connect to \"[ADDRESS]\".", AIArgs("[ADDRESS]", m_address));
+        THROW_FALERT("Failed to connect to the [BUS] bus.", AIArgs("[BUS]", m_use_system_bus ? "system" : "user"));
       }
-      [[fallthrough]];
-    case DBusConnection_wait_for_request_name_result:
-    {
-      statefultask::AdoptLock lock(mutex());
-      int is_error = sd_bus_message_is_method_error(m_request_name_async_callback_message, nullptr);
-      if (is_error < 0)
-        THROW_FALERTC(-is_error, "sd_bus_message_is_method_error");
-      if (is_error)
+      if (m_service_name.empty())
       {
-        sd_bus_error const* error = sd_bus_message_get_error(m_request_name_async_callback_message);
-        dbus::Error dbus_error = error;
-        sd_bus_message_unref(m_request_name_async_callback_message);
-        m_request_name_async_callback_message = nullptr;
-        THROW_FALERT("[ERROR]", AIArgs("[ERROR]", dbus_error));
-        abort();
-      }
-#if 0
-      else
-      {
-        dbus::MessageRead message(m_request_name_async_callback_message, m_handle_io->connection()->get_bus());
-        std::string s;
-        message >> s;
-        Dout(dc::notice, "Received message: " << s);
+        set_state(DBusConnection_done);
+        break;
       }
-#endif
-      sd_bus_message_unref(m_request_name_async_callback_message);
-      m_request_name_async_callback_message = nullptr;
+      set_state(DBusConnection_wait_for_request_name_result);
+      wait(request_name_callback);
+      break;
+    case DBusConnection_wait_for_request_name_result:
+      if (m_request_name_error.is_set())
+        THROW_FALERT("[ERROR]", AIArgs("[ERROR]", m_request_name_error));
       set_state(DBusConnection_done);
+      [[fallthrough]];
+    case DBusConnection_done:
+      // From now on, losing the connection causes m_handle_io to reconnect (if so configured).
+      m_handle_io->enable_reconnect();
+      finish();
       break;
-    }
-  }
-}
-
-void DBusConnection::finish_impl()
-{
-  if (m_slot)
-  {
-    // Make sure DBusConnection::s_request_name_async_callback is never called (in case we get here after an abort()).
-    sd_bus_slot_unref(m_slot);
-    m_slot = nullptr;
   }
 }
 
 void DBusConnection::abort_impl()
 {
-  if (m_request_name_async_callback_message)
+  if (m_slot || m_connected_slot)
   {
-    sd_bus_message_unref(m_request_name_async_callback_message);
-    m_request_name_async_callback_message = nullptr;
+    // Make sure that the callbacks are never called (anymore).
+    // Scoped, blocking lock.
+    DBusLock lock(this, true COMMA_CWDEBUG_ONLY(mSMDebug));
+    if (m_slot)
+    {
+      sd_bus_slot_unref(m_slot);
+      m_slot = nullptr;
+    }
+    if (m_connected_slot)
+    {
+      sd_bus_slot_unref(m_connected_slot);
+      m_connected_slot = nullptr;
+    }
   }
   if (m_handle_io)
   {
@@ -173,6 +185,12 @@ void DBusConnectionData::initialize(DBusConnection& dbus_connection) const
   if (!m_service_name.empty())
     dbus_connection.request_service_name(m_service_name, m_flags);
   dbus_connection.set_use_system_bus(m_use_system_bus);
+  if (!m_address.empty())
+    dbus_connection.set_address(m_address, m_bus_client);
+  dbus_connection.set_process_budget(m_max_messages_per_wakeup, m_max_time_per_wakeup);
+  if (m_use_pinned_io_thread)
+    dbus_connection.set_pinned_io_thread(m_pinned_cpu, m_spin_period);
+  dbus_connection.set_reconnect_policy(m_reconnect_policy);
 }
 
 } // namespace task
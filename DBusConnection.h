@@ -2,6 +2,8 @@
 
 #include "Interface.h"
 #include "DBusHandleIO.h"
+#include "ConnectionPool.h"
+#include "Error.h"
 #include "statefultask/AIStatefulTask.h"
 #include "block-task/BlockingTaskMutex.h"
 #include "debug.h"
@@ -19,17 +21,35 @@ class DBusConnectionData
   std::string m_service_name;                                   // Requested "well known" service name, if any (if this is a service).
   int m_flags;                                                  // Flags specifying how to handle duplicated service name requests.
   bool m_use_system_bus;                                        // Use system bus if true, user bus otherwise.
+  std::string m_address;                                        // Connect to this address instead, if not empty.
+  bool m_bus_client;                                            // False if m_address is the address of a peer (not a bus).
+  unsigned int m_shard;                                         // The index of the connection in the connection pool, if any.
+
+  // The connection pool, if any. Not part of the identity of a connection.
+  std::shared_ptr<dbus::ConnectionPool> m_pool;
+
+  // Tuning parameters. These are not part of the identity of a connection (not used by operator== or the hash).
+  unsigned int m_max_messages_per_wakeup;                       // See dbus::Connection::set_process_budget.
+  std::chrono::microseconds m_max_time_per_wakeup;
+  bool m_use_pinned_io_thread;                                  // See dbus::Connection::use_pinned_io_thread.
+  int m_pinned_cpu;
+  std::chrono::microseconds m_spin_period;
+  dbus::ReconnectPolicy m_reconnect_policy;                     // See set_reconnect_policy.
 
   // Set m_flags to zero because when request_service_name is
   // not called then it is still used to calculate a hash.
-  DBusConnectionData() : m_flags(0), m_use_system_bus(false) { }
+  DBusConnectionData() : m_flags(0), m_use_system_bus(false), m_bus_client(true), m_shard(0),
+    m_max_messages_per_wakeup(dbus::Connection::default_max_messages_per_wakeup),
+    m_max_time_per_wakeup(dbus::Connection::default_max_time_per_wakeup),
+    m_use_pinned_io_thread(false), m_pinned_cpu(-1), m_spin_period(0) { }
 
   // Used by DBusConnectionBrokerKey.
   void initialize(DBusConnection& dbus_connection) const;
 
   bool operator==(DBusConnectionData const& other) const
   {
-    return m_service_name == other.m_service_name && m_flags == other.m_flags && m_use_system_bus == other.m_use_system_bus;
+    return m_service_name == other.m_service_name && m_flags == other.m_flags && m_use_system_bus == other.m_use_system_bus &&
+      m_address == other.m_address && m_bus_client == other.m_bus_client && m_shard == other.m_shard;
   }
 
   void print_on(std::ostream& os) const
@@ -62,6 +82,14 @@ class DBusConnectionData
       }
       os << ", use_system_bus:" << std::boolalpha << m_use_system_bus;
     }
+    char const* prefix = m_service_name.empty() ? "" : ", ";
+    if (!m_address.empty())
+    {
+      os << prefix << "address:\"" << m_address << "\", bus_client:" << std::boolalpha << m_bus_client;
+      prefix = ", ";
+    }
+    if (m_pool)
+      os << prefix << "shard:" << m_shard << '/' << m_pool->size();
     os << '}';
   }
 
@@ -82,26 +110,99 @@ class DBusConnectionData
   //   SD_BUS_NAME_QUEUE
   //       Queue the acquisition of the name when the name is already taken.
   //
-  void request_service_name(std::string service_name, int flags = 0) { m_service_name = std::move(service_name); m_flags = flags; }
+  void request_service_name(std::string service_name, int flags = 0)
+  {
+    // A service name can only be owned by a single connection (see set_connection_pool).
+    ASSERT(!m_pool);
+    m_service_name = std::move(service_name);
+    m_flags = flags;
+  }
 
   /// Set if this connection should be to the system bus or the user bus.
   void set_use_system_bus(bool use_system_bus) { m_use_system_bus = use_system_bus; }
+
+  /// Connect to address (for example "unix:path=/run/my_service.socket") instead of to the system bus or the user bus.
+  //
+  // By default this is a peer-to-peer connection, for example to a task::DBusServer. Pass bus_client = true
+  // if address is the address of a bus. A service name can only be requested on a bus.
+  void set_address(std::string address, bool bus_client = false) { m_address = std::move(address); m_bus_client = bus_client; }
+
+  /// Use a pool of pool_size connections instead of a single connection.
+  //
+  // This is only allowed for client-only keys (that do not request a service name).
+  // Each task that uses this key picks one of the connections according to policy.
+  void set_connection_pool(unsigned int pool_size, dbus::PoolPolicy policy = dbus::PoolPolicy::round_robin)
+  {
+    // A service name can only be owned by a single connection.
+    ASSERT(m_service_name.empty());
+    if (pool_size > 1)
+      m_pool = std::make_shared<dbus::ConnectionPool>(pool_size, policy);
+    else
+      m_pool.reset();
+  }
+
+  /// Return true if set_connection_pool was called with a pool_size larger than one.
+  bool is_pooled() const { return static_cast<bool>(m_pool); }
+
+  /// Release the connection with index shard, as returned by DBusConnectionBrokerKey::acquire_pool_connection.
+  void release_pool_connection(unsigned int shard) const { m_pool->release(shard); }
+
+  /// Limit the number of incoming messages (max_messages) and the time (max_time) that are processed per wakeup while holding the connection lock.
+  //
+  // When the budget runs out the connection lock is given back to other tasks that are waiting for it
+  // before processing continues. Passing zero for either means no limit for that aspect.
+  //
+  // This is a tuning parameter: it is not part of the broker key identity, the key that creates the connection determines its value.
+  void set_process_budget(unsigned int max_messages, std::chrono::microseconds max_time)
+  {
+    m_max_messages_per_wakeup = max_messages;
+    m_max_time_per_wakeup = max_time;
+  }
+
+  /// Let the I/O of this connection be done by a dedicated thread that is pinned to cpu (or not pinned if cpu is -1).
+  //
+  // This is meant for latency critical connections: the dedicated thread runs the I/O task of the connection
+  // directly instead of going through the EventLoop thread, and it busy-polls the socket for spin_period
+  // after every wakeup before blocking again.
+  //
+  // This is a tuning parameter: it is not part of the broker key identity.
+  void set_pinned_io_thread(int cpu, std::chrono::microseconds spin_period = std::chrono::microseconds{0})
+  {
+    m_use_pinned_io_thread = true;
+    m_pinned_cpu = cpu;
+    m_spin_period = spin_period;
+  }
+
+  /// Reconnect automatically, according to policy, when the connection to the bus is lost.
+  //
+  // After reconnecting the service name is requested again, objects (task::DBusObject) and signal matches
+  // (task::DBusMatchSignal) are installed again and method calls (task::DBusMethodCall) that were waiting
+  // for a reply are sent again or fail, depending on policy.m_in_flight. Tasks that need the connection
+  // lock while the connection is down have to wait until the connection is restored.
+  //
+  // This is a tuning parameter: it is not part of the broker key identity.
+  void set_reconnect_policy(dbus::ReconnectPolicy const& policy)
+  {
+    m_reconnect_policy = policy;
+  }
 };
 
 class DBusConnection : public AIStatefulTask, public DBusConnectionData
 {
  public:
   static constexpr condition_type request_name_callback = 1;
-  static constexpr condition_type connection_locked = 2;
+  static constexpr condition_type connected = 2;
 
  private:
   // Wrapped data.
   boost::intrusive_ptr<DBusHandleIO> m_handle_io;               // Pointer to the task containing the statefultask mutex.
 
   // Internal usage:
-  sd_bus_slot* m_slot;                                          // To cancel a connection upon abort.
-  sd_bus_message* m_request_name_async_callback_message;        // To tranfer service name request reply message from request_name_async_callback
-                                                                // to state machine (DBusConnection_wait_for_request_name_result).
+  sd_bus_slot* m_slot;                                          // To cancel the service name request upon abort.
+  sd_bus_slot* m_connected_slot;                                // To remove the filter that waits for the Connected signal.
+  bool m_connection_failed;                                     // Set when the bus was disconnected before it was connected.
+  dbus::Error m_request_name_error;                             // The error returned by the service name request, if any.
+
  protected:
   /// The base class of this task.
   using direct_base_type = AIStatefulTask;
@@ -109,16 +210,14 @@ class DBusConnection : public AIStatefulTask, public DBusConnectionData
   /// The different states of the stateful task.
   enum DBusConnection_state_type {
     DBusConnection_start = direct_base_type::state_end,
-    DBusConnection_done,
-    DBusConnection_request_name_async_wait_for_lock,
-    DBusConnection_request_name_async,
-    DBusConnection_wait_for_request_name_result_wait_for_lock,
-    DBusConnection_wait_for_request_name_result
+    DBusConnection_wait_for_connected,
+    DBusConnection_wait_for_request_name_result,
+    DBusConnection_done
   };
 
  public:
   /// One beyond the largest state of this task.
-  static constexpr state_type state_end = DBusConnection_wait_for_request_name_result + 1;
+  static constexpr state_type state_end = DBusConnection_done + 1;
 
   /// Construct a DBusConnection object.
   DBusConnection(CWDEBUG_ONLY(bool debug = false)) : AIStatefulTask(CWDEBUG_ONLY(debug))
@@ -144,6 +243,40 @@ class DBusConnection : public AIStatefulTask, public DBusConnectionData
     return m_handle_io->mutex();
   }
 
+  /// Let the DBusHandleIO task of this connection call request->submit(bus) the next time it holds the connection lock.
+  /// This does not block and does not require the lock.
+  void submit(dbus::OutboundRequest* request) const
+  {
+    m_handle_io->submit(request);
+  }
+
+  /// Let the DBusHandleIO task of this connection call request->submit(bus) once delay has passed.
+  /// Must be called while holding the connection lock.
+  void schedule(dbus::OutboundRequest* request, std::chrono::microseconds delay) const
+  {
+    m_handle_io->schedule(request, delay);
+  }
+
+  /// Undo schedule for request, if it wasn't submitted yet. Returns true if it was removed.
+  /// Must be called while holding the connection lock.
+  bool unschedule(dbus::OutboundRequest* request) const
+  {
+    return m_handle_io->unschedule(request);
+  }
+
+  /// Let the DBusHandleIO task of this connection call bus_user->bus_lost and bus_user->bus_restored when reconnecting.
+  /// Must be called while holding the connection lock.
+  void register_bus_user(dbus::BusUser* bus_user) const
+  {
+    m_handle_io->register_bus_user(bus_user);
+  }
+
+  /// Undo register_bus_user. Must be called while holding the connection lock.
+  void unregister_bus_user(dbus::BusUser* bus_user) const
+  {
+    m_handle_io->unregister_bus_user(bus_user);
+  }
+
   /// Return the unique name of this connection.
   std::string get_unique_name() const
   {
@@ -154,6 +287,7 @@ class DBusConnection : public AIStatefulTask, public DBusConnectionData
 
   /// Return the underlaying sd_bus* of this connection.
   /// Only valid after the task successfully finished.
+  /// The bus is replaced when reconnecting; only use the returned pointer while holding the connection lock.
   sd_bus* get_bus() const
   {
     // The task must be successfully finished before you call this function.
@@ -161,6 +295,31 @@ class DBusConnection : public AIStatefulTask, public DBusConnectionData
     return m_handle_io->connection()->get_bus();
   }
 
+  /// Return the underlaying sd_bus* of this connection from a callback of the bus (a reply or signal callback).
+  /// Those are called from sd_bus_process while task::DBusHandleIO holds the connection lock, so the bus can't be replaced.
+  sd_bus* get_locked_bus() const
+  {
+    return m_handle_io->locked_connection().get_bus();
+  }
+
+  /// Return the number of times that the process budget of this connection ran out.
+  uint64_t budget_exhausted_count() const
+  {
+    return m_handle_io->metrics().budget_exhausted_count();
+  }
+
+  /// Return the in-flight method calls that identical calls can be attached to. Only use this while holding the connection lock.
+  std::unordered_map<std::string, DBusMethodCall*>& coalescing_table() const
+  {
+    return m_handle_io->coalescing_table();
+  }
+
+  /// Return the metrics of this connection. Use snapshot() to read them.
+  dbus::ConnectionMetrics& metrics() const
+  {
+    return m_handle_io->metrics();
+  }
+
   void terminate()
   {
     DoutEntering(dc::statefultask(mSMDebug), "DBusConnection::terminate()");
@@ -186,28 +345,36 @@ class DBusConnection : public AIStatefulTask, public DBusConnectionData
   char const* task_name_impl() const override;
   void initialize_impl() override;
   void multiplex_impl(state_type run_state) override;
-  void finish_impl() override;
   void abort_impl() override;
 
  private:
+  // These callbacks are called from sd_bus_process, while DBusHandleIO has the connection lock.
+
   // This is the callback for sd_bus_request_name_async.
   static int s_request_name_async_callback(sd_bus_message* m, void* userdata, sd_bus_error* ret_error);
   int request_name_async_callback(sd_bus_message* m);
+
+  // This filter waits for the org.freedesktop.DBus.Local.Connected signal.
+  static int s_connected_filter(sd_bus_message* m, void* userdata, sd_bus_error* ret_error);
+  int connected_filter(sd_bus_message* m);
 };
 
 class DBusLock : public statefultask::AdoptLock
 {
  public:
-  DBusLock(boost::intrusive_ptr<DBusConnection const> const& connection, bool block = false
-      COMMA_CWDEBUG_ONLY(bool debug = false)) : statefultask::AdoptLock(connection->mutex())
+  DBusLock(AIStatefulTaskMutex& mutex, bool block = false
+      COMMA_CWDEBUG_ONLY(bool debug = false)) : statefultask::AdoptLock(mutex)
   {
     if (block)
     {
       auto blocking_task_mutex = statefultask::create<task::BlockingTaskMutex>(CWDEBUG_ONLY(debug));
-      blocking_task_mutex->set_mutex(connection->mutex());
+      blocking_task_mutex->set_mutex(mutex);
       blocking_task_mutex->lock();
     }
   }
+
+  DBusLock(boost::intrusive_ptr<DBusConnection const> const& connection, bool block = false
+      COMMA_CWDEBUG_ONLY(bool debug = false)) : DBusLock(connection->mutex(), block COMMA_CWDEBUG_ONLY(debug)) { }
 };
 
 } // namespace task
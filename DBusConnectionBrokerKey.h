@@ -8,10 +8,27 @@ namespace dbus {
 
 class DBusConnectionBrokerKey : public statefultask::BrokerKey, public task::DBusConnectionData
 {
+ public:
+  // Return the key of the pool connection that should be used by the calling task
+  // and set shard to its index, which must be passed to release_pool_connection
+  // once the task is done with the connection.
+  // Only call this when is_pooled() returns true.
+  DBusConnectionBrokerKey acquire_pool_connection(unsigned int& shard) const
+  {
+    shard = m_pool->acquire();
+    DBusConnectionBrokerKey key(*this);
+    key.m_shard = shard;
+    return key;
+  }
+
  protected:
   uint64_t hash() const final
   {
-    return util::Hash64WithSeeds(m_service_name.data(), m_service_name.length(), m_use_system_bus ? 0xa38b092ee91a871fULL : 0x9ae16a3b2f90404fULL, m_flags);
+    uint64_t h = util::Hash64WithSeeds(m_service_name.data(), m_service_name.length(), m_use_system_bus ? 0xa38b092ee91a871fULL : 0x9ae16a3b2f90404fULL,
+        m_flags ^ (static_cast<uint64_t>(m_shard) << 32));
+    if (m_address.empty())
+      return h;
+    return util::Hash64WithSeeds(m_address.data(), m_address.length(), h, m_bus_client);
   }
 
   void initialize(boost::intrusive_ptr<AIStatefulTask> task) const final
@@ -1,5 +1,14 @@
 #include "sys.h"
 #include "DBusHandleIO.h"
+#include "DBusConnection.h"
+#include "Error.h"
+#include "utils/AIAlert.h"
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
 
 namespace utils { using namespace threading; }
 namespace task {
@@ -10,6 +19,7 @@ char const* DBusHandleIO::condition_str_impl(condition_type condition) const
   {
     AI_CASE_RETURN(have_dbus_io);
     AI_CASE_RETURN(connection_locked);
+    AI_CASE_RETURN(backoff_timer_expired);
   }
   return direct_base_type::condition_str_impl(condition);
 }
@@ -21,6 +31,7 @@ char const* DBusHandleIO::state_str_impl(state_type run_state) const
     AI_CASE_RETURN(DBusHandleIO_start);
     AI_CASE_RETURN(DBusHandleIO_wait_for_lock);
     AI_CASE_RETURN(DBusHandleIO_locked);
+    AI_CASE_RETURN(DBusHandleIO_reconnect);
     AI_CASE_RETURN(DBusHandleIO_done);
   }
   AI_NEVER_REACHED;
@@ -31,6 +42,233 @@ char const* DBusHandleIO::task_name_impl() const
   return "DBusHandleIO";
 }
 
+DBusHandleIO::~DBusHandleIO()
+{
+  DoutEntering(dc::statefultask(mSMDebug), "~DBusHandleIO() [" << (void*)this << "]");
+  if (m_connection)
+    m_connection->close();
+  if (m_standby)
+    m_standby->close();
+  if (m_backoff_timer)
+    m_backoff_timer->close();
+  if (m_schedule_timer)
+    m_schedule_timer->close();
+  if (m_wakeup_fd != -1)
+    ::close(m_wakeup_fd);
+}
+
+void DBusHandleIO::use_pinned_io_thread(int cpu, std::chrono::microseconds spin_period)
+{
+  m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeup_fd == -1)
+    THROW_ALERTC(errno, "eventfd");
+  m_pinned_cpu = cpu;
+  m_spin_period = spin_period;
+  m_connection->use_pinned_io_thread(cpu, spin_period, m_wakeup_fd);
+}
+
+void DBusHandleIO::wake_up_pinned_io_thread()
+{
+  uint64_t one = 1;
+  [[maybe_unused]] ssize_t len = ::write(m_wakeup_fd, &one, sizeof(one));
+}
+
+void DBusHandleIO::set_reconnect_policy(dbus::ReconnectPolicy const& policy, std::string const& service_name, int flags)
+{
+  m_reconnect_policy = policy;
+  m_service_name = service_name;
+  m_flags = flags;
+  m_backoff = policy.m_initial_backoff;
+  if (policy.m_enabled && !m_backoff_timer)
+  {
+    m_backoff_timer = evio::create<dbus::TimerFd>(this, backoff_timer_expired);
+    m_backoff_timer->init();
+  }
+}
+
+void DBusHandleIO::schedule(dbus::OutboundRequest* request, std::chrono::microseconds delay) const
+{
+  if (!m_schedule_timer)
+  {
+    // Like the timeout timer of dbus::Connection, this just wakes up this task.
+    m_schedule_timer = evio::create<dbus::TimerFd>(const_cast<DBusHandleIO*>(this), have_dbus_io);
+    m_schedule_timer->init();
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t monotonic_usec = static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000 + delay.count();
+  m_scheduled_requests.push_back({monotonic_usec, request});
+  std::push_heap(m_scheduled_requests.begin(), m_scheduled_requests.end(), std::greater<ScheduledRequest>{});
+  if (monotonic_usec < m_schedule_timer->expiration_usec())
+    m_schedule_timer->arm_at(monotonic_usec);
+}
+
+bool DBusHandleIO::unschedule(dbus::OutboundRequest* request) const
+{
+  auto iter = std::find_if(m_scheduled_requests.begin(), m_scheduled_requests.end(),
+      [request](ScheduledRequest const& scheduled_request){ return scheduled_request.m_request == request; });
+  if (iter == m_scheduled_requests.end())
+    return false;
+  m_scheduled_requests.erase(iter);
+  std::make_heap(m_scheduled_requests.begin(), m_scheduled_requests.end(), std::greater<ScheduledRequest>{});
+  // If the timer was armed for this request then it just wakes up this task for nothing.
+  return true;
+}
+
+// Called while holding the lock.
+void DBusHandleIO::submit_scheduled_requests(sd_bus* bus)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t now_usec = static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+  while (!m_scheduled_requests.empty() && m_scheduled_requests.front().m_monotonic_usec <= now_usec)
+  {
+    dbus::OutboundRequest* request = m_scheduled_requests.front().m_request;
+    std::pop_heap(m_scheduled_requests.begin(), m_scheduled_requests.end(), std::greater<ScheduledRequest>{});
+    m_scheduled_requests.pop_back();
+    request->submit(bus);
+  }
+  if (!m_scheduled_requests.empty() && m_scheduled_requests.front().m_monotonic_usec != m_schedule_timer->expiration_usec())
+    m_schedule_timer->arm_at(m_scheduled_requests.front().m_monotonic_usec);
+}
+
+// Called while holding the lock, when this task finishes.
+void DBusHandleIO::discard_submitted_requests()
+{
+  m_submission_queue.drain([](dbus::OutboundRequest* request){ request->discard(); });
+}
+
+// Called while holding the lock, when this task finishes.
+void DBusHandleIO::discard_scheduled_requests()
+{
+  // Take the requests out first, so that m_scheduled_requests is consistent while discard runs.
+  std::vector<ScheduledRequest> scheduled_requests = std::move(m_scheduled_requests);
+  m_scheduled_requests.clear();
+  for (ScheduledRequest const& scheduled_request : scheduled_requests)
+    scheduled_request.m_request->discard();
+}
+
+void DBusHandleIO::connect(dbus::Connection& connection)
+{
+  if (!m_address.empty())
+    connection.connect_address(m_address, m_bus_client, "DBusConnection - " + m_address);
+  else if (m_use_system_bus)
+    connection.connect_system("DBusConnection - system");
+  else
+    connection.connect_user("DBusConnection - user");
+}
+
+// Called while holding the lock, after m_connection->handle_dbus_io() returned connection_lost.
+void DBusHandleIO::connection_lost()
+{
+  DoutEntering(dc::notice, "DBusHandleIO::connection_lost()");
+  // Let everyone that has something installed on the bus drop it (or, for pending method calls, keep it if they want to see the error).
+  m_bus_users.for_each([this](dbus::BusUser* bus_user){ bus_user->bus_lost(m_reconnect_policy); });
+  // Let sd_bus_process dispatch an org.freedesktop.DBus.Error.NoReply error to every method call that is still waiting for a reply.
+  sd_bus* bus = m_connection->get_bus();
+  while (sd_bus_process(bus, nullptr) > 0)
+    ;
+  // Those callbacks should not unlock the connection.
+  ASSERT(!m_connection->is_unlocked_in_callback());
+  m_connection->stop_pinned_io_thread();
+  m_connection->close();
+  m_connection->close_bus();
+}
+
+void DBusHandleIO::open_standby()
+{
+  DoutEntering(dc::notice, "DBusHandleIO::open_standby()");
+  m_standby = evio::create<dbus::Connection>(this);
+  try
+  {
+    connect(*m_standby);
+  }
+  catch (AIAlert::Error const& error)
+  {
+    Dout(dc::warning, "Failed to open a standby connection: " << error);
+    m_standby->close();
+    m_standby.reset();
+    return;
+  }
+  m_standby->enable_reconnect();
+  // The standby is driven by the EventLoop, also in pinned I/O thread mode.
+  m_standby->handle_io_ready();
+}
+
+// Called while holding the lock. Returns false if connecting failed.
+bool DBusHandleIO::reconnect()
+{
+  DoutEntering(dc::notice, "DBusHandleIO::reconnect()");
+  boost::intrusive_ptr<dbus::Connection> connection = std::move(m_standby);
+  // The standby is useless if it was lost too (for example, because the bus was restarted).
+  if (connection && connection->handle_dbus_io() == dbus::Connection::connection_lost)
+  {
+    connection->close();
+    connection.reset();
+  }
+  if (connection)
+  {
+    // Normal I/O is started again by handle_io_ready below.
+    connection->stop_input_device();
+    connection->stop_output_device();
+  }
+  else
+  {
+    connection = evio::create<dbus::Connection>(this);
+    try
+    {
+      connect(*connection);
+    }
+    catch (AIAlert::Error const& error)
+    {
+      Dout(dc::warning, "Failed to reconnect: " << error);
+      connection->close();
+      return false;
+    }
+    connection->enable_reconnect();
+  }
+  connection->inherit_settings(*m_connection);
+  if (m_wakeup_fd != -1)
+    connection->use_pinned_io_thread(m_pinned_cpu, m_spin_period, m_wakeup_fd);
+  {
+    std::lock_guard<std::mutex> lock(m_connection_mutex);
+    m_connection.swap(connection);
+  }
+  // Release the lost Connection.
+  connection.reset();
+  sd_bus* bus = m_connection->get_bus();
+  if (!m_service_name.empty())
+  {
+    // Pipeline the name request right behind the Hello call, like task::DBusConnection does.
+    int ret = sd_bus_request_name_async(bus, nullptr, m_service_name.c_str(), m_flags, &DBusHandleIO::s_request_name_callback, this);
+    if (ret < 0)
+      Dout(dc::warning, "sd_bus_request_name_async: " << strerror(-ret));
+    else
+      m_metrics.sent(SD_BUS_MESSAGE_METHOD_CALL);
+  }
+  // Install the objects and matches again and resend method calls that should be retried.
+  m_bus_users.for_each([bus](dbus::BusUser* bus_user){ bus_user->bus_restored(bus); });
+  m_connection->handle_io_ready();
+  return true;
+}
+
+void DBusHandleIO::arm_backoff_timer()
+{
+  // Add jitter, so that not all clients of a restarted bus reconnect at the same time.
+  std::uniform_int_distribution<std::chrono::microseconds::rep> jitter(m_backoff.count() / 2, m_backoff.count());
+  std::chrono::microseconds delay(jitter(m_backoff_jitter));
+  Dout(dc::notice, "Next attempt to reconnect in " << delay.count() << " us.");
+  m_backoff_timer->arm_in(delay);
+  m_backoff = std::min(2 * m_backoff, m_reconnect_policy.m_max_backoff);
+}
+
+int DBusHandleIO::s_request_name_callback(sd_bus_message* message, void* UNUSED_ARG(userdata), sd_bus_error* UNUSED_ARG(ret_error))
+{
+  if (sd_bus_message_is_method_error(message, nullptr) > 0)
+    Dout(dc::warning, "Failed to request the service name again after reconnecting: " << dbus::Error(sd_bus_message_get_error(message)));
+  return 0;
+}
+
 void DBusHandleIO::multiplex_impl(state_type run_state)
 {
   switch (run_state)
@@ -44,6 +282,7 @@ void DBusHandleIO::multiplex_impl(state_type run_state)
     }
     case DBusHandleIO_wait_for_lock:
       set_state(DBusHandleIO_locked);
+      m_lock_requested = std::chrono::steady_clock::now();
       // Attempt to obtain the lock on the connection.
       if (!lock(this, connection_locked))
       {
@@ -54,8 +293,26 @@ void DBusHandleIO::multiplex_impl(state_type run_state)
     case DBusHandleIO_locked:
     {
       obtained_lock();
+      m_lock_obtained = std::chrono::steady_clock::now();
+      m_metrics.io_lock_waited(m_lock_obtained - m_lock_requested);
       set_state(DBusHandleIO_wait_for_lock);
       statefultask::AdoptLock scoped_lock(m_mutex);
+      // First send everything that was submitted by other tasks while we didn't have the lock.
+      sd_bus* bus = m_connection->get_bus();
+      m_submission_queue.drain([bus](dbus::OutboundRequest* request){ request->submit(bus); });
+      if (!m_scheduled_requests.empty())
+        submit_scheduled_requests(bus);
+      if (m_reconnect_policy.m_warm_standby && m_connection->reconnect_enabled())
+      {
+        // Keep the standby connection alive (authentication, Hello and, after that, whatever the bus sends).
+        if (!m_standby)
+          open_standby();
+        else if (m_standby->handle_dbus_io() == dbus::Connection::connection_lost)
+        {
+          m_standby->close();
+          m_standby.reset();
+        }
+      }
       switch (m_connection->handle_dbus_io())
       {
         case dbus::Connection::needs_relock:
@@ -66,16 +323,89 @@ void DBusHandleIO::multiplex_impl(state_type run_state)
           wait(have_dbus_io);
           break;
         case dbus::Connection::io_handled:
+          m_metrics.io_lock_held(std::chrono::steady_clock::now() - m_lock_obtained);
           scoped_lock.unlock();
           wait(have_dbus_io);
           break;
+        case dbus::Connection::budget_exhausted:
+          // Give the lock back; if other tasks are waiting for it then the mutex is handed
+          // over to the first of them and we end up at the back of the queue in DBusHandleIO_wait_for_lock.
+          m_metrics.io_lock_held(std::chrono::steady_clock::now() - m_lock_obtained);
+          scoped_lock.unlock();
+          // Continue in DBusHandleIO_wait_for_lock from the handler, instead of looping on in this call stack.
+          yield();
+          break;
+        case dbus::Connection::connection_lost:
+        {
+          if (!m_reconnect_policy.m_enabled)
+          {
+            // A peer-to-peer client of a task::DBusServer disconnected.
+            scoped_lock.unlock();
+            set_state(DBusHandleIO_done);
+            break;
+          }
+          // Keep the lock until we're connected again: nobody can use the bus in the meantime.
+          scoped_lock.skip_unlock();
+          m_reconnecting = true;
+          // Reconnect immediately if the lost connection had been working; otherwise we're still trying to reconnect.
+          bool const first_attempt = m_connection->is_established();
+          connection_lost();
+          set_state(DBusHandleIO_reconnect);
+          if (first_attempt)
+            m_backoff = m_reconnect_policy.m_initial_backoff;
+          else
+          {
+            arm_backoff_timer();
+            wait(backoff_timer_expired);
+          }
+          break;
+        }
       }
       break;
     }
+    case DBusHandleIO_reconnect:
+      // We still have the lock.
+      if (!reconnect())
+      {
+        arm_backoff_timer();
+        wait(backoff_timer_expired);
+        break;
+      }
+      m_reconnecting = false;
+      m_metrics.reconnected();
+      // We never gave the lock back.
+      m_lock_requested = std::chrono::steady_clock::now();
+      set_state(DBusHandleIO_locked);
+      break;
     case DBusHandleIO_done:
       finish();
       break;
   }
 }
 
+void DBusHandleIO::finish_impl()
+{
+  // Also called after an abort.
+  m_connection->stop_pinned_io_thread();
+  if (m_backoff_timer)
+    m_backoff_timer->disarm();
+  if (m_schedule_timer)
+    m_schedule_timer->disarm();
+  if (m_reconnecting)
+  {
+    // We were aborted while waiting for the backoff timer.
+    discard_submitted_requests();
+    discard_scheduled_requests();
+    m_reconnecting = false;
+    m_mutex.unlock();
+  }
+  else
+  {
+    // Scoped, blocking lock.
+    DBusLock lock(m_mutex, true COMMA_CWDEBUG_ONLY(mSMDebug));
+    discard_submitted_requests();
+    discard_scheduled_requests();
+  }
+}
+
 } // namespace task
@@ -1,20 +1,72 @@
 #pragma once
 
 #include "Connection.h"
+#include "SubmissionQueue.h"
+#include "BusUser.h"
+#include "TimerFd.h"
+#include "ConnectionMetrics.h"
 #include "statefultask/AIStatefulTask.h"
 #include "debug.h"
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace task {
 
+class DBusMethodCall;
+
 class DBusHandleIO : public AIStatefulTask
 {
  public:
   static constexpr condition_type have_dbus_io = 1;
   static constexpr condition_type connection_locked = 2;
+  static constexpr condition_type backoff_timer_expired = 4;
 
  private:
   boost::intrusive_ptr<dbus::Connection> m_connection;          // Pointer to the Connection that is being used.
+  mutable std::mutex m_connection_mutex;                        // Protects m_connection against being replaced (see reconnect) while connection() reads it.
   mutable AIStatefulTaskMutex m_mutex;                          // Connection specific task mutex.
+  dbus::SubmissionQueue m_submission_queue;                     // Requests that must be handled the next time this task has the lock.
+  int m_wakeup_fd;                                              // The eventfd used to wake up the pinned I/O thread, or -1 when not pinned.
+  int m_pinned_cpu;                                             // See use_pinned_io_thread.
+  std::chrono::microseconds m_spin_period;
+
+  // Where to connect to (see set_bus).
+  bool m_use_system_bus;
+  std::string m_address;
+  bool m_bus_client;
+
+  // Reconnecting.
+  dbus::ReconnectPolicy m_reconnect_policy;                     // See set_reconnect_policy.
+  std::string m_service_name;                                   // The service name to request again after reconnecting, if any.
+  int m_flags;                                                  // The flags to request it with.
+  dbus::BusUserList m_bus_users;                                // Objects that need to be told about a new bus.
+  boost::intrusive_ptr<dbus::Connection> m_standby;             // A connection that is kept ready to switch to, if m_reconnect_policy.m_warm_standby.
+  boost::intrusive_ptr<dbus::TimerFd> m_backoff_timer;          // Used to wait before the next attempt to reconnect.
+  std::chrono::microseconds m_backoff;                          // The time to wait after the next failed attempt.
+  std::minstd_rand m_backoff_jitter;                            // Used to randomize m_backoff.
+  bool m_reconnecting;                                          // Set while this task holds the lock because it is reconnecting.
+
+  // Method calls that are in flight and that identical calls can be attached to (see DBusMethodCall::set_coalesced_params).
+  mutable std::unordered_map<std::string, DBusMethodCall*> m_coalescing_table;
+
+  // Requests that must be handled once their time has come (see schedule).
+  struct ScheduledRequest
+  {
+    uint64_t m_monotonic_usec;                                  // When to call m_request->submit(bus).
+    dbus::OutboundRequest* m_request;
+    bool operator>(ScheduledRequest const& other) const { return m_monotonic_usec > other.m_monotonic_usec; }
+  };
+  mutable std::vector<ScheduledRequest> m_scheduled_requests;   // A min-heap (see std::push_heap with std::greater).
+  mutable boost::intrusive_ptr<dbus::TimerFd> m_schedule_timer; // Expires when the first of m_scheduled_requests is due.
+
+  // Statistics.
+  mutable dbus::ConnectionMetrics m_metrics;                    // The metrics of this connection; they survive reconnecting.
+  std::chrono::steady_clock::time_point m_lock_requested;       // When this task last tried to obtain the connection lock.
+  std::chrono::steady_clock::time_point m_lock_obtained;        // When this task last obtained the connection lock.
 
  protected:
   /// The base class of this task.
@@ -25,6 +77,7 @@ class DBusHandleIO : public AIStatefulTask
     DBusHandleIO_start = direct_base_type::state_end,
     DBusHandleIO_wait_for_lock,
     DBusHandleIO_locked,
+    DBusHandleIO_reconnect,
     DBusHandleIO_done
   };
 
@@ -32,7 +85,8 @@ class DBusHandleIO : public AIStatefulTask
   /// One beyond the largest state of this task.
   static constexpr state_type state_end = DBusHandleIO_done + 1;
 
-  DBusHandleIO(CWDEBUG_ONLY(bool debug = false)) : AIStatefulTask(CWDEBUG_ONLY(debug))
+  DBusHandleIO(CWDEBUG_ONLY(bool debug = false)) : AIStatefulTask(CWDEBUG_ONLY(debug)),
+    m_wakeup_fd(-1), m_pinned_cpu(-1), m_use_system_bus(false), m_bus_client(true), m_flags(0), m_backoff(0), m_backoff_jitter(reinterpret_cast<uintptr_t>(this)), m_reconnecting(false)
   {
     DoutEntering(dc::statefultask(mSMDebug), "DBusHandleIO() [" << (void*)this << "]");
     m_connection = evio::create<dbus::Connection>(this);
@@ -40,7 +94,9 @@ class DBusHandleIO : public AIStatefulTask
 
   bool lock(AIStatefulTask* task, condition_type condition) const
   {
-    return m_mutex.lock(task, condition);
+    bool obtained = m_mutex.lock(task, condition);
+    m_metrics.lock_requested(obtained);
+    return obtained;
   }
 
   void obtained_lock() const
@@ -55,30 +111,120 @@ class DBusHandleIO : public AIStatefulTask
     m_mutex.unlock();
   }
 
-  boost::intrusive_ptr<dbus::Connection> const& connection() const
+  // Let this task call request->submit(bus) the next time it holds the connection lock.
+  // This function is thread-safe and does not block.
+  void submit(dbus::OutboundRequest* request)
   {
+    // Only wake up the task when the queue was empty; otherwise that already happened.
+    if (m_submission_queue.push(request))
+    {
+      // In pinned I/O thread mode, let the I/O thread do the work.
+      // Don't use m_connection here: it is replaced when reconnecting.
+      if (m_wakeup_fd != -1)
+        wake_up_pinned_io_thread();
+      else
+        signal(have_dbus_io);
+    }
+  }
+
+  // Let this task call request->submit(bus) once delay has passed, the first time it holds the connection lock after that.
+  // Must be called while holding the connection lock.
+  void schedule(dbus::OutboundRequest* request, std::chrono::microseconds delay) const;
+
+  // Undo schedule for request, if it wasn't submitted yet. Returns true if it was removed.
+  // Must be called while holding the connection lock.
+  bool unschedule(dbus::OutboundRequest* request) const;
+
+  // Let a dedicated thread do the I/O of the connection (see dbus::Connection::use_pinned_io_thread).
+  // Must be called after connecting but before this task is run.
+  void use_pinned_io_thread(int cpu, std::chrono::microseconds spin_period);
+
+  // Set what connect() connects to: address if it is not empty, otherwise the system bus or the user bus.
+  void set_bus(bool use_system_bus, std::string const& address, bool bus_client)
+  {
+    m_use_system_bus = use_system_bus;
+    m_address = address;
+    m_bus_client = bus_client;
+  }
+
+  // Start connecting (see set_bus). Must be called before this task is run.
+  void connect() { connect(*m_connection); }
+
+  // Reconnect, according to policy, when the connection is lost.
+  // The service name (if any) is requested again after reconnecting.
+  // Must be called before this task is run; reconnecting only starts after a call to enable_reconnect.
+  void set_reconnect_policy(dbus::ReconnectPolicy const& policy, std::string const& service_name, int flags);
+
+  // Called by task::DBusConnection once the connection is set up.
+  void enable_reconnect()
+  {
+    if (m_reconnect_policy.m_enabled)
+      m_connection->enable_reconnect();
+  }
+
+  // Register bus_user to be informed when the bus is lost and restored. Must be called while holding the connection lock.
+  void register_bus_user(dbus::BusUser* bus_user) { m_bus_users.insert(bus_user); }
+
+  // Undo register_bus_user. Must be called while holding the connection lock.
+  void unregister_bus_user(dbus::BusUser* bus_user) { m_bus_users.erase(bus_user); }
+
+  // Return the Connection that is being used. This may be called from any thread; while not holding
+  // the connection lock the returned Connection might be replaced by a new one at any moment.
+  boost::intrusive_ptr<dbus::Connection> connection() const
+  {
+    std::lock_guard<std::mutex> lock(m_connection_mutex);
     return m_connection;
   }
 
+  // Return the Connection that is being used, without locking m_connection_mutex and without touching the reference count.
+  // Only call this while this task holds the connection lock; for example from the callbacks of the bus, that are called from sd_bus_process.
+  dbus::Connection& locked_connection() const
+  {
+    ASSERT(m_mutex.is_self_locked(this));
+    return *m_connection;
+  }
+
   AIStatefulTaskMutex& mutex()
   {
     return m_mutex;
   }
 
- protected:
-  /// Call finish() (or abort()), not delete.
-  ~DBusHandleIO() override
+  // Return the coalescing table. Only use this while holding the connection lock.
+  std::unordered_map<std::string, DBusMethodCall*>& coalescing_table() const
   {
-    DoutEntering(dc::statefultask(mSMDebug), "~DBusHandleIO() [" << (void*)this << "]");
-    if (m_connection)
-      m_connection->close();
+    return m_coalescing_table;
   }
 
+  // The metrics of this connection. Thread-safe.
+  dbus::ConnectionMetrics& metrics() const
+  {
+    return m_metrics;
+  }
+
+ private:
+  void wake_up_pinned_io_thread();
+  void connect(dbus::Connection& connection);
+  void connection_lost();
+  bool reconnect();
+  void open_standby();
+  void arm_backoff_timer();
+  void submit_scheduled_requests(sd_bus* bus);
+  void discard_submitted_requests();
+  void discard_scheduled_requests();
+
+  // This is the callback for the service name request after reconnecting.
+  static int s_request_name_callback(sd_bus_message* m, void* userdata, sd_bus_error* ret_error);
+
+ protected:
+  /// Call finish() (or abort()), not delete.
+  ~DBusHandleIO() override;
+
   // Implementation of virtual functions of AIStatefulTask.
   char const* condition_str_impl(condition_type condition) const override;
   char const* state_str_impl(state_type run_state) const override;
   char const* task_name_impl() const override;
   void multiplex_impl(state_type run_state) override;
+  void finish_impl() override;
 };
 
 } //namespace task
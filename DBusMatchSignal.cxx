@@ -1,6 +1,7 @@
 #include "sys.h"
 #include "DBusMatchSignal.h"
 #include "systemd_sd-bus.h"
+#include <cstring>
 
 namespace utils { using namespace threading; }
 
@@ -36,6 +37,7 @@ void DBusMatchSignal::match_callback(dbus::MessageRead const& message)
   // Make sure DBusMatchSignal::match_callback is not called again.
   sd_bus_slot_unref(m_slot);
   m_slot = nullptr;
+  m_dbus_connection->unregister_bus_user(this);
   // Unlock the connection before waking up the task.
   // The current handler may not be immediate because that would cause arbitrary code
   // to be executed immediately, which isn't what we can allow since we have the lock
@@ -57,6 +59,8 @@ void DBusMatchSignal::multiplex_impl(state_type run_state)
   {
     case DBusMatchSignal_start:
     {
+      if (m_broker_key.is_pooled())
+        m_broker_key = m_broker_key.acquire_pool_connection(m_shard);
       m_dbus_connection = m_broker->run(m_broker_key, [this](bool success){ Dout(dc::notice, "dbus_connection finished!"); signal(connection_set_up); });
       Dout(dc::notice, "Requested name = \"" << m_dbus_connection->service_name() << "\".");
       set_state(DBusMatchSignal_wait_for_lock);
@@ -77,9 +81,10 @@ void DBusMatchSignal::multiplex_impl(state_type run_state)
       set_state(DBusMatchSignal_done);
       DBusLock lock(m_dbus_connection);
       Dout(dc::notice, "Unique name = \"" << m_dbus_connection->get_unique_name() << "\".");
-      int res = sd_bus_match_signal_async(m_dbus_connection->get_bus(), &m_slot,
-          m_destination->service_name(), m_destination->object_path(), m_destination->interface_name(), m_destination->method_name(),
-          &DBusMatchSignal::match_callback, nullptr, this);
+      int res = add_match(m_dbus_connection->get_bus());
+      // Add the match again after reconnecting.
+      if (res >= 0)
+        m_dbus_connection->register_bus_user(this);
       lock.unlock();
       if (res < 0)
         THROW_ALERTC(-res, "sd_bus_match_signal_async");
@@ -93,17 +98,45 @@ void DBusMatchSignal::multiplex_impl(state_type run_state)
   }
 }
 
+int DBusMatchSignal::add_match(sd_bus* bus)
+{
+  return sd_bus_match_signal_async(bus, &m_slot,
+      m_destination->service_name(), m_destination->object_path(), m_destination->interface_name(), m_destination->method_name(),
+      &DBusMatchSignal::match_callback, nullptr, this);
+}
+
+void DBusMatchSignal::bus_lost(dbus::ReconnectPolicy const& UNUSED_ARG(policy))
+{
+  sd_bus_slot_unref(m_slot);
+  m_slot = nullptr;
+}
+
+void DBusMatchSignal::bus_restored(sd_bus* bus)
+{
+  int res = add_match(bus);
+  if (res < 0)
+    Dout(dc::warning, "DBusMatchSignal: sd_bus_match_signal_async failed after reconnecting: " << strerror(-res));
+}
+
 void DBusMatchSignal::abort_impl()
 {
-  if (m_slot)
+  if (m_slot || is_registered())
   {
     // Scoped, blocking lock.
     DBusLock lock(m_dbus_connection, true COMMA_CWDEBUG_ONLY(mSMDebug));
     // Make sure DBusMatchSignal::s_*_callback is no longer called.
     sd_bus_slot_unref(m_slot);
     m_slot = nullptr;
+    if (is_registered())
+      m_dbus_connection->unregister_bus_user(this);
   }
 }
 
-} // namespace task
+void DBusMatchSignal::finish_impl()
+{
+  // Also called after an abort.
+  if (m_broker_key.is_pooled() && m_dbus_connection)
+    m_broker_key.release_pool_connection(m_shard);
+}
 
+} // namespace task
@@ -3,22 +3,28 @@
 #include "Message.h"
 #include "DBusConnectionBrokerKey.h"
 #include "Destination.h"
+#include "BusUser.h"
+#include "InlineFunction.h"
 #include "statefultask/Broker.h"
 #include "debug.h"
 
 namespace task {
 
-class DBusMatchSignal : public AIStatefulTask
+class DBusMatchSignal : public AIStatefulTask, public dbus::BusUser
 {
+ public:
+  using match_callback_type = dbus::InlineFunction<void(dbus::MessageRead const&)>;
+
  private:
   static constexpr condition_type connection_set_up = 1;
   static constexpr condition_type connection_locked = 2;
   static constexpr condition_type have_match_callback = 4;
 
   dbus::DBusConnectionBrokerKey m_broker_key;
+  unsigned int m_shard;                                         // The index of the used connection in the pool, if m_broker_key.is_pooled().
   boost::intrusive_ptr<task::Broker<task::DBusConnection>> m_broker;
   dbus::Destination const* m_destination;
-  std::function<void(dbus::MessageRead const&)> m_match_callback;
+  match_callback_type m_match_callback;
   boost::intrusive_ptr<task::DBusConnection const> m_dbus_connection;
   sd_bus_slot* m_slot;
 
@@ -50,7 +56,7 @@ class DBusMatchSignal : public AIStatefulTask
     m_destination = destination;
   }
 
-  void set_match_callback(std::function<void(dbus::MessageRead const&)> match_callback)
+  void set_match_callback(match_callback_type match_callback)
   {
     m_match_callback = std::move(match_callback);
   }
@@ -60,6 +66,12 @@ class DBusMatchSignal : public AIStatefulTask
     m_broker_key.set_use_system_bus(use_system_bus);
   }
 
+  // Use one of the connections of a pool of pool_size connections (see DBusConnectionData::set_connection_pool).
+  void use_connection_pool(unsigned int pool_size, dbus::PoolPolicy policy = dbus::PoolPolicy::round_robin)
+  {
+    m_broker_key.set_connection_pool(pool_size, policy);
+  }
+
 #ifdef CWDEBUG
   bool is_same_bus(sd_bus* bus) const { return m_dbus_connection->get_bus() == bus; }
 #endif
@@ -70,10 +82,17 @@ class DBusMatchSignal : public AIStatefulTask
   static int match_callback(sd_bus_message* m, void* userdata, sd_bus_error* UNUSED_ARG(empty_error))
   {
     DBusMatchSignal* self = static_cast<DBusMatchSignal*>(userdata);
-    self->match_callback({m, self->m_dbus_connection->get_bus()});
+    self->match_callback({m, self->m_dbus_connection->get_locked_bus()});
     return 0;
   }
 
+  // Add the match rule to bus.
+  int add_match(sd_bus* bus);
+
+  // Implementation of dbus::BusUser.
+  void bus_lost(dbus::ReconnectPolicy const& policy) override;
+  void bus_restored(sd_bus* bus) override;
+
  protected:
   /// Call finish() (or abort()), not delete.
   ~DBusMatchSignal() override
@@ -93,6 +112,9 @@ class DBusMatchSignal : public AIStatefulTask
 
   /// Called for base state @ref bs_abort.
   void abort_impl() override;
+
+  /// Called for base state @ref bs_finish.
+  void finish_impl() override;
 };
 
 } //namespace task
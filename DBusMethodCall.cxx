@@ -1,17 +1,66 @@
 #include "sys.h"
 #include "systemd_sd-bus.h"
 #include "DBusMethodCall.h"
+#include "DBusMethodCallPool.h"
+#include "ReplyCache.h"
+#include "ConcurrencyLimiter.h"
+#include "CancellationGroup.h"
+#include "RetryPolicy.h"
+#include "Error.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "utils/NodeMemoryResource.h"
+#include "utils/AIAlert.h"
+#include <algorithm>
+#include <system_error>
 
 namespace utils { using namespace threading; }
 namespace task {
 
+namespace {
+
+utils::NodeMemoryResource& node_memory_resource()
+{
+  static utils::NodeMemoryResource s_node_memory_resource(AIMemoryPagePool::instance(), sizeof(DBusMethodCall));
+  return s_node_memory_resource;
+}
+
+} // namespace
+
+//static
+void* DBusMethodCall::operator new(std::size_t size)
+{
+  // Classes derived from DBusMethodCall don't fit in the blocks.
+  if (size != sizeof(DBusMethodCall))
+    return ::operator new(size);
+  return node_memory_resource().allocate(size);
+}
+
+//static
+void DBusMethodCall::init_memory_resource()
+{
+  // This uses AIMemoryPagePool::instance().
+  node_memory_resource();
+}
+
+//static
+void DBusMethodCall::operator delete(void* ptr, std::size_t size)
+{
+  if (size != sizeof(DBusMethodCall))
+    ::operator delete(ptr);
+  else
+    node_memory_resource().deallocate(ptr);
+}
+
 char const* DBusMethodCall::condition_str_impl(condition_type condition) const
 {
   switch (condition)
   {
     AI_CASE_RETURN(connection_set_up);
-    AI_CASE_RETURN(connection_locked);
+    AI_CASE_RETURN(call_requested);
     AI_CASE_RETURN(have_reply_callback);
+    AI_CASE_RETURN(have_permit);
+    AI_CASE_RETURN(cancel_requested);
+    AI_CASE_RETURN(cancel_request_done);
   }
   return direct_base_type::condition_str_impl(condition);
 }
@@ -21,8 +70,8 @@ char const* DBusMethodCall::state_str_impl(state_type run_state) const
   switch(run_state)
   {
     AI_CASE_RETURN(DBusMethodCall_start);
-    AI_CASE_RETURN(DBusMethodCall_wait_for_lock);
-    AI_CASE_RETURN(DBusMethodCall_locked);
+    AI_CASE_RETURN(DBusMethodCall_connect);
+    AI_CASE_RETURN(DBusMethodCall_submit);
     AI_CASE_RETURN(DBusMethodCall_done);
   }
   AI_NEVER_REACHED;
@@ -31,10 +80,53 @@ char const* DBusMethodCall::state_str_impl(state_type run_state) const
 void DBusMethodCall::reply_callback(dbus::MessageRead const& message)
 {
   DoutEntering(dc::notice, "DBusMethodCall::reply_callback()");
+  if (m_retry_policy)
+  {
+    if (message.is_method_error())
+    {
+      if (retry(message))
+        return;
+    }
+    else if (m_retry_budget)
+      m_retry_budget->deposit();
+  }
+  if (m_concurrency_limiter)
+    m_overloaded = message.is_method_error(SD_BUS_ERROR_LIMITS_EXCEEDED) ||
+                   message.is_method_error(SD_BUS_ERROR_NO_REPLY) ||
+                   message.is_method_error(SD_BUS_ERROR_TIMEOUT);
+  {
+    auto now = std::chrono::steady_clock::now();
+    dbus::MethodLatency& latency = m_destination->latency();
+    latency.record(dbus::MethodLatency::reply, now - m_sent);
+    latency.record(dbus::MethodLatency::total, now - m_started);
+  }
+  if (m_in_coalescing_table)
+  {
+    // Don't let more calls attach to this one.
+    m_dbus_connection->coalescing_table().erase(m_coalescing_key);
+    m_in_coalescing_table = false;
+  }
   // This is a callback from sd_bus, so we have the lock on the connection.
   m_reply_callback(message);
+  // Pass the same reply to all calls that were attached to this one.
+  DBusMethodCall* follower = std::exchange(m_followers, nullptr);
+  while (follower)
+  {
+    // Read m_next_follower before follower_reply wakes up the follower.
+    DBusMethodCall* next = follower->m_next_follower;
+    message.rewind();
+    follower->follower_reply(message);
+    follower = next;
+  }
+  if (m_reply_cache && message.get_type() == SD_BUS_MESSAGE_METHOD_RETURN)
+    m_reply_cache->store(m_coalescing_key, *m_destination, message, m_dbus_connection);
   // We're done with the message.
   m_message.reset();
+  sd_bus_slot_unref(m_slot);
+  m_slot = nullptr;
+  m_dbus_connection->metrics().reply_done();
+  m_dbus_connection->unregister_bus_user(this);
+  m_replied.store(true, std::memory_order_release);
   // Unlock the mutex before waking up the task.
   // The current handler may not be immediate because that would cause arbitrary code
   // to be executed immediately, which isn't what we can allow since we have the lock
@@ -43,44 +135,406 @@ void DBusMethodCall::reply_callback(dbus::MessageRead const& message)
   signal(have_reply_callback);
 }
 
+// Called from reply_callback, while holding the connection lock, with an error reply.
+// Returns true if the call will be sent again.
+bool DBusMethodCall::retry(dbus::MessageRead const& message)
+{
+  std::error_code error = dbus::Error(message.get_error());
+  if (!m_retry_policy->should_retry(error) || m_retries + 1 >= m_retry_policy->m_max_attempts)
+    return false;
+  std::chrono::microseconds delay = m_retry_policy->backoff(m_retries + 1);
+  // Don't retry if the reply wouldn't be in time anyway.
+  if (m_deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() + delay >= m_deadline)
+    return false;
+  if (m_retry_budget && !m_retry_budget->withdraw())
+    return false;
+  ++m_retries;
+  Dout(dc::notice, "Retrying call after " << error.message() << " in " << delay.count() << " us (retry " << m_retries << ").");
+  // Drop the failed call. While scheduled, this call isn't a bus user: the retry sends it on whatever bus is current by then.
+  m_message.reset();
+  sd_bus_slot_unref(m_slot);
+  m_slot = nullptr;
+  m_dbus_connection->metrics().reply_done();
+  m_dbus_connection->unregister_bus_user(this);
+  // Never schedule the same request twice; if it is still scheduled then that will send the call again.
+  if (!m_retry_request.m_scheduled)
+  {
+    m_retry_request.m_call = this;
+    m_retry_request.m_scheduled = true;
+    m_dbus_connection->schedule(&m_retry_request, delay);
+  }
+  return true;
+}
+
+// Called by the DBusHandleIO task of the connection, while it holds the connection lock, when the backoff of a retry passed.
+void DBusMethodCall::RetryRequest::submit(sd_bus* bus)
+{
+  // Release the reference that kept the task alive while this request was scheduled when leaving this function.
+  boost::intrusive_ptr<DBusMethodCall> call = std::move(m_call);
+  m_scheduled = false;
+  // Don't send the call again if it was aborted or cancelled in the meantime.
+  if (call->m_aborted || call->m_replied.load(std::memory_order_relaxed))
+    return;
+  call->send(bus);
+}
+
+// Called by the DBusHandleIO task of the connection, while it holds the connection lock, when it finishes before the backoff passed.
+void DBusMethodCall::RetryRequest::discard()
+{
+  boost::intrusive_ptr<DBusMethodCall> call = std::move(m_call);
+  m_scheduled = false;
+  if (call->m_aborted || call->m_replied.load(std::memory_order_relaxed))
+    return;
+  // The call can't be sent again; let it fail.
+  call->m_submit_exception = std::make_exception_ptr(std::system_error(std::make_error_code(std::errc::not_connected)));
+  call->m_replied.store(true, std::memory_order_release);
+  call->signal(have_reply_callback);
+}
+
+// Called with the reply of the leader that this call is attached to, while holding the connection lock.
+void DBusMethodCall::follower_reply(dbus::MessageRead const& message)
+{
+  DoutEntering(dc::notice, "DBusMethodCall::follower_reply()");
+  m_leader = nullptr;
+  m_destination->latency().record(dbus::MethodLatency::total, std::chrono::steady_clock::now() - m_started);
+  m_reply_callback(message);
+  m_replied.store(true, std::memory_order_release);
+  // See reply_callback.
+  ASSERT(!is_immediate());
+  signal(have_reply_callback);
+}
+
+// Called while holding the connection lock when this call, a leader, failed to send its message.
+void DBusMethodCall::detach_followers(std::exception_ptr const& exception)
+{
+  m_dbus_connection->coalescing_table().erase(m_coalescing_key);
+  m_in_coalescing_table = false;
+  DBusMethodCall* follower = std::exchange(m_followers, nullptr);
+  while (follower)
+  {
+    DBusMethodCall* next = follower->m_next_follower;
+    follower->m_leader = nullptr;
+    follower->m_submit_exception = exception;
+    follower->m_replied.store(true, std::memory_order_release);
+    follower->signal(have_reply_callback);
+    follower = next;
+  }
+}
+
+// Called from multiplex_impl. Returns true if the reply callback was called with a cached reply.
+bool DBusMethodCall::reply_from_cache()
+{
+  if (!m_reply_cache)
+    return false;
+  // Call set_coalesced_params or set_coalescing_key when using a reply cache.
+  ASSERT(!m_coalescing_key.empty());
+  if (!m_reply_cache->lookup(m_coalescing_key, m_reply_callback))
+    return false;
+  m_destination->latency().record(dbus::MethodLatency::total, std::chrono::steady_clock::now() - m_started);
+  return true;
+}
+
+// Give up the permit of m_concurrency_limiter, if any.
+// Set completed when the call finished normally, so that the limiter can learn from its latency.
+void DBusMethodCall::release_permit(bool completed)
+{
+  switch (std::exchange(m_permit, no_permit))
+  {
+    case no_permit:
+      break;
+    case permit_requested:
+      // If we were given a permit after all, give it back.
+      if (!m_concurrency_limiter->cancel(this))
+        m_concurrency_limiter->release();
+      break;
+    case permit_held:
+      if (completed)
+        m_concurrency_limiter->release(std::chrono::steady_clock::now() - m_permit_obtained, m_overloaded);
+      else
+        m_concurrency_limiter->release();
+      break;
+  }
+}
+
+void DBusMethodCall::initialize_impl()
+{
+  DoutEntering(dc::statefultask(mSMDebug), "DBusMethodCall::initialize_impl() [" << (void*)this << "]");
+  m_submit_exception = nullptr;
+  m_slot = nullptr;
+  m_aborted = false;
+  m_in_coalescing_table = false;
+  m_leader = nullptr;
+  m_followers = nullptr;
+  m_permit = no_permit;
+  m_replied = true;
+  if (m_cancellation_group)
+    m_cancellation_group->insert(this);
+  m_started = std::chrono::steady_clock::now();
+  set_state(DBusMethodCall_start);
+}
+
+// Called by the DBusHandleIO task of the connection, while it holds the connection lock.
+void DBusMethodCall::submit(sd_bus* bus)
+{
+  DoutEntering(dc::notice, "DBusMethodCall::submit()");
+  // Release the reference that kept this task alive while it was in the submission queue when leaving this function.
+  boost::intrusive_ptr<DBusMethodCall> self = std::move(m_keep_alive);
+  if (AI_UNLIKELY(m_aborted))
+    return;
+  dbus::MethodLatency& latency = m_destination->latency();
+  latency.record(dbus::MethodLatency::broker_wait, m_connection_set_up - m_started);
+  latency.record(dbus::MethodLatency::queue_wait, std::chrono::steady_clock::now() - m_connection_set_up);
+  if (m_no_reply)
+  {
+    send_no_reply(bus);
+    return;
+  }
+  if (!m_coalescing_key.empty())
+  {
+    auto ibp = m_dbus_connection->coalescing_table().try_emplace(m_coalescing_key, this);
+    if (!ibp.second)
+    {
+      // An identical call is in flight; wait for its reply instead of sending a message.
+      DBusMethodCall* leader = ibp.first->second;
+      m_leader = leader;
+      m_next_follower = leader->m_followers;
+      leader->m_followers = this;
+      return;
+    }
+    m_in_coalescing_table = true;
+  }
+  send(bus);
+}
+
+// Called by the DBusHandleIO task of the connection, while it holds the connection lock, when it finishes before this call was submitted.
+void DBusMethodCall::discard()
+{
+  DoutEntering(dc::notice, "DBusMethodCall::discard()");
+  // Release the reference that kept this task alive while it was in the submission queue when leaving this function.
+  boost::intrusive_ptr<DBusMethodCall> self = std::move(m_keep_alive);
+  if (AI_UNLIKELY(m_aborted))
+    return;
+  // The call will never be sent; let it fail.
+  m_submit_exception = std::make_exception_ptr(std::system_error(std::make_error_code(std::errc::not_connected)));
+  m_replied.store(true, std::memory_order_release);
+  signal(have_reply_callback);
+}
+
+// Called while holding the connection lock.
+void DBusMethodCall::send_no_reply(sd_bus* bus)
+{
+  auto const start = std::chrono::steady_clock::now();
+  try
+  {
+    m_message.create_message(m_dbus_connection, *m_destination);
+    m_params_callback(m_message);
+    int res = sd_bus_message_set_expect_reply(m_message, 0);
+    if (res < 0)
+      THROW_ALERTC(-res, "sd_bus_message_set_expect_reply");
+    res = sd_bus_send(bus, m_message, nullptr);
+    if (res < 0)
+      THROW_ALERTC(-res, "sd_bus_send");
+    m_destination->latency().record(dbus::MethodLatency::send, std::chrono::steady_clock::now() - start);
+    m_dbus_connection->metrics().sent(SD_BUS_MESSAGE_METHOD_CALL);
+  }
+  catch (...)
+  {
+    // Rethrow the exception from multiplex_impl.
+    m_submit_exception = std::current_exception();
+  }
+  m_message.reset();
+  // Let the task finish now that the message was sent.
+  m_replied.store(true, std::memory_order_release);
+  signal(have_reply_callback);
+}
+
+// Called while holding the connection lock.
+void DBusMethodCall::send(sd_bus* bus)
+{
+  auto const start = std::chrono::steady_clock::now();
+  try
+  {
+    m_message.create_message(m_dbus_connection, *m_destination);
+    m_params_callback(m_message);
+    // sd_bus wants a relative timeout; zero means its default.
+    uint64_t usec = m_timeout.count();
+    if (m_deadline != std::chrono::steady_clock::time_point::max())
+    {
+      auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(m_deadline - std::chrono::steady_clock::now());
+      // Let a deadline that already passed time out as soon as possible, rather than using the default.
+      uint64_t deadline_usec = std::max<int64_t>(remaining.count(), 1);
+      if (usec == 0 || deadline_usec < usec)
+        usec = deadline_usec;
+    }
+    int res = sd_bus_call_async(bus, &m_slot, m_message, &DBusMethodCall::reply_callback, this, usec);
+    if (res < 0)
+      THROW_ALERTC(-res, "sd_bus_call_async");
+    m_sent = std::chrono::steady_clock::now();
+    m_destination->latency().record(dbus::MethodLatency::send, m_sent - start);
+    dbus::ConnectionMetrics& metrics = m_dbus_connection->metrics();
+    metrics.sent(SD_BUS_MESSAGE_METHOD_CALL);
+    metrics.reply_pending();
+    if (!is_registered())
+      m_dbus_connection->register_bus_user(this);
+  }
+  catch (...)
+  {
+    // Rethrow the exception from multiplex_impl.
+    m_submit_exception = std::current_exception();
+    if (m_in_coalescing_table)
+      detach_followers(m_submit_exception);
+    m_message.reset();
+    if (is_registered())
+      m_dbus_connection->unregister_bus_user(this);
+    m_replied.store(true, std::memory_order_release);
+    signal(have_reply_callback);
+  }
+}
+
+void DBusMethodCall::bus_lost(dbus::ReconnectPolicy const& policy)
+{
+  // Let the call fail with org.freedesktop.DBus.Error.NoReply, unless it should be sent again.
+  if (policy.m_in_flight == dbus::InFlightPolicy::retry && m_slot)
+  {
+    sd_bus_slot_unref(m_slot);
+    m_slot = nullptr;
+    m_dbus_connection->metrics().reply_done();
+    m_message.reset();
+  }
+}
+
+void DBusMethodCall::bus_restored(sd_bus* bus)
+{
+  if (!m_slot)
+    send(bus);
+}
+
 void DBusMethodCall::multiplex_impl(state_type run_state)
 {
+  if (AI_UNLIKELY(m_cancelled.load(std::memory_order_relaxed)) && run_state != DBusMethodCall_done)
+  {
+    // Cancelled before the call was submitted.
+    m_submit_exception = std::make_exception_ptr(std::system_error(std::make_error_code(std::errc::operation_canceled)));
+    set_state(DBusMethodCall_done);
+    return;
+  }
   switch (run_state)
   {
     case DBusMethodCall_start:
+      // A pooled task comes back here for the next call.
+      if (reply_from_cache())
+      {
+        set_state(DBusMethodCall_done);
+        break;
+      }
+      // A pooled task already has its connection.
+      set_state(m_dbus_connection ? DBusMethodCall_submit : DBusMethodCall_connect);
+      if (m_concurrency_limiter)
+      {
+        m_overloaded = false;
+        if (!m_concurrency_limiter->acquire(this, have_permit))
+        {
+          m_permit = permit_requested;
+          wait(have_permit | cancel_requested);
+          break;
+        }
+        m_permit = permit_held;
+        m_permit_obtained = std::chrono::steady_clock::now();
+      }
+      break;
+    case DBusMethodCall_connect:
     {
-      m_dbus_connection = m_broker->run(*m_broker_key, [this](bool success){ Dout(dc::notice, "dbus_connection finished!"); signal(connection_set_up); });
+      if (m_permit == permit_requested)
+      {
+        m_permit = permit_held;
+        m_permit_obtained = std::chrono::steady_clock::now();
+      }
+      dbus::DBusConnectionBrokerKey const* broker_key = m_broker_key;
+      if (m_broker_key->is_pooled())
+      {
+        m_pool_key = m_broker_key->acquire_pool_connection(m_shard);
+        broker_key = &m_pool_key;
+      }
+      m_dbus_connection = m_broker->run(*broker_key, [this](bool success){ Dout(dc::notice, "dbus_connection finished!"); signal(connection_set_up); });
       Dout(dc::notice, "Requested name = \"" << m_dbus_connection->service_name() << "\".");
-      set_state(DBusMethodCall_wait_for_lock);
+      set_state(DBusMethodCall_submit);
       wait(connection_set_up);
       break;
     }
-    case DBusMethodCall_wait_for_lock:
-      set_state(DBusMethodCall_locked);
-      // Attempt to obtain the lock on the connection.
-      if (!m_dbus_connection->lock(this, connection_locked))
+    case DBusMethodCall_submit:
+      if (m_permit == permit_requested)
       {
-        wait(connection_locked);
-        break;
+        m_permit = permit_held;
+        m_permit_obtained = std::chrono::steady_clock::now();
       }
-      [[fallthrough]];
-    case DBusMethodCall_locked:
-    {
+      m_connection_set_up = std::chrono::steady_clock::now();
       set_state(DBusMethodCall_done);
-      DBusLock lock(m_dbus_connection);
-      Dout(dc::notice, "Unique name = \"" << m_dbus_connection->get_unique_name() << "\".");
-      m_message.create_message(m_dbus_connection, *m_destination);
-      m_params_callback(m_message);
-      int res = sd_bus_call_async(m_dbus_connection->get_bus(), nullptr, m_message, &DBusMethodCall::reply_callback, this, 0);
-      lock.unlock();
-      if (res < 0)
-        THROW_ALERTC(-res, "sd_bus_call_async");
-      wait(have_reply_callback);
+      // Instead of obtaining the connection lock ourselves, let the DBusHandleIO task create and send
+      // the message together with all other requests that are submitted while it doesn't have the lock.
+      m_keep_alive = this;
+      m_replied = false;
+      m_retries = 0;
+      m_dbus_connection->submit(this);
+      if (m_no_reply)
+      {
+        // There won't be a reply; send_no_reply signals have_reply_callback once the message was sent.
+        wait(have_reply_callback);
+        break;
+      }
+      wait(have_reply_callback | cancel_requested);
       break;
-    }
     case DBusMethodCall_done:
+    {
+      if (AI_UNLIKELY(!m_replied.load(std::memory_order_acquire)))
+      {
+        // Woken up by cancel (or by a cancel of a previous call of this pooled task that came too late).
+        // Never push m_cancel_request while it is still in the submission queue.
+        if (m_cancelled.load(std::memory_order_relaxed) && m_cancel_request.m_state.load(std::memory_order_relaxed) == CancelRequest::idle)
+        {
+          // Let the DBusHandleIO task drop the call while it holds the connection lock.
+          m_cancel_request.m_call = this;
+          m_cancel_request.m_state.store(CancelRequest::queued, std::memory_order_relaxed);
+          m_dbus_connection->submit(&m_cancel_request);
+        }
+        wait(have_reply_callback);
+        break;
+      }
+      if (AI_UNLIKELY(m_cancel_request.m_state.load(std::memory_order_acquire) != CancelRequest::idle))
+      {
+        // The reply beat the cancel request. Don't reuse or finish this task while the connection still refers to it.
+        wait(cancel_request_done);
+        break;
+      }
+      std::exception_ptr submit_exception = std::exchange(m_submit_exception, nullptr);
+      release_permit(!submit_exception);
+      if (m_done_callback)
+      {
+        // Move the callback out of the way: after idle() the next call might set a new one.
+        done_callback_type done_callback = std::move(m_done_callback);
+        if (m_pool)
+        {
+          // Pass the exception to the caller and keep this task for the next call.
+          set_state(DBusMethodCall_start);
+          m_pool->idle(this);
+          wait(call_requested);
+          done_callback(submit_exception);
+          break;
+        }
+        done_callback(submit_exception);
+      }
+      if (AI_UNLIKELY(submit_exception))
+        std::rethrow_exception(submit_exception);
+      if (m_pool)
+      {
+        // Keep the connection and wait for the next call.
+        set_state(DBusMethodCall_start);
+        m_pool->idle(this);
+        wait(call_requested);
+        break;
+      }
       finish();
       break;
+    }
   }
 }
 
@@ -92,7 +546,107 @@ void DBusMethodCall::abort_impl()
   {
     // Scoped, blocking lock.
     DBusLock lock(m_dbus_connection, true COMMA_CWDEBUG_ONLY(mSMDebug));
-    m_message.reset();
+    // In case we're still in the submission queue.
+    m_aborted = true;
+    drop_pending();
+  }
+}
+
+// Called while holding the connection lock.
+// Detach from coalesced calls and make sure that DBusMethodCall::reply_callback is not called anymore.
+void DBusMethodCall::drop_pending()
+{
+  if (m_leader)
+  {
+    // Detach from the call that we're attached to.
+    DBusMethodCall** link = &m_leader->m_followers;
+    while (*link != this)
+      link = &(*link)->m_next_follower;
+    *link = m_next_follower;
+    m_leader = nullptr;
+  }
+  if (m_in_coalescing_table)
+  {
+    // Let the first follower, if any, take over.
+    auto& coalescing_table = m_dbus_connection->coalescing_table();
+    DBusMethodCall* new_leader = std::exchange(m_followers, nullptr);
+    m_in_coalescing_table = false;
+    if (!new_leader)
+      coalescing_table.erase(m_coalescing_key);
+    else
+    {
+      coalescing_table[m_coalescing_key] = new_leader;
+      new_leader->m_leader = nullptr;
+      new_leader->m_in_coalescing_table = true;
+      new_leader->m_followers = new_leader->m_next_follower;
+      for (DBusMethodCall* follower = new_leader->m_followers; follower; follower = follower->m_next_follower)
+        follower->m_leader = new_leader;
+      new_leader->send(m_dbus_connection->get_bus());
+    }
+  }
+  // Make sure that DBusMethodCall::reply_callback is not called anymore.
+  if (m_slot)
+  {
+    sd_bus_slot_unref(m_slot);
+    m_slot = nullptr;
+    m_dbus_connection->metrics().reply_done();
+  }
+  if (is_registered())
+    m_dbus_connection->unregister_bus_user(this);
+  m_message.reset();
+  // Don't send the call again.
+  if (m_retry_request.m_scheduled && m_dbus_connection->unschedule(&m_retry_request))
+  {
+    m_retry_request.m_scheduled = false;
+    // The caller still has a reference to this task.
+    m_retry_request.m_call.reset();
+  }
+}
+
+// Called while holding the connection lock, after cancel woke up the task while it was waiting for the reply.
+void DBusMethodCall::cancel_pending()
+{
+  DoutEntering(dc::notice, "DBusMethodCall::cancel_pending()");
+  // If the reply (or an error) beat us to it then have_reply_callback was already signalled.
+  if (m_replied.load(std::memory_order_relaxed))
+    return;
+  drop_pending();
+  m_submit_exception = std::make_exception_ptr(std::system_error(std::make_error_code(std::errc::operation_canceled)));
+  m_replied.store(true, std::memory_order_release);
+  signal(have_reply_callback);
+}
+
+void DBusMethodCall::CancelRequest::submit(sd_bus* UNUSED_ARG(bus))
+{
+  // Release the reference that kept the task alive while this request was in the submission queue when leaving this function.
+  boost::intrusive_ptr<DBusMethodCall> call = std::move(m_call);
+  if (!call->m_aborted)
+    call->cancel_pending();
+  // From here on the task may be reused or finish.
+  if (m_state.exchange(idle, std::memory_order_acq_rel) == queued_release_shard)
+    call->m_broker_key->release_pool_connection(call->m_shard);
+  else if (!call->m_aborted)
+    call->signal(cancel_request_done);
+}
+
+void DBusMethodCall::CancelRequest::discard()
+{
+  // Cancelling doesn't need the bus: the pending call is dropped (and failed) in the same way.
+  submit(nullptr);
+}
+
+void DBusMethodCall::finish_impl()
+{
+  // Also called after an abort.
+  release_permit(false);
+  if (m_cancellation_group)
+    m_cancellation_group->erase(this);
+  if (m_broker_key->is_pooled() && m_dbus_connection)
+  {
+    // If we were aborted while m_cancel_request is still in the submission queue then let it release the pool connection.
+    int state = CancelRequest::queued;
+    if (!m_cancel_request.m_state.compare_exchange_strong(state, CancelRequest::queued_release_shard, std::memory_order_acq_rel))
+      m_broker_key->release_pool_connection(m_shard);
   }
 }
 
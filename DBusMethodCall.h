@@ -3,25 +3,118 @@
 #include "Message.h"
 #include "DBusConnectionBrokerKey.h"
 #include "Destination.h"
+#include "MethodLatency.h"
+#include "SubmissionQueue.h"
+#include "BusUser.h"
+#include "InlineFunction.h"
+#include "CoalescingKey.h"
 #include "statefultask/Broker.h"
 #include "debug.h"
+#include <atomic>
+#include <exception>
+#include <chrono>
+
+namespace dbus {
+class ReplyCache;
+class ConcurrencyLimiter;
+class CancellationGroup;
+struct RetryPolicy;
+class RetryBudget;
+} // namespace dbus
 
 namespace task {
 
-class DBusMethodCall : public AIStatefulTask
+class DBusMethodCallPool;
+
+class DBusMethodCall : public AIStatefulTask, public dbus::OutboundRequest, public dbus::BusUser
 {
+ public:
+  using params_callback_type = dbus::InlineFunction<void(dbus::Message&)>;
+  using reply_callback_type = dbus::InlineFunction<void(dbus::MessageRead const&)>;
+  using done_callback_type = dbus::InlineFunction<void(std::exception_ptr)>;
+
  private:
   static constexpr condition_type connection_set_up = 1;
-  static constexpr condition_type connection_locked = 2;
+  static constexpr condition_type call_requested = 2;
   static constexpr condition_type have_reply_callback = 4;
+  static constexpr condition_type have_permit = 8;
+  static constexpr condition_type cancel_requested = 16;
+  static constexpr condition_type cancel_request_done = 32;
+
+  enum permit_type {
+    no_permit,                  // No permit was requested from m_concurrency_limiter.
+    permit_requested,           // Waiting in the queue of m_concurrency_limiter.
+    permit_held                 // Holding a permit.
+  };
 
   dbus::Message m_message;
   boost::intrusive_ptr<task::Broker<task::DBusConnection>> m_broker;
   dbus::DBusConnectionBrokerKey const* m_broker_key;
+  dbus::DBusConnectionBrokerKey m_pool_key;                     // The key of the pool connection that is used, if m_broker_key->is_pooled().
+  unsigned int m_shard;                                         // The index of that connection in the pool.
   dbus::Destination const* m_destination;
-  std::function<void(dbus::Message&)> m_params_callback;
-  std::function<void(dbus::MessageRead const&)> m_reply_callback;
+  params_callback_type m_params_callback;
+  reply_callback_type m_reply_callback;
+  done_callback_type m_done_callback;
   boost::intrusive_ptr<task::DBusConnection const> m_dbus_connection;
+  sd_bus_slot* m_slot;                                          // The slot of the pending method call.
+  std::chrono::microseconds m_timeout;                          // The timeout of the call, or zero to use the default of sd_bus (25 seconds).
+  std::chrono::steady_clock::time_point m_deadline;             // The time at which the call must have been answered, if not time_point::max().
+  boost::intrusive_ptr<DBusMethodCall> m_keep_alive;            // Keeps this task alive while it is in the submission queue of the connection.
+  std::exception_ptr m_submit_exception;                        // Set when submit failed.
+  bool m_aborted;                                               // Set (under the connection lock) when the task was aborted.
+  DBusMethodCallPool* m_pool;                                   // The pool that this task belongs to, if any.
+  bool m_no_reply;                                              // Set when no reply is expected (see set_no_reply).
+
+  // Coalescing (see set_coalesced_params).
+  std::string m_coalescing_key;                                 // Identifies the call; empty if the call should not be coalesced.
+  bool m_in_coalescing_table;                                   // Set while this call is in the coalescing table of the connection (it is a leader).
+  DBusMethodCall* m_leader;                                     // The call that this call is attached to, if any (it is a follower).
+  DBusMethodCall* m_followers;                                  // The calls attached to this call, linked through m_next_follower.
+  DBusMethodCall* m_next_follower;
+  dbus::ReplyCache* m_reply_cache;                              // The cache to look up and store the reply in, if any (see set_reply_cache).
+
+  // Concurrency limiting (see set_concurrency_limiter).
+  dbus::ConcurrencyLimiter* m_concurrency_limiter;              // The limiter to obtain a permit from before sending the call, if any.
+  permit_type m_permit;                                         // Whether or not this call holds a permit of m_concurrency_limiter.
+  std::chrono::steady_clock::time_point m_permit_obtained;      // When the permit was obtained.
+  bool m_overloaded;                                            // Set when the reply was an error that indicates that the peer is overloaded.
+
+  // Cancellation (see cancel).
+  struct CancelRequest final : public dbus::OutboundRequest
+  {
+    enum state_type {
+      idle,                     // Not in the submission queue.
+      queued,                   // In the submission queue.
+      queued_release_shard      // In the submission queue, and the task finished: release the pool connection after use.
+    };
+    boost::intrusive_ptr<DBusMethodCall> m_call;               // The call to cancel; keeps it alive while in the submission queue.
+    std::atomic<int> m_state = idle;                            // One of state_type.
+    void submit(sd_bus* bus) override;
+    void discard() override;
+  };
+  std::atomic<bool> m_cancelled;                                // Set by cancel.
+  std::atomic<bool> m_replied;                                  // Set (under the connection lock) when have_reply_callback is signalled for a submitted call.
+  CancelRequest m_cancel_request;                               // Used to drop a pending call.
+  dbus::CancellationGroup* m_cancellation_group;                // The group that this call belongs to, if any.
+
+  // Retrying (see set_retry_policy).
+  struct RetryRequest final : public dbus::OutboundRequest
+  {
+    boost::intrusive_ptr<DBusMethodCall> m_call;               // The call to send again; keeps it alive while it is scheduled.
+    bool m_scheduled = false;                                   // Set while scheduled on the connection. Only accessed while holding the connection lock.
+    void submit(sd_bus* bus) override;
+    void discard() override;
+  };
+  dbus::RetryPolicy const* m_retry_policy;                      // When to send the call again after an error reply, if at all.
+  dbus::RetryBudget* m_retry_budget;                            // The budget to take retries from, if any.
+  unsigned int m_retries;                                       // The number of times the current call was sent again.
+  RetryRequest m_retry_request;                                 // Used to schedule sending the call again.
+
+  // Timestamps of the phases of the call (see dbus::MethodLatency).
+  std::chrono::steady_clock::time_point m_started;              // When the task was run.
+  std::chrono::steady_clock::time_point m_connection_set_up;    // When the connection was set up and the call was submitted.
+  std::chrono::steady_clock::time_point m_sent;                 // When the message was passed to sd_bus_call_async.
 
  protected:
   /// The base class of this task.
@@ -30,8 +123,8 @@ class DBusMethodCall : public AIStatefulTask
   /// The different states of the stateful task.
   enum DBusMethodCall_state_type {
     DBusMethodCall_start = direct_base_type::state_end,
-    DBusMethodCall_wait_for_lock,
-    DBusMethodCall_locked,
+    DBusMethodCall_connect,
+    DBusMethodCall_submit,
     DBusMethodCall_done
   };
 
@@ -39,7 +132,10 @@ class DBusMethodCall : public AIStatefulTask
   /// One beyond the largest state of this task.
   static constexpr state_type state_end = DBusMethodCall_done + 1;
 
-  DBusMethodCall(CWDEBUG_ONLY(bool debug = false)) : AIStatefulTask(CWDEBUG_ONLY(debug))
+  DBusMethodCall(CWDEBUG_ONLY(bool debug = false)) : AIStatefulTask(CWDEBUG_ONLY(debug)),
+    m_timeout(0), m_deadline(std::chrono::steady_clock::time_point::max()), m_pool(nullptr), m_no_reply(false), m_reply_cache(nullptr),
+    m_concurrency_limiter(nullptr), m_permit(no_permit), m_cancelled(false), m_replied(true), m_cancellation_group(nullptr),
+    m_retry_policy(nullptr), m_retry_budget(nullptr)
   {
     DoutEntering(dc::statefultask(mSMDebug), "DBusMethodCall() [" << (void*)this << "]");
   }
@@ -52,16 +148,119 @@ class DBusMethodCall : public AIStatefulTask
     m_destination = destination;
   }
 
-  void set_params_callback(std::function<void(dbus::Message&)> params_callback)
+  // The params callback is called again when the call is sent again after reconnecting (see DBusConnectionData::set_reconnect_policy).
+  void set_params_callback(params_callback_type params_callback)
   {
     m_params_callback = std::move(params_callback);
   }
 
-  void set_reply_callback(std::function<void(dbus::MessageRead const&)> reply_callback)
+  void set_reply_callback(reply_callback_type reply_callback)
   {
     m_reply_callback = std::move(reply_callback);
   }
 
+  // Called by the task, running in its own handler without holding the connection lock, after the reply callback was called.
+  // If the call couldn't be sent then the reply callback isn't called and the exception is passed instead.
+  // For a pooled task, the task might already be used for the next call when this is called.
+  void set_done_callback(done_callback_type done_callback)
+  {
+    m_done_callback = std::move(done_callback);
+  }
+
+  // Let the call fail with org.freedesktop.DBus.Error.Timeout when no reply was received within timeout after sending it.
+  void set_timeout(std::chrono::microseconds timeout)
+  {
+    m_timeout = timeout;
+  }
+
+  // Let the call fail with org.freedesktop.DBus.Error.Timeout when no reply was received at deadline.
+  // This includes the time spent waiting for the connection. If both a timeout and a deadline are set, whichever expires first applies.
+  void set_deadline(std::chrono::steady_clock::time_point deadline)
+  {
+    m_deadline = deadline;
+  }
+
+  // Send the call with the NO_REPLY_EXPECTED flag: the peer doesn't reply and the task finishes
+  // as soon as the message was passed to sd_bus_send. The reply callback is not used; failing to
+  // create or send the message aborts the task.
+  // Can't be used for tasks of a DBusMethodCallPool.
+  void set_no_reply(bool no_reply = true)
+  {
+    m_no_reply = no_reply;
+  }
+
+  // Set the arguments of the call, and let identical calls share their reply.
+  //
+  // This sets a params callback that appends args. If, when this call is submitted, an identical call
+  // (same destination and arguments) to the same connection is still waiting for its reply, then no
+  // message is sent: this call gets the reply of that call instead. Only use this for idempotent calls.
+  // Call set_destination first.
+  template<typename... Args>
+  void set_coalesced_params(Args... args)
+  {
+    m_coalescing_key = dbus::coalescing_key(*m_destination, args...);
+    m_params_callback = [args...](dbus::Message& message){ (message.append(args), ...); };
+  }
+
+  // Like set_coalesced_params, but use a params callback that was set with set_params_callback.
+  // The caller guarantees that calls to the same destination with the same key have the same arguments.
+  void set_coalescing_key(std::string const& key)
+  {
+    m_coalescing_key = dbus::coalescing_key(*m_destination, key);
+  }
+
+  // Look up the reply in reply_cache before sending the call, and store the reply there after receiving it.
+  // On a cache hit the reply callback is called without obtaining a connection or its lock.
+  // The key of the call must be set with set_coalesced_params or set_coalescing_key.
+  void set_reply_cache(dbus::ReplyCache* reply_cache)
+  {
+    m_reply_cache = reply_cache;
+  }
+
+  // Don't send the call while the number of calls in flight that use concurrency_limiter is at its limit.
+  // A call that has to wait does so before requesting a connection. Use one limiter per destination.
+  void set_concurrency_limiter(dbus::ConcurrencyLimiter* concurrency_limiter)
+  {
+    m_concurrency_limiter = concurrency_limiter;
+  }
+
+  // Send the call again, after a random backoff, when it fails with one of the errors of retry_policy.
+  // The message is rebuilt with the params callback; the reply callback only sees the last reply.
+  // If retry_budget isn't null then every retry takes a token from it, and every successful call adds to it.
+  // Both objects must outlive the task.
+  void set_retry_policy(dbus::RetryPolicy const* retry_policy, dbus::RetryBudget* retry_budget = nullptr)
+  {
+    m_retry_policy = retry_policy;
+    m_retry_budget = retry_budget;
+  }
+
+  // Make this call a member of cancellation_group while it runs (see dbus::CancellationGroup::cancel).
+  void set_cancellation_group(dbus::CancellationGroup* cancellation_group)
+  {
+    m_cancellation_group = cancellation_group;
+  }
+
+  // Cancel the call. This function is thread-safe and does not block.
+  //
+  // A call that wasn't sent yet isn't sent anymore. A call that is waiting for its reply is dropped by the
+  // DBusHandleIO task of the connection: the slot is unreferenced so that a late reply is ignored by sd-bus.
+  // Unless the reply was received already, the task aborts and the done callback receives std::errc::operation_canceled.
+  // Only call this while the task runs. Cancelling a pooled task only cancels its current call.
+  void cancel()
+  {
+    if (!m_cancelled.exchange(true, std::memory_order_relaxed))
+      signal(cancel_requested);
+  }
+
+  // Allocate DBusMethodCall objects from the AIMemoryPagePool (see statefultask/DefaultMemoryPagePool.h).
+  // The AIMemoryPagePool must be created before the first DBusMethodCall.
+  static void* operator new(std::size_t size);
+  static void operator delete(void* ptr, std::size_t size);
+
+  // Create the memory resource that operator new allocates from, if that didn't happen yet.
+  // Called by the constructor of DBusMethodCallPool, so that a missing AIMemoryPagePool shows up there.
+  static void init_memory_resource();
+
 #ifdef CWDEBUG
   bool is_same_bus(sd_bus* bus) const { return m_dbus_connection->get_bus() == bus; }
 #endif
@@ -69,10 +268,42 @@ class DBusMethodCall : public AIStatefulTask
  private:
   void reply_callback(dbus::MessageRead const& message);
 
+  // Create the message and send it.
+  void send(sd_bus* bus);
+
+  // Create the message and send it without expecting a reply.
+  void send_no_reply(sd_bus* bus);
+
+  // Coalescing.
+  void follower_reply(dbus::MessageRead const& message);
+  bool reply_from_cache();
+  void release_permit(bool completed);
+  void drop_pending();
+  void cancel_pending();
+  bool retry(dbus::MessageRead const& message);
+  void detach_followers(std::exception_ptr const& exception);
+
+  friend class DBusMethodCallPool;
+  // Start the next call of a pooled task.
+  void next_call()
+  {
+    m_cancelled.store(false, std::memory_order_relaxed);
+    m_started = std::chrono::steady_clock::now();
+    signal(call_requested);
+  }
+
+  // Implementation of dbus::OutboundRequest.
+  void submit(sd_bus* bus) override;
+  void discard() override;
+
+  // Implementation of dbus::BusUser.
+  void bus_lost(dbus::ReconnectPolicy const& policy) override;
+  void bus_restored(sd_bus* bus) override;
+
   static int reply_callback(sd_bus_message* m, void* userdata, sd_bus_error* UNUSED_ARG(empty_error))
   {
     DBusMethodCall* self = static_cast<DBusMethodCall*>(userdata);
-    self->reply_callback({m, self->m_dbus_connection->get_bus()});
+    self->reply_callback({m, self->m_dbus_connection->get_locked_bus()});
     return 0;
   }
 
@@ -86,8 +317,10 @@ class DBusMethodCall : public AIStatefulTask
   // Implementation of virtual functions of AIStatefulTask.
   char const* condition_str_impl(condition_type condition) const override;
   char const* state_str_impl(state_type run_state) const override;
+  void initialize_impl() override;
   void multiplex_impl(state_type run_state) override;
   void abort_impl() override;
+  void finish_impl() override;
 };
 
 } //namespace task
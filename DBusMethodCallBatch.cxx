@@ -0,0 +1,235 @@
+#include "sys.h"
+#include "systemd_sd-bus.h"
+#include "DBusMethodCallBatch.h"
+#include <algorithm>
+#include <system_error>
+
+namespace utils { using namespace threading; }
+namespace task {
+
+char const* DBusMethodCallBatch::condition_str_impl(condition_type condition) const
+{
+  switch (condition)
+  {
+    AI_CASE_RETURN(connection_set_up);
+    AI_CASE_RETURN(have_all_replies);
+  }
+  return direct_base_type::condition_str_impl(condition);
+}
+
+char const* DBusMethodCallBatch::state_str_impl(state_type run_state) const
+{
+  switch(run_state)
+  {
+    AI_CASE_RETURN(DBusMethodCallBatch_start);
+    AI_CASE_RETURN(DBusMethodCallBatch_submit);
+    AI_CASE_RETURN(DBusMethodCallBatch_done);
+  }
+  AI_NEVER_REACHED;
+}
+
+char const* DBusMethodCallBatch::task_name_impl() const
+{
+  return "DBusMethodCallBatch";
+}
+
+void DBusMethodCallBatch::reply_callback(Element& element, dbus::MessageRead const& message)
+{
+  size_t const index = &element - m_elements.data();
+  DoutEntering(dc::notice, "DBusMethodCallBatch::reply_callback() for call " << index);
+  {
+    auto now = std::chrono::steady_clock::now();
+    dbus::MethodLatency& latency = m_destination->latency();
+    latency.record(dbus::MethodLatency::reply, now - m_sent);
+    latency.record(dbus::MethodLatency::total, now - m_started);
+  }
+  // This is a callback from sd_bus, so we have the lock on the connection.
+  m_reply_callback(index, message);
+  sd_bus_slot_unref(element.m_slot);
+  element.m_slot = nullptr;
+  element.m_replied = true;
+  m_dbus_connection->metrics().reply_done();
+  if (--m_pending > 0)
+    return;
+  m_dbus_connection->unregister_bus_user(this);
+  // See DBusMethodCall::reply_callback.
+  ASSERT(!is_immediate());
+  signal(have_all_replies);
+}
+
+void DBusMethodCallBatch::initialize_impl()
+{
+  DoutEntering(dc::statefultask(mSMDebug), "DBusMethodCallBatch::initialize_impl() [" << (void*)this << "]");
+  m_submit_exception = nullptr;
+  m_aborted = false;
+  m_elements.assign(m_params_callbacks.size(), Element{this, nullptr, false});
+  m_pending = 0;
+  m_started = std::chrono::steady_clock::now();
+  set_state(DBusMethodCallBatch_start);
+}
+
+// Called by the DBusHandleIO task of the connection, while it holds the connection lock.
+void DBusMethodCallBatch::submit(sd_bus* bus)
+{
+  DoutEntering(dc::notice, "DBusMethodCallBatch::submit() with " << m_elements.size() << " calls");
+  // Release the reference that kept this task alive while it was in the submission queue when leaving this function.
+  boost::intrusive_ptr<DBusMethodCallBatch> self = std::move(m_keep_alive);
+  if (AI_UNLIKELY(m_aborted))
+    return;
+  dbus::MethodLatency& latency = m_destination->latency();
+  latency.record(dbus::MethodLatency::broker_wait, m_connection_set_up - m_started);
+  latency.record(dbus::MethodLatency::queue_wait, std::chrono::steady_clock::now() - m_connection_set_up);
+  try
+  {
+    for (Element& element : m_elements)
+      send(bus, element);
+    m_dbus_connection->register_bus_user(this);
+  }
+  catch (...)
+  {
+    // Cancel the calls that were already sent, so that m_pending doesn't count calls that will never
+    // be replied to and the reply callback isn't called for half a batch. The exception is rethrown
+    // from multiplex_impl, which aborts the task: the callback passed to run() is called with false.
+    cancel_pending();
+    m_submit_exception = std::current_exception();
+    signal(have_all_replies);
+  }
+}
+
+// Called by the DBusHandleIO task of the connection, while it holds the connection lock, when it finishes before this batch was submitted.
+void DBusMethodCallBatch::discard()
+{
+  DoutEntering(dc::notice, "DBusMethodCallBatch::discard()");
+  // Release the reference that kept this task alive while it was in the submission queue when leaving this function.
+  boost::intrusive_ptr<DBusMethodCallBatch> self = std::move(m_keep_alive);
+  if (AI_UNLIKELY(m_aborted))
+    return;
+  // None of the calls will be sent; let the batch fail.
+  m_submit_exception = std::make_exception_ptr(std::system_error(std::make_error_code(std::errc::not_connected)));
+  signal(have_all_replies);
+}
+
+// Called while holding the connection lock.
+void DBusMethodCallBatch::cancel_pending()
+{
+  // Make sure that DBusMethodCallBatch::reply_callback is not called anymore.
+  for (Element& element : m_elements)
+    if (element.m_slot)
+    {
+      sd_bus_slot_unref(element.m_slot);
+      element.m_slot = nullptr;
+      m_dbus_connection->metrics().reply_done();
+    }
+  m_pending = 0;
+}
+
+// Called while holding the connection lock.
+void DBusMethodCallBatch::send(sd_bus* bus, Element& element)
+{
+  auto const start = std::chrono::steady_clock::now();
+  dbus::Message message;
+  message.create_message(m_dbus_connection, *m_destination);
+  m_params_callbacks[&element - m_elements.data()](message);
+  int res = sd_bus_call_async(bus, &element.m_slot, message, &DBusMethodCallBatch::reply_callback, &element, m_timeout.count());
+  if (res < 0)
+    THROW_ALERTC(-res, "sd_bus_call_async");
+  m_sent = std::chrono::steady_clock::now();
+  m_destination->latency().record(dbus::MethodLatency::send, m_sent - start);
+  dbus::ConnectionMetrics& metrics = m_dbus_connection->metrics();
+  metrics.sent(SD_BUS_MESSAGE_METHOD_CALL);
+  metrics.reply_pending();
+  ++m_pending;
+}
+
+void DBusMethodCallBatch::bus_lost(dbus::ReconnectPolicy const& policy)
+{
+  // Let the calls fail with org.freedesktop.DBus.Error.NoReply, unless they should be sent again.
+  if (policy.m_in_flight != dbus::InFlightPolicy::retry)
+    return;
+  for (Element& element : m_elements)
+    if (element.m_slot)
+    {
+      sd_bus_slot_unref(element.m_slot);
+      element.m_slot = nullptr;
+      m_dbus_connection->metrics().reply_done();
+      --m_pending;
+    }
+}
+
+void DBusMethodCallBatch::bus_restored(sd_bus* bus)
+{
+  try
+  {
+    for (Element& element : m_elements)
+      if (!element.m_replied && !element.m_slot)
+        send(bus, element);
+  }
+  catch (...)
+  {
+    cancel_pending();
+    m_submit_exception = std::current_exception();
+    m_dbus_connection->unregister_bus_user(this);
+    signal(have_all_replies);
+  }
+}
+
+void DBusMethodCallBatch::multiplex_impl(state_type run_state)
+{
+  switch (run_state)
+  {
+    case DBusMethodCallBatch_start:
+    {
+      if (m_elements.empty())
+      {
+        finish();
+        break;
+      }
+      dbus::DBusConnectionBrokerKey const* broker_key = m_broker_key;
+      if (m_broker_key->is_pooled())
+      {
+        m_pool_key = m_broker_key->acquire_pool_connection(m_shard);
+        broker_key = &m_pool_key;
+      }
+      m_dbus_connection = m_broker->run(*broker_key, [this](bool success){ signal(connection_set_up); });
+      set_state(DBusMethodCallBatch_submit);
+      wait(connection_set_up);
+      break;
+    }
+    case DBusMethodCallBatch_submit:
+      m_connection_set_up = std::chrono::steady_clock::now();
+      set_state(DBusMethodCallBatch_done);
+      // Let the DBusHandleIO task create and send all messages in one go.
+      m_keep_alive = this;
+      m_dbus_connection->submit(this);
+      wait(have_all_replies);
+      break;
+    case DBusMethodCallBatch_done:
+      if (AI_UNLIKELY(m_submit_exception))
+        std::rethrow_exception(std::exchange(m_submit_exception, nullptr));
+      finish();
+      break;
+  }
+}
+
+void DBusMethodCallBatch::abort_impl()
+{
+  if (AI_UNLIKELY(m_dbus_connection))     // Could be aborted before it even got the chance to run DBusMethodCallBatch_start.
+  {
+    // Scoped, blocking lock.
+    DBusLock lock(m_dbus_connection, true COMMA_CWDEBUG_ONLY(mSMDebug));
+    // In case we're still in the submission queue.
+    m_aborted = true;
+    cancel_pending();
+    if (is_registered())
+      m_dbus_connection->unregister_bus_user(this);
+  }
+}
+
+void DBusMethodCallBatch::finish_impl()
+{
+  // Also called after an abort.
+  if (m_broker_key->is_pooled() && m_dbus_connection)
+    m_broker_key->release_pool_connection(m_shard);
+}
+
+} // namespace task
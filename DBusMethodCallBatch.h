@@ -0,0 +1,161 @@
+#pragma once
+
+#include "Message.h"
+#include "DBusConnectionBrokerKey.h"
+#include "Destination.h"
+#include "MethodLatency.h"
+#include "SubmissionQueue.h"
+#include "BusUser.h"
+#include "InlineFunction.h"
+#include "statefultask/Broker.h"
+#include "debug.h"
+#include <exception>
+#include <chrono>
+#include <vector>
+
+namespace task {
+
+// Call the same destination many times at once.
+//
+// The connection is looked up once, and all messages are created and sent by task::DBusHandleIO
+// during a single hold of the connection lock. Each reply is passed to the reply callback together
+// with the index of the call; the task finishes when all replies were received.
+// If creating or sending one of the messages fails then the calls that were already sent
+// are cancelled and the task is aborted (the callback passed to run() is called with false).
+class DBusMethodCallBatch : public AIStatefulTask, public dbus::OutboundRequest, public dbus::BusUser
+{
+ public:
+  using params_callback_type = dbus::InlineFunction<void(dbus::Message&)>;
+  using reply_callback_type = dbus::InlineFunction<void(size_t, dbus::MessageRead const&)>;
+
+ private:
+  static constexpr condition_type connection_set_up = 1;
+  static constexpr condition_type have_all_replies = 2;
+
+  struct Element
+  {
+    DBusMethodCallBatch* m_batch;
+    sd_bus_slot* m_slot;                                        // The slot of the pending method call, if any.
+    bool m_replied;                                             // Set when the reply was received.
+  };
+
+  boost::intrusive_ptr<task::Broker<task::DBusConnection>> m_broker;
+  dbus::DBusConnectionBrokerKey const* m_broker_key;
+  dbus::DBusConnectionBrokerKey m_pool_key;                     // The key of the pool connection that is used, if m_broker_key->is_pooled().
+  unsigned int m_shard;                                         // The index of that connection in the pool.
+  dbus::Destination const* m_destination;
+  std::vector<params_callback_type> m_params_callbacks;         // One per call.
+  reply_callback_type m_reply_callback;
+  std::vector<Element> m_elements;                              // One per call.
+  size_t m_pending;                                             // The number of calls that are waiting for a reply.
+  boost::intrusive_ptr<task::DBusConnection const> m_dbus_connection;
+  std::chrono::microseconds m_timeout;                          // The timeout of each call, or zero to use the default of sd_bus (25 seconds).
+  boost::intrusive_ptr<DBusMethodCallBatch> m_keep_alive;       // Keeps this task alive while it is in the submission queue of the connection.
+  std::exception_ptr m_submit_exception;                        // Set when submit failed.
+  bool m_aborted;                                               // Set (under the connection lock) when the task was aborted.
+
+  // Timestamps of the phases of the calls (see dbus::MethodLatency).
+  std::chrono::steady_clock::time_point m_started;              // When the task was run.
+  std::chrono::steady_clock::time_point m_connection_set_up;    // When the connection was set up and the batch was submitted.
+  std::chrono::steady_clock::time_point m_sent;                 // When the last message was passed to sd_bus_call_async.
+
+ protected:
+  /// The base class of this task.
+  using direct_base_type = AIStatefulTask;
+
+  /// The different states of the stateful task.
+  enum DBusMethodCallBatch_state_type {
+    DBusMethodCallBatch_start = direct_base_type::state_end,
+    DBusMethodCallBatch_submit,
+    DBusMethodCallBatch_done
+  };
+
+ public:
+  /// One beyond the largest state of this task.
+  static constexpr state_type state_end = DBusMethodCallBatch_done + 1;
+
+  DBusMethodCallBatch(CWDEBUG_ONLY(bool debug = false)) : AIStatefulTask(CWDEBUG_ONLY(debug)), m_pending(0), m_timeout(0)
+  {
+    DoutEntering(dc::statefultask(mSMDebug), "DBusMethodCallBatch() [" << (void*)this << "]");
+  }
+
+  // The Destination object must have a life-time longer than the time it takes to finish task::DBusConnection.
+  void set_destination(boost::intrusive_ptr<task::Broker<task::DBusConnection>> broker, dbus::DBusConnectionBrokerKey const* broker_key, dbus::Destination const* destination)
+  {
+    m_broker = broker;
+    m_broker_key = broker_key;
+    m_destination = destination;
+  }
+
+  // Set the params callbacks, one per call. The index of a call is its index in params_callbacks.
+  // A params callback is called again when its call is sent again after reconnecting.
+  void set_params_callbacks(std::vector<params_callback_type> params_callbacks)
+  {
+    m_params_callbacks = std::move(params_callbacks);
+  }
+
+  // Add one call; returns its index. Calls can only be added before the task is run.
+  size_t add_params_callback(params_callback_type params_callback)
+  {
+    m_params_callbacks.push_back(std::move(params_callback));
+    return m_params_callbacks.size() - 1;
+  }
+
+  // Called for each reply (or error), with the index of the call that it belongs to.
+  // Use the callback passed to run() to be notified when all replies were received.
+  void set_reply_callback(reply_callback_type reply_callback)
+  {
+    m_reply_callback = std::move(reply_callback);
+  }
+
+  // Let each call fail with org.freedesktop.DBus.Error.Timeout when no reply was received within timeout after sending it.
+  void set_timeout(std::chrono::microseconds timeout)
+  {
+    m_timeout = timeout;
+  }
+
+  size_t size() const { return m_params_callbacks.size(); }
+
+ private:
+  void reply_callback(Element& element, dbus::MessageRead const& message);
+
+  // Create the message of element and send it.
+  void send(sd_bus* bus, Element& element);
+
+  // Stop waiting for the replies of the calls that were sent.
+  void cancel_pending();
+
+  // Implementation of dbus::OutboundRequest.
+  void submit(sd_bus* bus) override;
+  void discard() override;
+
+  // Implementation of dbus::BusUser.
+  void bus_lost(dbus::ReconnectPolicy const& policy) override;
+  void bus_restored(sd_bus* bus) override;
+
+  static int reply_callback(sd_bus_message* m, void* userdata, sd_bus_error* UNUSED_ARG(empty_error))
+  {
+    Element* element = static_cast<Element*>(userdata);
+    DBusMethodCallBatch* self = element->m_batch;
+    self->reply_callback(*element, {m, self->m_dbus_connection->get_locked_bus()});
+    return 0;
+  }
+
+ protected:
+  /// Call finish() (or abort()), not delete.
+  ~DBusMethodCallBatch() override
+  {
+    DoutEntering(dc::statefultask(mSMDebug), "~DBusMethodCallBatch() [" << (void*)this << "]");
+  }
+
+  // Implementation of virtual functions of AIStatefulTask.
+  char const* condition_str_impl(condition_type condition) const override;
+  char const* state_str_impl(state_type run_state) const override;
+  char const* task_name_impl() const override;
+  void initialize_impl() override;
+  void multiplex_impl(state_type run_state) override;
+  void abort_impl() override;
+  void finish_impl() override;
+};
+
+} //namespace task
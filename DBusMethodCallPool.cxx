@@ -0,0 +1,115 @@
+#include "sys.h"
+#include "DBusMethodCallPool.h"
+#include <algorithm>
+
+namespace task {
+
+char const* DBusMethodCallPool::condition_str_impl(condition_type condition) const
+{
+  switch (condition)
+  {
+    AI_CASE_RETURN(stop_called);
+  }
+  return direct_base_type::condition_str_impl(condition);
+}
+
+char const* DBusMethodCallPool::state_str_impl(state_type run_state) const
+{
+  switch(run_state)
+  {
+    AI_CASE_RETURN(DBusMethodCallPool_start);
+    AI_CASE_RETURN(DBusMethodCallPool_done);
+  }
+  AI_NEVER_REACHED;
+}
+
+char const* DBusMethodCallPool::task_name_impl() const
+{
+  return "DBusMethodCallPool";
+}
+
+void DBusMethodCallPool::call(DBusMethodCall::params_callback_type params_callback, DBusMethodCall::reply_callback_type reply_callback,
+    DBusMethodCall::done_callback_type done_callback, std::chrono::steady_clock::time_point deadline)
+{
+  // The reply callback is called while holding the connection lock.
+  ASSERT(!m_call_handler.is_immediate());
+  DBusMethodCall* method_call = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(m_calls_mutex);
+    if (!m_idle.empty())
+    {
+      method_call = m_idle.back();
+      m_idle.pop_back();
+    }
+  }
+  if (method_call)
+  {
+    // The task is waiting for call_requested and doesn't touch its callbacks until it is signalled.
+    method_call->set_params_callback(std::move(params_callback));
+    method_call->set_reply_callback(std::move(reply_callback));
+    method_call->set_done_callback(std::move(done_callback));
+    method_call->set_deadline(deadline);
+    method_call->next_call();
+    return;
+  }
+  // Grow the pool.
+  auto new_call = statefultask::create<DBusMethodCall>(CWDEBUG_ONLY(mSMDebug));
+  new_call->set_destination(m_broker, m_broker_key, m_destination);
+  new_call->set_params_callback(std::move(params_callback));
+  new_call->set_reply_callback(std::move(reply_callback));
+  new_call->set_done_callback(std::move(done_callback));
+  new_call->set_deadline(deadline);
+  new_call->m_pool = this;
+  {
+    std::lock_guard<std::mutex> lock(m_calls_mutex);
+    m_calls.push_back(new_call);
+  }
+  new_call->run(m_call_handler, [self = boost::intrusive_ptr<DBusMethodCallPool>(this), method_call = new_call.get()](bool UNUSED_ARG(success)){
+    self->call_gone(method_call);
+  });
+}
+
+void DBusMethodCallPool::idle(DBusMethodCall* method_call)
+{
+  std::lock_guard<std::mutex> lock(m_calls_mutex);
+  m_idle.push_back(method_call);
+}
+
+void DBusMethodCallPool::call_gone(DBusMethodCall* method_call)
+{
+  std::lock_guard<std::mutex> lock(m_calls_mutex);
+  m_idle.erase(std::remove(m_idle.begin(), m_idle.end(), method_call), m_idle.end());
+  auto iter = std::find_if(m_calls.begin(), m_calls.end(), [method_call](auto const& call){ return call.get() == method_call; });
+  if (iter != m_calls.end())
+    m_calls.erase(iter);
+}
+
+void DBusMethodCallPool::multiplex_impl(state_type run_state)
+{
+  switch (run_state)
+  {
+    case DBusMethodCallPool_start:
+      set_state(DBusMethodCallPool_done);
+      wait(stop_called);
+      break;
+    case DBusMethodCallPool_done:
+      finish();
+      break;
+  }
+}
+
+void DBusMethodCallPool::finish_impl()
+{
+  // Also called after an abort.
+  std::vector<boost::intrusive_ptr<DBusMethodCall>> calls;
+  {
+    std::lock_guard<std::mutex> lock(m_calls_mutex);
+    calls = m_calls;
+    m_idle.clear();
+  }
+  // Don't hold m_calls_mutex while aborting: that calls call_gone.
+  for (auto& method_call : calls)
+    method_call->abort();
+}
+
+} // namespace task
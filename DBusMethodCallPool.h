@@ -0,0 +1,114 @@
+#pragma once
+
+#include "DBusMethodCall.h"
+#include "statefultask/AIStatefulTask.h"
+#include <mutex>
+#include <vector>
+#include "debug.h"
+
+namespace task {
+
+// A pool of reusable DBusMethodCall tasks, all calling the same destination.
+//
+// A pooled DBusMethodCall doesn't finish after receiving its reply: it goes back to the pool
+// and waits for the next call, keeping its connection. Once the pool contains enough tasks
+// to serve the number of concurrent calls, call() doesn't create tasks anymore and
+// doesn't go through the broker.
+//
+// Like the broker, this task never finishes by itself; call stop() (or abort()) when done.
+//
+// The DBusMethodCall tasks are allocated from the AIMemoryPagePool, which therefore must
+// be created (at the top of main) before a DBusMethodCallPool is constructed.
+class DBusMethodCallPool : public AIStatefulTask
+{
+ public:
+  static constexpr condition_type stop_called = 1;
+
+ private:
+  boost::intrusive_ptr<task::Broker<task::DBusConnection>> m_broker;
+  dbus::DBusConnectionBrokerKey const* m_broker_key;
+  dbus::Destination const* m_destination;
+  Handler m_call_handler;                                       // The handler to run the DBusMethodCall tasks with.
+
+  std::mutex m_calls_mutex;                                     // Protects m_calls and m_idle.
+  std::vector<boost::intrusive_ptr<DBusMethodCall>> m_calls;    // All tasks of the pool.
+  std::vector<DBusMethodCall*> m_idle;                          // The tasks that are waiting for a call.
+
+ protected:
+  /// The base class of this task.
+  using direct_base_type = AIStatefulTask;
+
+  /// The different states of the stateful task.
+  enum DBusMethodCallPool_state_type {
+    DBusMethodCallPool_start = direct_base_type::state_end,
+    DBusMethodCallPool_done
+  };
+
+ public:
+  /// One beyond the largest state of this task.
+  static constexpr state_type state_end = DBusMethodCallPool_done + 1;
+
+  // The DBusMethodCall tasks are run with call_handler; this may not be Handler::immediate
+  // because the reply callbacks are called while holding the connection lock.
+  DBusMethodCallPool(Handler call_handler COMMA_CWDEBUG_ONLY(bool debug = false)) :
+    AIStatefulTask(CWDEBUG_ONLY(debug)), m_broker_key(nullptr), m_destination(nullptr), m_call_handler(call_handler)
+  {
+    DoutEntering(dc::statefultask(mSMDebug), "DBusMethodCallPool() [" << (void*)this << "]");
+    ASSERT(!m_call_handler.is_immediate());
+    DBusMethodCall::init_memory_resource();
+  }
+
+  // See DBusMethodCall::set_destination. The broker key and destination must outlive this task.
+  void set_destination(boost::intrusive_ptr<task::Broker<task::DBusConnection>> broker, dbus::DBusConnectionBrokerKey const* broker_key, dbus::Destination const* destination)
+  {
+    m_broker = std::move(broker);
+    m_broker_key = broker_key;
+    m_destination = destination;
+  }
+
+  // Run the DBusMethodCall tasks that are created from now on with handler; this may not be Handler::immediate.
+  void set_call_handler(Handler handler)
+  {
+    ASSERT(!handler.is_immediate());
+    m_call_handler = handler;
+  }
+
+  // Reserve space for size tasks, so that growing the pool up till that size doesn't reallocate.
+  void reserve(size_t size)
+  {
+    std::lock_guard<std::mutex> lock(m_calls_mutex);
+    m_calls.reserve(size);
+    m_idle.reserve(size);
+  }
+
+  // Call the destination; see DBusMethodCall::set_params_callback, DBusMethodCall::set_reply_callback,
+  // DBusMethodCall::set_done_callback and DBusMethodCall::set_deadline.
+  // This function is thread-safe. Must not be called after stop().
+  void call(DBusMethodCall::params_callback_type params_callback, DBusMethodCall::reply_callback_type reply_callback,
+      DBusMethodCall::done_callback_type done_callback = nullptr, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+  void stop() { signal(stop_called); }
+
+ private:
+  friend class DBusMethodCall;
+  // Called by a pooled DBusMethodCall when it is ready for the next call.
+  void idle(DBusMethodCall* method_call);
+  // Called when a pooled DBusMethodCall finished (it was aborted).
+  void call_gone(DBusMethodCall* method_call);
+
+ protected:
+  /// Call finish() (or abort()), not delete.
+  ~DBusMethodCallPool() override
+  {
+    DoutEntering(dc::statefultask(mSMDebug), "~DBusMethodCallPool() [" << (void*)this << "]");
+  }
+
+  // Implementation of virtual functions of AIStatefulTask.
+  char const* condition_str_impl(condition_type condition) const override;
+  char const* state_str_impl(state_type run_state) const override;
+  char const* task_name_impl() const override;
+  void multiplex_impl(state_type run_state) override;
+  void finish_impl() override;
+};
+
+} // namespace task
@@ -1,6 +1,7 @@
 #include "sys.h"
 #include "systemd_sd-bus.h"
 #include "DBusObject.h"
+#include <cstring>
 
 namespace task {
 
@@ -40,6 +41,14 @@ void DBusObject::multiplex_impl(state_type run_state)
   {
     case DBusObject_start:
     {
+      if (m_server)
+      {
+        // Install the object on the connections of all current and future clients of the server.
+        m_server->add_object(this);
+        set_state(DBusObject_done);
+        wait(stop_called);
+        break;
+      }
       m_dbus_connection = m_broker->run(*m_broker_key, [this](bool success){ Dout(dc::statefultask(mSMDebug), "dbus_connection finished!"); signal(connection_set_up); });
       Dout(dc::dbus, "Requested name = \"" << m_dbus_connection->service_name() << "\" [" << this << "]");
       set_state(DBusObject_wait_for_lock);
@@ -61,6 +70,9 @@ void DBusObject::multiplex_impl(state_type run_state)
       DBusLock lock(m_dbus_connection);
       Dout(dc::dbus, "Unique name = \"" << m_dbus_connection->get_unique_name() << "\" [" << this << "]");
       int res = sd_bus_add_object(m_dbus_connection->get_bus(), &m_slot, m_interface->object_path(), &DBusObject::s_object_callback, this);
+      // Install the object again after reconnecting.
+      if (res >= 0)
+        m_dbus_connection->register_bus_user(this);
       lock.unlock();
       if (res < 0)
         THROW_ALERTC(-res, "sd_bus_add_object");
@@ -73,10 +85,23 @@ void DBusObject::multiplex_impl(state_type run_state)
   }
 }
 
+void DBusObject::bus_lost(dbus::ReconnectPolicy const& UNUSED_ARG(policy))
+{
+  sd_bus_slot_unref(m_slot);
+  m_slot = nullptr;
+}
+
+void DBusObject::bus_restored(sd_bus* bus)
+{
+  int res = sd_bus_add_object(bus, &m_slot, m_interface->object_path(), &DBusObject::s_object_callback, this);
+  if (res < 0)
+    Dout(dc::warning, "DBusObject: sd_bus_add_object failed after reconnecting: " << strerror(-res) << " [" << this << "]");
+}
+
 void DBusObject::abort_impl()
 {
   DoutEntering(dc::statefultask(mSMDebug), "DBusObject::abort_impl() [" << this << "]");
-  if (m_slot)
+  if (m_slot || is_registered())
   {
     // Scoped, blocking lock.
     DBusLock lock(m_dbus_connection, true COMMA_CWDEBUG_ONLY(mSMDebug));
@@ -84,8 +109,17 @@ void DBusObject::abort_impl()
     Dout(dc::statefultask(mSMDebug), "Calling sd_bus_slot_unref(m_slot) and setting m_slot to nullptr (making sure the callback is no longer called)");
     sd_bus_slot_unref(m_slot);
     m_slot = nullptr;
+    if (is_registered())
+      m_dbus_connection->unregister_bus_user(this);
   }
 }
 
+void DBusObject::finish_impl()
+{
+  // Also called after an abort.
+  if (m_server)
+    m_server->remove_object(this);
+}
+
 } // namespace task
 
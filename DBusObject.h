@@ -4,12 +4,14 @@
 #include "DBusConnectionBrokerKey.h"
 #include "Interface.h"
 #include "Error.h"
+#include "BusUser.h"
+#include "DBusServer.h"
 #include "statefultask/Broker.h"
 #include "debug.h"
 
 namespace task {
 
-class DBusObject : public AIStatefulTask
+class DBusObject : public AIStatefulTask, public dbus::BusUser
 {
  private:
   static constexpr condition_type connection_set_up = 1;
@@ -18,6 +20,7 @@ class DBusObject : public AIStatefulTask
 
   boost::intrusive_ptr<task::Broker<task::DBusConnection>> m_broker;
   dbus::DBusConnectionBrokerKey const* m_broker_key;
+  boost::intrusive_ptr<task::DBusServer> m_server;              // Set instead of m_broker when serving the clients of a peer-to-peer server.
   dbus::Interface const* m_interface;
   boost::intrusive_ptr<task::DBusConnection const> m_dbus_connection;
   sd_bus_slot* m_slot;
@@ -51,6 +54,14 @@ class DBusObject : public AIStatefulTask
     m_interface = interface;
   }
 
+  // Serve the clients of server instead: the object is installed on the connection of every client.
+  // The Interface object must have a life-time longer than this task.
+  void set_interface(boost::intrusive_ptr<task::DBusServer> server, dbus::Interface const* interface)
+  {
+    m_server = std::move(server);
+    m_interface = interface;
+  }
+
   dbus::Interface const* get_interface() const
   {
     return m_interface;
@@ -68,10 +79,12 @@ class DBusObject : public AIStatefulTask
   }
 
 #ifdef CWDEBUG
-  bool is_same_bus(sd_bus* bus) const { return m_dbus_connection->get_bus() == bus; }
+  // When serving the clients of a peer-to-peer server any bus is one of ours.
+  bool is_same_bus(sd_bus* bus) const { return m_server || m_dbus_connection->get_bus() == bus; }
 #endif
 
  private:
+  friend class DBusServer;
   virtual bool object_callback(dbus::Message message) = 0;
 
   static int s_object_callback(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
@@ -80,13 +93,16 @@ class DBusObject : public AIStatefulTask
     DBusObject* self = static_cast<DBusObject*>(userdata);
     try
     {
-      handled = self->object_callback({m, self->m_dbus_connection->get_bus()});
-      if (handled)
+      // Use the bus of the message: when serving the clients of a peer-to-peer server every client has its own bus.
+      handled = self->object_callback({m, sd_bus_message_get_bus(m)});
+      // The slots installed by a DBusServer are removed by DBusServer::remove_object.
+      if (handled && self->m_slot)
       {
         // Make sure DBusObject::s_*_callback is not called again.
         Dout(dc::dbus(self->mSMDebug), "object_callback returned true: calling sd_bus_slot_unref(m_slot) and setting m_slot to nullptr (making sure the callback is no longer called)");
         sd_bus_slot_unref(self->m_slot);
         self->m_slot = nullptr;
+        self->m_dbus_connection->unregister_bus_user(self);
       }
     }
     catch (dbus::Error& error)
@@ -97,6 +113,10 @@ class DBusObject : public AIStatefulTask
     return handled;
   }
 
+  // Implementation of dbus::BusUser.
+  void bus_lost(dbus::ReconnectPolicy const& policy) override;
+  void bus_restored(sd_bus* bus) override;
+
  protected:
   /// Call finish() (or abort()), not delete.
   ~DBusObject() override
@@ -110,6 +130,7 @@ class DBusObject : public AIStatefulTask
   void initialize_impl() override;
   void multiplex_impl(state_type run_state) override;
   void abort_impl() override;
+  void finish_impl() override;
 };
 
 } //namespace task
@@ -0,0 +1,167 @@
+#include "sys.h"
+#include "DBusServer.h"
+#include "DBusObject.h"
+#include "DBusConnection.h"
+#include "utils/AIAlert.h"
+#include <algorithm>
+#include <cstring>
+
+namespace task {
+
+char const* DBusServer::condition_str_impl(condition_type condition) const
+{
+  switch (condition)
+  {
+    AI_CASE_RETURN(stop_called);
+  }
+  return direct_base_type::condition_str_impl(condition);
+}
+
+char const* DBusServer::state_str_impl(state_type run_state) const
+{
+  switch(run_state)
+  {
+    AI_CASE_RETURN(DBusServer_start);
+    AI_CASE_RETURN(DBusServer_listening);
+    AI_CASE_RETURN(DBusServer_done);
+  }
+  AI_NEVER_REACHED;
+}
+
+char const* DBusServer::task_name_impl() const
+{
+  return "DBusServer";
+}
+
+// Called from the EventLoop thread.
+void DBusServer::new_client(int fd)
+{
+  DoutEntering(dc::notice, "DBusServer::new_client(" << fd << ")");
+  auto handle_io = statefultask::create<DBusHandleIO>(CWDEBUG_ONLY(mSMDebug));
+  try
+  {
+    // This does not block: the authentication is done by handle_io.
+    handle_io->connection()->accept(fd, m_server_id, "DBusServer - client");
+    handle_io->metrics().set_description("DBusServer " + m_socket_path + " client fd:" + std::to_string(fd));
+  }
+  catch (AIAlert::Error const& error)
+  {
+    Dout(dc::warning, "Failed to set up the connection of a new client: " << error);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    Client& client = m_clients.emplace_back();
+    client.m_handle_io = handle_io;
+    // As long as handle_io isn't running, nobody else uses the bus and we don't need the connection lock.
+    for (DBusObject* object : m_objects)
+      install(client, object);
+  }
+  handle_io->run(m_client_handler, [this, self = boost::intrusive_ptr<DBusServer>(this), handle_io = handle_io.get()](bool UNUSED_ARG(success)){
+    client_gone(handle_io);
+  });
+}
+
+// Called while holding m_clients_mutex and the connection lock of client (or while the connection isn't used yet).
+void DBusServer::install(Client& client, DBusObject* object)
+{
+  sd_bus_slot* slot;
+  int res = sd_bus_add_object(client.m_handle_io->connection()->get_bus(), &slot, object->get_interface()->object_path(), &DBusObject::s_object_callback, object);
+  if (res < 0)
+  {
+    Dout(dc::warning, "DBusServer: sd_bus_add_object failed: " << strerror(-res));
+    return;
+  }
+  client.m_slots.emplace_back(object, slot);
+}
+
+void DBusServer::add_object(DBusObject* object)
+{
+  DoutEntering(dc::notice, "DBusServer::add_object(" << object << ")");
+  std::lock_guard<std::mutex> lock(m_clients_mutex);
+  m_objects.push_back(object);
+  for (Client& client : m_clients)
+  {
+    // Scoped, blocking lock.
+    DBusLock connection_lock(client.m_handle_io->mutex(), true COMMA_CWDEBUG_ONLY(mSMDebug));
+    install(client, object);
+  }
+}
+
+void DBusServer::remove_object(DBusObject* object)
+{
+  DoutEntering(dc::notice, "DBusServer::remove_object(" << object << ")");
+  std::lock_guard<std::mutex> lock(m_clients_mutex);
+  m_objects.erase(std::remove(m_objects.begin(), m_objects.end(), object), m_objects.end());
+  for (Client& client : m_clients)
+  {
+    auto slot = std::find_if(client.m_slots.begin(), client.m_slots.end(), [object](auto const& slot){ return slot.first == object; });
+    if (slot == client.m_slots.end())
+      continue;
+    // Scoped, blocking lock.
+    DBusLock connection_lock(client.m_handle_io->mutex(), true COMMA_CWDEBUG_ONLY(mSMDebug));
+    // Make sure DBusObject::s_object_callback is no longer called for this object.
+    sd_bus_slot_unref(slot->second);
+    client.m_slots.erase(slot);
+  }
+}
+
+// Called when the DBusHandleIO task of a client finished (the client disconnected, or the server is stopping).
+void DBusServer::client_gone(DBusHandleIO* handle_io)
+{
+  DoutEntering(dc::notice, "DBusServer::client_gone(" << (void*)handle_io << ")");
+  std::lock_guard<std::mutex> lock(m_clients_mutex);
+  auto client = std::find_if(m_clients.begin(), m_clients.end(), [handle_io](Client const& client){ return client.m_handle_io.get() == handle_io; });
+  if (client == m_clients.end())
+    return;
+  // The I/O task finished, so the only ones that could still use this bus are add_object and remove_object,
+  // but those hold m_clients_mutex.
+  for (auto& slot : client->m_slots)
+    sd_bus_slot_unref(slot.second);
+  m_clients.erase(client);
+}
+
+void DBusServer::multiplex_impl(state_type run_state)
+{
+  switch (run_state)
+  {
+    case DBusServer_start:
+    {
+      int ret = sd_id128_randomize(&m_server_id);
+      if (ret < 0)
+        THROW_ALERTC(-ret, "sd_id128_randomize");
+      m_listen_socket = evio::create<dbus::ListenSocket>(this);
+      m_listen_socket->listen(m_socket_path);
+      set_state(DBusServer_listening);
+      wait(stop_called);
+      break;
+    }
+    case DBusServer_listening:
+      set_state(DBusServer_done);
+      [[fallthrough]];
+    case DBusServer_done:
+      finish();
+      break;
+  }
+}
+
+void DBusServer::finish_impl()
+{
+  // Also called after an abort.
+  if (m_listen_socket)
+  {
+    m_listen_socket->close();
+    m_listen_socket.reset();
+  }
+  std::vector<boost::intrusive_ptr<DBusHandleIO>> handle_ios;
+  {
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    for (Client& client : m_clients)
+      handle_ios.push_back(client.m_handle_io);
+  }
+  // Don't hold m_clients_mutex while aborting: that calls client_gone.
+  for (auto& handle_io : handle_ios)
+    handle_io->abort();
+}
+
+} // namespace task
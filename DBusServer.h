@@ -0,0 +1,102 @@
+#pragma once
+
+#include "DBusHandleIO.h"
+#include "ListenSocket.h"
+#include "statefultask/AIStatefulTask.h"
+#include <systemd/sd-id128.h>
+#include <list>
+#include <mutex>
+#include <vector>
+#include "debug.h"
+
+namespace task {
+
+class DBusObject;
+
+// A peer-to-peer D-Bus server.
+//
+// Listens on a UNIX socket and gives every client that connects its own sd_bus,
+// running under its own DBusHandleIO task (and therefore its own connection lock),
+// so that clients are served in parallel. Clients connect with a DBusConnectionBrokerKey
+// on which set_address was called.
+//
+// Objects are served by running a DBusObject on which set_interface was called with
+// this server instead of a broker: it is installed on the connection of every client.
+class DBusServer : public AIStatefulTask
+{
+ public:
+  static constexpr condition_type stop_called = 1;
+
+ private:
+  struct Client
+  {
+    boost::intrusive_ptr<DBusHandleIO> m_handle_io;
+    std::vector<std::pair<DBusObject*, sd_bus_slot*>> m_slots;  // The objects installed on this connection.
+  };
+
+  std::string m_socket_path;                                    // The path of the UNIX socket to listen on.
+  Handler m_client_handler;                                     // The handler to run the DBusHandleIO tasks of clients with.
+  sd_id128_t m_server_id;                                       // The id of this server, as seen by clients.
+  boost::intrusive_ptr<dbus::ListenSocket> m_listen_socket;
+
+  std::mutex m_clients_mutex;                                   // Protects m_clients and m_objects.
+  std::list<Client> m_clients;
+  std::vector<DBusObject*> m_objects;
+
+ protected:
+  /// The base class of this task.
+  using direct_base_type = AIStatefulTask;
+
+  /// The different states of the stateful task.
+  enum DBusServer_state_type {
+    DBusServer_start = direct_base_type::state_end,
+    DBusServer_listening,
+    DBusServer_done
+  };
+
+ public:
+  /// One beyond the largest state of this task.
+  static constexpr state_type state_end = DBusServer_done + 1;
+
+  DBusServer(CWDEBUG_ONLY(bool debug = false)) : AIStatefulTask(CWDEBUG_ONLY(debug)), m_client_handler(Handler::immediate)
+  {
+    DoutEntering(dc::statefultask(mSMDebug), "DBusServer() [" << (void*)this << "]");
+  }
+
+  // Listen on the UNIX socket path (a leading '@' means an abstract socket).
+  // Clients connect to "unix:path=<path>" (or "unix:abstract=<name>").
+  void set_socket_path(std::string socket_path) { m_socket_path = std::move(socket_path); }
+
+  // Run the I/O of each client with handler. The default is Handler::immediate, which does the
+  // I/O of all clients in the EventLoop thread; pass a thread pool queue to spread clients over cores.
+  void set_client_handler(Handler handler) { m_client_handler = handler; }
+
+  void stop() { signal(stop_called); }
+
+  // Called by dbus::ListenSocket for every accepted connection.
+  void new_client(int fd);
+
+  // Called by DBusObject.
+  void add_object(DBusObject* object);
+  void remove_object(DBusObject* object);
+
+ private:
+  void install(Client& client, DBusObject* object);
+  void client_gone(DBusHandleIO* handle_io);
+
+ protected:
+  /// Call finish() (or abort()), not delete.
+  ~DBusServer() override
+  {
+    DoutEntering(dc::statefultask(mSMDebug), "~DBusServer() [" << (void*)this << "]");
+  }
+
+  // Implementation of virtual functions of AIStatefulTask.
+  char const* condition_str_impl(condition_type condition) const override;
+  char const* state_str_impl(state_type run_state) const override;
+  char const* task_name_impl() const override;
+  void multiplex_impl(state_type run_state) override;
+  void finish_impl() override;
+};
+
+} // namespace task
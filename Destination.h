@@ -1,19 +1,33 @@
 #pragma once
 
 #include "Interface.h"
+#include <atomic>
+#include <string>
 
 namespace dbus {
 
+class MethodLatency;
+
 class Destination : public Interface
 {
  protected:
   char const* m_method_name;
+  mutable std::atomic<MethodLatency*> m_latency;        // Cache of MethodLatency::get(*this).
+  std::string const* m_key_prefix;                      // Precomputed coalescing_key_prefix(*this), if not null (see MethodCallTemplate). Stays valid till the end of the program.
 
  public:
   Destination(char const* service_name, char const* object_path, char const* interface_name, char const* method_name) :
-    Interface(service_name, object_path, interface_name), m_method_name(method_name) { }
+    Interface(service_name, object_path, interface_name), m_method_name(method_name), m_latency(nullptr), m_key_prefix(nullptr) { }
+
+  Destination(Destination const& destination) :
+    Interface(destination), m_method_name(destination.m_method_name), m_latency(destination.m_latency.load(std::memory_order_relaxed)),
+    m_key_prefix(destination.m_key_prefix) { }
 
   char const* method_name() const { return m_method_name; }
+  std::string const* key_prefix() const { return m_key_prefix; }
+
+  // Return the latency histograms of method calls to this destination (see task::DBusMethodCall).
+  MethodLatency& latency() const;
 };
 
 } // namespace dbus
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "debug.h"
+
+namespace dbus {
+
+// The capacity (in bytes) of the callbacks that are stored by the tasks of this library.
+// A callable whose captures are larger than this doesn't compile; capture a pointer instead.
+static constexpr size_t default_callback_capacity = 64;
+
+template<typename Signature, size_t Capacity = default_callback_capacity>
+class InlineFunction;
+
+// A move-only replacement of std::function that stores the callable in a buffer of Capacity bytes
+// inside the object itself. A callable that doesn't fit is a compile error; nothing is ever allocated.
+//
+// Moving an InlineFunction moves the stored callable. Callables that can't be moved without throwing
+// (for example, a lambda that captures a const std::string by value, which is copied instead) are
+// supported, but then moving the InlineFunction might throw too. If it does, the moved-from object
+// keeps its callable.
+template<typename R, typename... Args, size_t Capacity>
+class InlineFunction<R(Args...), Capacity>
+{
+ private:
+  enum Operation { move_op, destroy_op };
+  using invoke_type = R (*)(void*, Args&&...);
+  using manage_type = void (*)(Operation, void*, void*);
+
+  alignas(std::max_align_t) unsigned char m_storage[Capacity];
+  invoke_type m_invoke;                         // Calls the stored callable, or nullptr if this object is empty.
+  manage_type m_manage;                         // Moves or destroys the stored callable.
+
+  template<typename F>
+  static R invoke(void* storage, Args&&... args)
+  {
+    return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+  }
+
+  template<typename F>
+  static void manage(Operation operation, void* storage, void* from)
+  {
+    // If the move (or copy) throws, from is left untouched.
+    if (operation == move_op)
+      new (storage) F(std::move(*static_cast<F*>(from)));
+    static_cast<F*>(operation == move_op ? from : storage)->~F();
+  }
+
+ public:
+  InlineFunction() : m_invoke(nullptr), m_manage(nullptr) { }
+  InlineFunction(std::nullptr_t) : InlineFunction() { }
+
+  template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InlineFunction> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+  InlineFunction(F&& callable)
+  {
+    using callable_type = std::decay_t<F>;
+    static_assert(sizeof(callable_type) <= Capacity, "The callable is too large: increase Capacity, or capture less (for example, a pointer).");
+    static_assert(alignof(callable_type) <= alignof(std::max_align_t), "The callable is over-aligned.");
+    new (m_storage) callable_type(std::forward<F>(callable));
+    m_invoke = &invoke<callable_type>;
+    m_manage = &manage<callable_type>;
+  }
+
+  InlineFunction(InlineFunction&& orig) : m_invoke(orig.m_invoke), m_manage(orig.m_manage)
+  {
+    if (m_manage)
+      m_manage(move_op, m_storage, orig.m_storage);
+    orig.m_invoke = nullptr;
+    orig.m_manage = nullptr;
+  }
+
+  InlineFunction(InlineFunction const&) = delete;
+
+  ~InlineFunction() { reset(); }
+
+  InlineFunction& operator=(InlineFunction&& orig)
+  {
+    if (this != &orig)
+    {
+      reset();
+      if (orig.m_manage)
+        orig.m_manage(move_op, m_storage, orig.m_storage);
+      m_invoke = orig.m_invoke;
+      m_manage = orig.m_manage;
+      orig.m_invoke = nullptr;
+      orig.m_manage = nullptr;
+    }
+    return *this;
+  }
+
+  InlineFunction& operator=(std::nullptr_t)
+  {
+    reset();
+    return *this;
+  }
+
+  // Destroy the stored callable, if any.
+  void reset()
+  {
+    if (m_manage)
+      m_manage(destroy_op, m_storage, nullptr);
+    m_invoke = nullptr;
+    m_manage = nullptr;
+  }
+
+  explicit operator bool() const { return m_invoke; }
+
+  R operator()(Args... args) const
+  {
+    // Calling an empty InlineFunction.
+    ASSERT(m_invoke);
+    return m_invoke(const_cast<unsigned char*>(m_storage), std::forward<Args>(args)...);
+  }
+};
+
+} // namespace dbus
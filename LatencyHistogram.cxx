@@ -0,0 +1,67 @@
+#include "sys.h"
+#include "LatencyHistogram.h"
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+
+namespace dbus {
+
+LatencyHistogram::LatencyHistogram() : m_count(0), m_sum_usec(0), m_max_usec(0)
+{
+  for (auto& bucket : m_buckets)
+    bucket.store(0, std::memory_order_relaxed);
+}
+
+LatencyHistogramSnapshot LatencyHistogram::snapshot() const
+{
+  LatencyHistogramSnapshot snapshot;
+  snapshot.m_count = 0;
+  for (int bucket = 0; bucket < LatencyHistogramSnapshot::number_of_buckets; ++bucket)
+  {
+    snapshot.m_buckets[bucket] = m_buckets[bucket].load(std::memory_order_relaxed);
+    // Use the sum of the buckets, so that percentile() is consistent with the buckets.
+    snapshot.m_count += snapshot.m_buckets[bucket];
+  }
+  snapshot.m_sum_usec = m_sum_usec.load(std::memory_order_relaxed);
+  snapshot.m_max_usec = m_max_usec.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+uint64_t LatencyHistogramSnapshot::percentile(double q) const
+{
+  if (m_count == 0)
+    return 0;
+  // The rank of the requested value (1 based).
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * m_count)));
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < number_of_buckets; ++bucket)
+  {
+    seen += m_buckets[bucket];
+    if (seen >= rank)
+      // Return the middle of the bucket, but never more than the largest recorded value.
+      return std::min(bucket_lower_bound(bucket) + bucket_width(bucket) / 2, m_max_usec);
+  }
+  return m_max_usec;
+}
+
+LatencyHistogramSnapshot& LatencyHistogramSnapshot::operator+=(LatencyHistogramSnapshot const& other)
+{
+  for (int bucket = 0; bucket < number_of_buckets; ++bucket)
+    m_buckets[bucket] += other.m_buckets[bucket];
+  m_count += other.m_count;
+  m_sum_usec += other.m_sum_usec;
+  m_max_usec = std::max(m_max_usec, other.m_max_usec);
+  return *this;
+}
+
+void LatencyHistogramSnapshot::print_on(std::ostream& os) const
+{
+  os << "{count:" << m_count <<
+    ", mean:" << mean() <<
+    "us, p50:" << percentile(0.5) <<
+    "us, p99:" << percentile(0.99) <<
+    "us, p999:" << percentile(0.999) <<
+    "us, max:" << m_max_usec << "us}";
+}
+
+} // namespace dbus
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include "debug.h"
+
+namespace dbus {
+
+class LatencyHistogram;
+
+// A copy of the buckets of a LatencyHistogram.
+class LatencyHistogramSnapshot
+{
+  friend class LatencyHistogram;
+
+ public:
+  // Values are recorded with a resolution of 1/32 of their power of two (about 3%); up till 2^32 microseconds (71 minutes).
+  static constexpr int sub_bucket_bits = 5;
+  static constexpr int sub_buckets = 1 << sub_bucket_bits;
+  static constexpr int max_value_bits = 32;
+  static constexpr int number_of_buckets = (max_value_bits - sub_bucket_bits) * sub_buckets + sub_buckets;
+
+  // Return the bucket of value (in microseconds).
+  static int bucket(uint64_t value)
+  {
+    if (value >= (uint64_t{1} << max_value_bits))
+      return number_of_buckets - 1;
+    if (value < 2 * sub_buckets)
+      return value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - sub_bucket_bits;
+    return shift * sub_buckets + (value >> shift);
+  }
+
+  // Return the smallest value that is recorded in bucket.
+  static uint64_t bucket_lower_bound(int bucket)
+  {
+    if (bucket < 2 * sub_buckets)
+      return bucket;
+    int shift = bucket / sub_buckets - 1;
+    return static_cast<uint64_t>(bucket % sub_buckets + sub_buckets) << shift;
+  }
+
+  // Return the number of different values that are recorded in bucket.
+  static uint64_t bucket_width(int bucket)
+  {
+    return bucket < 2 * sub_buckets ? 1 : uint64_t{1} << (bucket / sub_buckets - 1);
+  }
+
+ private:
+  std::array<uint64_t, number_of_buckets> m_buckets;
+  uint64_t m_count;
+  uint64_t m_sum_usec;
+  uint64_t m_max_usec;
+
+ public:
+  uint64_t count() const { return m_count; }
+  uint64_t max() const { return m_max_usec; }
+  double mean() const { return m_count ? static_cast<double>(m_sum_usec) / m_count : 0.0; }
+
+  // Return the value (in microseconds) below which a fraction q (0 <= q <= 1) of the recorded values lie.
+  // For example, percentile(0.999) returns the p999.
+  uint64_t percentile(double q) const;
+
+  LatencyHistogramSnapshot& operator+=(LatencyHistogramSnapshot const& other);
+
+  // Print count, mean, p50, p99, p999 and max.
+  void print_on(std::ostream& os) const;
+};
+
+inline std::ostream& operator<<(std::ostream& os, LatencyHistogramSnapshot const& snapshot) { snapshot.print_on(os); return os; }
+
+// A log-linear histogram of durations (with microsecond resolution), in the style of an HDR histogram.
+//
+// Recording is lock-free and wait-free (apart from keeping track of the maximum):
+// it only does a few relaxed atomic increments.
+class LatencyHistogram
+{
+ private:
+  std::array<std::atomic<uint64_t>, LatencyHistogramSnapshot::number_of_buckets> m_buckets;
+  std::atomic<uint64_t> m_count;
+  std::atomic<uint64_t> m_sum_usec;
+  std::atomic<uint64_t> m_max_usec;
+
+ public:
+  LatencyHistogram();
+  LatencyHistogram(LatencyHistogram const&) = delete;
+
+  void record(std::chrono::steady_clock::duration duration)
+  {
+    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    uint64_t value = usec < 0 ? 0 : usec;
+    m_buckets[LatencyHistogramSnapshot::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum_usec.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = m_max_usec.load(std::memory_order_relaxed);
+    while (value > max && !m_max_usec.compare_exchange_weak(max, value, std::memory_order_relaxed))
+      ;
+  }
+
+  // Return a copy of the current buckets. Values that are being recorded concurrently might be partially included.
+  LatencyHistogramSnapshot snapshot() const;
+};
+
+} // namespace dbus
@@ -0,0 +1,58 @@
+#include "sys.h"
+#include "ListenSocket.h"
+#include "DBusServer.h"
+#include "utils/AIAlert.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+namespace dbus {
+
+void ListenSocket::listen(std::string const& path)
+{
+  DoutEntering(dc::notice, "dbus::ListenSocket::listen(\"" << path << "\")");
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.length() >= sizeof(addr.sun_path))
+    THROW_ALERT("Invalid UNIX socket path \"[PATH]\".", AIArgs("[PATH]", path));
+  std::memcpy(addr.sun_path, path.data(), path.length());
+  socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + path.length();
+  if (path[0] == '@')
+    addr.sun_path[0] = '\0';            // Abstract socket: the name isn't null terminated.
+  else
+    ++addr_len;                         // Include the terminating zero.
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    THROW_ALERTC(errno, "socket");
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), addr_len) == -1 || ::listen(fd, SOMAXCONN) == -1)
+  {
+    int err = errno;
+    ::close(fd);
+    THROW_ALERTC(err, "bind/listen");
+  }
+  fd_init(fd);
+  start_input_device();
+}
+
+void ListenSocket::read_from_fd(int& UNUSED_ARG(allow_deletion_count), int fd)
+{
+  DoutEntering(dc::notice, "dbus::ListenSocket::read_from_fd()");
+  for (;;)
+  {
+    int client_fd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd == -1)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        Dout(dc::warning, "accept4: " << strerror(errno));
+      break;
+    }
+    m_server->new_client(client_fd);
+  }
+}
+
+} // namespace dbus
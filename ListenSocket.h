@@ -0,0 +1,31 @@
+#pragma once
+
+#include "evio/RawInputDevice.h"
+#include <string>
+#include "debug.h"
+
+namespace task {
+class DBusServer;
+} // namespace task
+
+namespace dbus {
+
+// A listening UNIX socket that passes every accepted connection to a task::DBusServer.
+class ListenSocket : public evio::RawInputDevice
+{
+ private:
+  task::DBusServer* m_server;                   // The server that accepted connections are passed to.
+
+ public:
+  ListenSocket(task::DBusServer* server) : m_server(server) { }
+
+  // Listen on the UNIX socket path. If path starts with a '@' then the rest of it is the name of an abstract socket.
+  void listen(std::string const& path);
+
+ protected:
+  void read_from_fd(int& allow_deletion_count, int fd) override;
+  void hup(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override { DoutEntering(dc::notice, "dbus::ListenSocket::hup"); }
+  void err(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override { DoutEntering(dc::notice, "dbus::ListenSocket::err"); close(); }
+};
+
+} // namespace dbus
@@ -0,0 +1,72 @@
+#include "sys.h"
+#include "MemFd.h"
+#include "utils/AIAlert.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cerrno>
+
+namespace dbus {
+
+MemFd::MemFd(size_t size, char const* name) : m_fd(memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING)), m_data(nullptr), m_size(size)
+{
+  if (!m_fd.is_valid())
+    THROW_ALERTC(errno, "memfd_create");
+  if (ftruncate(m_fd.get(), size) == -1)
+    THROW_ALERTC(errno, "ftruncate");
+  // mmap doesn't accept a length of zero.
+  if (size > 0)
+  {
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd.get(), 0);
+    if (data == MAP_FAILED)
+      THROW_ALERTC(errno, "mmap");
+    m_data = data;
+  }
+}
+
+MemFd::~MemFd()
+{
+  if (m_data)
+    munmap(m_data, m_size);
+}
+
+void MemFd::seal()
+{
+  // F_SEAL_WRITE fails as long as there is a writable shared mapping.
+  if (m_data)
+  {
+    munmap(m_data, m_size);
+    m_data = nullptr;
+  }
+  if (fcntl(m_fd.get(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    THROW_ALERTC(errno, "fcntl(F_ADD_SEALS)");
+}
+
+MemFdView::MemFdView(UnixFd fd) : m_fd(std::move(fd)), m_data(nullptr), m_size(0)
+{
+  // Without these seals the sender could change the payload while we read it, or truncate it causing a SIGBUS.
+  int seals = fcntl(m_fd.get(), F_GET_SEALS);
+  if (seals == -1)
+    THROW_ALERTC(errno, "fcntl(F_GET_SEALS)");
+  if ((seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK))
+    THROW_ALERT("Received a memfd that isn't sealed.");
+  struct stat st;
+  if (fstat(m_fd.get(), &st) == -1)
+    THROW_ALERTC(errno, "fstat");
+  m_size = st.st_size;
+  if (m_size > 0)
+  {
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd.get(), 0);
+    if (data == MAP_FAILED)
+      THROW_ALERTC(errno, "mmap");
+    m_data = data;
+  }
+}
+
+MemFdView::~MemFdView()
+{
+  if (m_data)
+    munmap(const_cast<void*>(m_data), m_size);
+}
+
+} // namespace dbus
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "UnixFd.h"
+#include <cstddef>
+#include "debug.h"
+
+namespace dbus {
+
+// A sealed memfd, used to pass a large payload to a peer without copying it through the socket.
+//
+// Usage (sender):
+//
+//   dbus::MemFd payload(size, "my-payload");
+//   std::memcpy(payload.data(), blob, size);
+//   payload.seal();
+//   message.append(payload.fd());
+//
+// The receiver reads a UnixFd from the message and constructs a MemFdView from it.
+class MemFd
+{
+ private:
+  UnixFd m_fd;
+  void* m_data;                 // Writable mapping of the memfd, until seal() is called.
+  size_t m_size;
+
+ public:
+  // Create a memfd of size bytes and map it. The name is only used for debugging (see /proc/self/fd).
+  MemFd(size_t size, char const* name = "dbus-payload");
+  MemFd(MemFd const&) = delete;
+  ~MemFd();
+
+  // The payload; only writable until seal() is called.
+  void* data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+  // Unmap the payload and seal the memfd, so that the receiver can rely on it not changing anymore.
+  void seal();
+  bool is_sealed() const { return !m_data; }
+
+  // The fd to append to a message. Only append a sealed memfd.
+  UnixFd const& fd() const
+  {
+    // Call seal() first.
+    ASSERT(is_sealed());
+    return m_fd;
+  }
+};
+
+// A read-only mapping of a sealed memfd that was received from a peer.
+class MemFdView
+{
+ private:
+  UnixFd m_fd;
+  void const* m_data;
+  size_t m_size;
+
+ public:
+  // Take ownership of fd and map it. Throws if the memfd isn't sealed against writing and shrinking.
+  explicit MemFdView(UnixFd fd);
+  MemFdView(MemFdView const&) = delete;
+  ~MemFdView();
+
+  void const* data() const { return m_data; }
+  size_t size() const { return m_size; }
+};
+
+} // namespace dbus
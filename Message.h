@@ -2,15 +2,77 @@
 
 #include "DBusConnection.h"
 #include "Destination.h"
+#include "UnixFd.h"
+#include "Signature.h"
 #include <boost/intrusive_ptr.hpp>
 #include "systemd_sd-bus.h"
 #include <iterator>
 #include <algorithm>
-#include <iterator>
+#include <span>
+#include <memory>
+#include <cstring>
+#include <fcntl.h>
+#include <cerrno>
 #include "debug.h"
 
 namespace dbus {
 
+// Return true if str is valid UTF-8 without zero bytes, as D-Bus requires of strings.
+// This is the check that sd_bus_message_append_basic does: it also rejects overlong encodings,
+// UTF-16 surrogates, code points beyond U+10FFFF and the non-characters U+FDD0..U+FDEF and U+xxFFFE/U+xxFFFF.
+inline bool is_valid_string(std::string_view str)
+{
+  static constexpr char32_t min_code_point[] = { 0, 0, 0x80, 0x800, 0x10000 };
+  unsigned char const* p = reinterpret_cast<unsigned char const*>(str.data());
+  unsigned char const* const end = p + str.size();
+  while (p < end)
+  {
+    unsigned char c = *p;
+    if (c == 0)
+      return false;
+    if (c < 0x80)
+    {
+      ++p;
+      continue;
+    }
+    int len;
+    char32_t code_point;
+    if ((c & 0xe0) == 0xc0)
+    {
+      len = 2;
+      code_point = c & 0x1f;
+    }
+    else if ((c & 0xf0) == 0xe0)
+    {
+      len = 3;
+      code_point = c & 0x0f;
+    }
+    else if ((c & 0xf8) == 0xf0)
+    {
+      len = 4;
+      code_point = c & 0x07;
+    }
+    else
+      return false;
+    if (end - p < len)
+      return false;
+    for (int i = 1; i < len; ++i)
+    {
+      if ((p[i] & 0xc0) != 0x80)
+        return false;
+      code_point = (code_point << 6) | (p[i] & 0x3f);
+    }
+    if (code_point < min_code_point[len] ||
+        code_point >= 0x110000 ||
+        (code_point & 0xfffff800) == 0xd800 ||
+        (code_point >= 0xfdd0 && code_point <= 0xfdef) ||
+        (code_point & 0xfffe) == 0xfffe)
+      return false;
+    p += len;
+  }
+  return true;
+}
+
 class MessageConst
 {
  protected:
@@ -218,6 +280,14 @@ class MessageRead : public MessageConst
     sd_bus_message_exit_container(m_message);
   }
 
+  // Start reading at the beginning again. Used to pass the same message to more than one callback.
+  void rewind() const
+  {
+    int ret = sd_bus_message_rewind(m_message, true);
+    if (ret < 0)
+      THROW_ALERTC(-ret, "sd_bus_message_rewind");
+  }
+
   MessageRead const& operator>>(uint8_t& n) const
   {
     int ret = sd_bus_message_read(m_message, "y", &n);
@@ -305,9 +375,67 @@ class MessageRead : public MessageConst
     return *this;
   }
 
+  // The string remains valid as long as the message exists.
+  MessageRead const& operator>>(std::string_view& s) const
+  {
+    char const* str;
+    int ret = sd_bus_message_read_basic(m_message, 's', &str);
+    if (ret < 0)
+      THROW_ALERTC(-ret, "sd_bus_message_read_basic");
+    s = str;
+    return *this;
+  }
+
+  // The fd in the message is duplicated, so fd remains valid after the message is destroyed.
+  MessageRead const& operator>>(UnixFd& fd) const
+  {
+    int message_fd;
+    int ret = sd_bus_message_read(m_message, "h", &message_fd);
+    if (ret < 0)
+      THROW_ALERTC(-ret, "sd_bus_message_read");
+    int dup_fd = fcntl(message_fd, F_DUPFD_CLOEXEC, 3);
+    if (dup_fd == -1)
+      THROW_ALERTC(errno, "fcntl");
+    fd = UnixFd(dup_fd);
+    return *this;
+  }
+
   template<typename CONTAINER>
   MessageRead const& operator>>(std::back_insert_iterator<CONTAINER> bi) const;
 
+  // Read an array of fixed size elements (any basic type except bool, std::string and UnixFd) without copying it.
+  // The returned span points into the message and remains valid as long as the message exists.
+  template<typename T>
+  requires detail::is_fixed_size_v<T>
+  std::span<T const> read_array() const
+  {
+    void const* ptr;
+    size_t size;
+    int ret = sd_bus_message_read_array(m_message, signature_v<T>[0], &ptr, &size);
+    if (ret < 0)
+      THROW_ALERTC(-ret, "sd_bus_message_read_array");
+    if (ret == 0)
+      THROW_FALERT("Received dbus message with unexpected end of content, expected array.");
+    return { static_cast<T const*>(ptr), size / sizeof(T) };
+  }
+
+  template<typename T>
+  requires detail::is_fixed_size_v<T>
+  MessageRead const& operator>>(std::span<T const>& elements) const
+  {
+    elements = read_array<T>();
+    return *this;
+  }
+
+  // Read a container, std::tuple, std::pair, aggregate, std::variant or std::optional (see Signature.h).
+  template<DBusType T>
+  requires (detail::kind_of<T>() != detail::Kind::basic)
+  MessageRead const& operator>>(T& value) const
+  {
+    read_value(value);
+    return *this;
+  }
+
   bool peek_type(char& type, char const*& contents) const
   {
     int ret = sd_bus_message_peek_type(m_message, &type, &contents);
@@ -325,44 +453,176 @@ class MessageRead : public MessageConst
   }
 
   operator sd_bus_message*() const { return m_message; }
+
+ private:
+  // Enter a container of which the signature is known at compile time.
+  // sd-bus checks that the message has a container of that type; a mismatch throws.
+  void enter(char type, char const* contents) const
+  {
+    int ret = sd_bus_message_enter_container(m_message, type, contents);
+    if (ret < 0)
+      THROW_ALERTC(-ret, "sd_bus_message_enter_container");
+    if (ret == 0)
+      THROW_FALERT("Received dbus message with unexpected end of content, expected [TYPE][CONTENTS].", AIArgs("[TYPE]", type)("[CONTENTS]", contents));
+  }
+
+  void exit() const
+  {
+    int ret = sd_bus_message_exit_container(m_message);
+    if (ret < 0)
+      THROW_ALERTC(-ret, "sd_bus_message_exit_container");
+  }
+
+  template<typename T>
+  void read_value(T& value) const;
+
+  template<typename T, size_t... I>
+  void read_variant(T& value, std::string_view contents, std::index_sequence<I...>) const;
 };
 
-template<typename T> char get_type();
-template<> char get_type<uint8_t>();
-template<> char get_type<bool>();
-template<> char get_type<int16_t>();
-template<> char get_type<uint16_t>();
-template<> char get_type<int32_t>();
-template<> char get_type<uint32_t>();
-template<> char get_type<int64_t>();
-template<> char get_type<uint64_t>();
-template<> char get_type<double>();
-template<> char get_type<std::string>();
+// Return the type code of the basic type T.
+template<typename T>
+constexpr char get_type()
+{
+  static_assert(detail::kind_of<T>() == detail::Kind::basic, "get_type only returns the type code of basic types; use signature_v.");
+  return signature_v<T>[0];
+}
 
 template<typename CONTAINER>
 MessageRead const& MessageRead::operator>>(std::back_insert_iterator<CONTAINER> bi) const
 {
-  char type;
-  char const* contents;
-  bool have_data = peek_type(type, contents);
-  // Only arrays are supported at the moment.
-  if (!have_data)
-    THROW_FALERT("Received dbus message with unexpected end of content, expected array.");
-  if (type != 'a')
-    THROW_FALERT("Received dbus message with unsupported type [TYPE], expected array.", AIArgs("[TYPE]", type));
-  enter_container(type, contents);
-  if (dbus::get_type<typename CONTAINER::value_type>() != contents[0])
-    THROW_FALERT("Dbus message with unexpected array contents [CONTENTS], expected [TYPE].", AIArgs("CONTENTS]", contents[0])("[TYPE]", dbus::get_type<typename CONTAINER::value_type>()));
+  using value_type = typename CONTAINER::value_type;
+  if constexpr (detail::is_fixed_size_v<value_type>)
+  {
+    std::ranges::copy(read_array<value_type>(), bi);
+    return *this;
+  }
+  enter('a', signature_v<value_type>.c_str());
   while (!at_end(false))
   {
-    typename CONTAINER::value_type data;
-    *this >> data;
-    bi = data;
+    value_type data;
+    read_value(data);
+    bi = std::move(data);
   }
-  exit_container();
+  exit();
   return *this;
 }
 
+template<typename T>
+void MessageRead::read_value(T& value) const
+{
+  constexpr detail::Kind kind = detail::kind_of<T>();
+  if constexpr (kind == detail::Kind::basic)
+    *this >> value;
+  else if constexpr (kind == detail::Kind::array)
+  {
+    using value_type = typename T::value_type;
+    if constexpr (detail::is_fixed_size_v<value_type>)
+    {
+      // Copy the whole array at once.
+      std::span<value_type const> elements = read_array<value_type>();
+      if constexpr (detail::is_std_array<T>::value)
+      {
+        if (elements.size() != value.size())
+          THROW_FALERT("Received dbus array with [RECEIVED] elements, expected [SIZE].", AIArgs("[RECEIVED]", elements.size())("[SIZE]", value.size()));
+        std::ranges::copy(elements, value.begin());
+      }
+      else
+        value.assign(elements.begin(), elements.end());
+      return;
+    }
+    enter('a', signature_v<value_type>.c_str());
+    if constexpr (detail::is_std_array<T>::value)
+    {
+      for (value_type& element : value)
+      {
+        if (at_end(false))
+          THROW_FALERT("Received dbus array with less than [SIZE] elements.", AIArgs("[SIZE]", value.size()));
+        read_value(element);
+      }
+      if (!at_end(false))
+        THROW_FALERT("Received dbus array with more than [SIZE] elements.", AIArgs("[SIZE]", value.size()));
+    }
+    else
+    {
+      value.clear();
+      while (!at_end(false))
+      {
+        if constexpr (std::is_same_v<value_type, bool>)
+        {
+          // The elements of a std::vector<bool> can't be referenced.
+          bool element;
+          read_value(element);
+          value.push_back(element);
+        }
+        else
+          read_value(value.emplace_back());
+      }
+    }
+    exit();
+  }
+  else if constexpr (kind == detail::Kind::dict)
+  {
+    static constexpr auto entry_contents = detail::dict_entry_contents_v<T>;
+    enter('a', signature_v<T>.c_str() + 1);
+    value.clear();
+    while (!at_end(false))
+    {
+      typename T::key_type key;
+      typename T::mapped_type mapped;
+      enter('e', entry_contents.c_str());
+      read_value(key);
+      read_value(mapped);
+      exit();
+      value.insert_or_assign(std::move(key), std::move(mapped));
+    }
+    exit();
+  }
+  else if constexpr (kind == detail::Kind::structure)
+  {
+    enter('r', detail::struct_contents_v<T>.c_str());
+    if constexpr (detail::is_std_tuple<T>::value)
+      std::apply([this](auto&... members){ (read_value(members), ...); }, value);
+    else
+      std::apply([this](auto&... members){ (read_value(members), ...); }, detail::tie_aggregate(value));
+    exit();
+  }
+  else if constexpr (kind == detail::Kind::variant)
+  {
+    // The contents of a VARIANT are only known at run time.
+    char type;
+    char const* contents;
+    if (!peek_type(type, contents))
+      THROW_FALERT("Received dbus message with unexpected end of content, expected variant.");
+    if (type != 'v')
+      THROW_FALERT("Received dbus message with type [TYPE], expected variant.", AIArgs("[TYPE]", type));
+    read_variant(value, contents, std::make_index_sequence<std::variant_size_v<T>>{});
+  }
+  else
+  {
+    using value_type = typename T::value_type;
+    enter('a', signature_v<value_type>.c_str());
+    value.reset();
+    if (!at_end(false))
+    {
+      read_value(value.emplace());
+      if (!at_end(false))
+        THROW_FALERT("Received dbus array with more than one element for an optional value.");
+    }
+    exit();
+  }
+}
+
+template<typename T, size_t... I>
+void MessageRead::read_variant(T& value, std::string_view contents, std::index_sequence<I...>) const
+{
+  // Read the first alternative with the signature of the contents.
+  bool found = ((contents == std::string_view(signature_v<std::variant_alternative_t<I, T>>) &&
+        (enter('v', signature_v<std::variant_alternative_t<I, T>>.c_str()), read_value(value.template emplace<I>()), exit(), true)) || ...);
+  if (!found)
+    THROW_FALERT("Received dbus variant with contents [CONTENTS] that doesn't match any alternative.", AIArgs("[CONTENTS]", std::string(contents)));
+}
+
 class Message : public MessageRead
 {
  public:
@@ -382,53 +642,47 @@ class Message : public MessageRead
     m_bus = dbus_connection->get_bus();
   }
 
-  // Append a std::vector or std::array (must be contiguous memory!)
-  // value_type must be one of the types for which get_type is specialized (see above; i.e. do not use 'int').
-  template<std::contiguous_iterator InputIt>
+  // Append the range [first, last) as an array.
+  // Elements of a fixed size basic type (see detail::is_fixed_size_v) must be in contiguous memory.
+  // Booleans and strings (anything that converts to std::string_view) are written directly into
+  // the message, without making a temporary copy. Strings must be valid UTF-8 without zero bytes
+  // (see is_valid_string); an invalid string throws (EINVAL).
+  template<std::forward_iterator InputIt>
   Message& append(InputIt first, InputIt last)
   {
-    using value_type = typename InputIt::value_type;
-    char type = dbus::get_type<value_type>();
-    int res;
-    if constexpr (std::is_same_v<bool, value_type>)
-    {
-      std::vector<int> booleans;
-      std::for_each(first, last, [&](bool boolean){ booleans.push_back(boolean); });
-      res = sd_bus_message_append_array(m_message, type, &booleans[0], sizeof(int) * booleans.size());
-    }
-    else if constexpr (std::is_same_v<std::string, value_type>)
-    {
-      std::vector<char const*> strings;
-      std::for_each(first, last, [&](std::string const& str){ strings.push_back(str.c_str()); });
-      res = sd_bus_message_append_array(m_message, type, &strings[0], sizeof(char const*) * strings.size());
-    }
+    using value_type = std::iter_value_t<InputIt>;
+    if constexpr (std::is_same_v<value_type, bool>)
+      append_booleans(first, last);
+    else if constexpr (std::is_convertible_v<value_type, std::string_view>)
+      append_strings(first, last);
     else
     {
-      size_t number_of_elements = std::distance(first, last);
-#ifdef CWDEBUG
-      if (number_of_elements > 1)
-      {
-        auto real_last = last - 1;
-        // Only use contiguous containers.
-        ASSERT(number_of_elements - 1 == real_last - first);
-      }
-#endif
-      res = sd_bus_message_append_array(m_message, type, &*first, sizeof(value_type) * number_of_elements);
+      static_assert(detail::is_fixed_size_v<value_type> && std::contiguous_iterator<InputIt>,
+          "Only contiguous ranges of a fixed size basic type, bool or strings can be appended as array.");
+      int res = sd_bus_message_append_array(m_message, signature_v<value_type>[0], std::to_address(first), sizeof(value_type) * (last - first));
+      if (res < 0)
+        THROW_ALERTC(-res, "sd_bus_message_append_array");
     }
-    if (res < 0)
-      THROW_ALERTC(-res, "sd_bus_message_append_array");
     return *this;
   }
 
-  template<typename T>
-  Message& append(T basic_type)
+  // Append value, which can be of any type for which dbus::signature_v exists (see Signature.h):
+  // a basic type, std::vector, std::array, std::map, std::unordered_map, std::tuple, std::pair,
+  // an aggregate, std::variant or std::optional, nested in any way. Other types don't compile.
+  //
+  // A UnixFd is appended as type 'h'; the message gets its own duplicate of the fd.
+  // The connection must support fd passing (see sd_bus_can_send).
+  template<DBusType T>
+  Message& append(T const& value)
   {
-    char type = dbus::get_type<T>();
-    int res;
-    if constexpr (std::is_same_v<T, std::string>)
-      res = sd_bus_message_append_basic(m_message, type, basic_type.c_str());
-    else
-      res = sd_bus_message_append_basic(m_message, type, reinterpret_cast<void*>(basic_type));
+    append_value(value);
+    return *this;
+  }
+
+  // Append a zero terminated string (type 's').
+  Message& append(char const* str)
+  {
+    int res = sd_bus_message_append_basic(m_message, 's', str);
     if (res < 0)
       THROW_ALERTC(-res, "sd_bus_message_append_basic");
     return *this;
@@ -440,6 +694,147 @@ class Message : public MessageRead
     if (ret < 0)
       THROW_ALERTC(-ret, "sd_bus_reply_method_return");
   }
+
+ private:
+  void open(char type, char const* contents)
+  {
+    int res = sd_bus_message_open_container(m_message, type, contents);
+    if (res < 0)
+      THROW_ALERTC(-res, "sd_bus_message_open_container");
+  }
+
+  void close()
+  {
+    int res = sd_bus_message_close_container(m_message);
+    if (res < 0)
+      THROW_ALERTC(-res, "sd_bus_message_close_container");
+  }
+
+  // Append str (type 's').
+  void append_string(std::string_view str)
+  {
+    // sd_bus_message_append_string_space doesn't check the string; fail like sd_bus_message_append_basic does.
+    if (!is_valid_string(str))
+      THROW_ALERTC(EINVAL, "sd_bus_message_append_basic");
+    char* ptr;
+    int res = sd_bus_message_append_string_space(m_message, str.size(), &ptr);
+    if (res < 0)
+      THROW_ALERTC(-res, "sd_bus_message_append_string_space");
+    std::memcpy(ptr, str.data(), str.size());
+  }
+
+  template<typename InputIt>
+  void append_booleans(InputIt first, InputIt last)
+  {
+    void* ptr;
+    int res = sd_bus_message_append_array_space(m_message, 'b', sizeof(int) * std::distance(first, last), &ptr);
+    if (res < 0)
+      THROW_ALERTC(-res, "sd_bus_message_append_array_space");
+    // D-Bus booleans are 32 bit.
+    std::copy(first, last, static_cast<int*>(ptr));
+  }
+
+  template<typename InputIt>
+  void append_strings(InputIt first, InputIt last)
+  {
+    open('a', "s");
+    for (; first != last; ++first)
+      append_string(*first);
+    close();
+  }
+
+  template<typename T>
+  void append_value(T const& value);
 };
 
+template<typename T>
+void Message::append_value(T const& value)
+{
+  constexpr detail::Kind kind = detail::kind_of<T>();
+  if constexpr (kind == detail::Kind::basic)
+  {
+    int res;
+    if constexpr (std::is_same_v<T, std::string>)
+      res = sd_bus_message_append_basic(m_message, 's', value.c_str());
+    else if constexpr (std::is_same_v<T, std::string_view>)
+    {
+      append_string(value);
+      return;
+    }
+    else if constexpr (std::is_same_v<T, bool>)
+    {
+      // D-Bus booleans are 32 bit.
+      int boolean = value;
+      res = sd_bus_message_append_basic(m_message, 'b', &boolean);
+    }
+    else if constexpr (std::is_same_v<T, UnixFd>)
+    {
+      int unix_fd = value.get();
+      res = sd_bus_message_append_basic(m_message, 'h', &unix_fd);
+    }
+    else
+      res = sd_bus_message_append_basic(m_message, signature_v<T>[0], &value);
+    if (res < 0)
+      THROW_ALERTC(-res, "sd_bus_message_append_basic");
+  }
+  else if constexpr (kind == detail::Kind::array)
+  {
+    using value_type = typename T::value_type;
+    if constexpr (std::is_same_v<value_type, bool>)
+      append_booleans(value.begin(), value.end());
+    else if constexpr (detail::is_fixed_size_v<value_type>)
+    {
+      // Fixed size elements are appended in one go.
+      int res = sd_bus_message_append_array(m_message, signature_v<value_type>[0], value.data(), sizeof(value_type) * value.size());
+      if (res < 0)
+        THROW_ALERTC(-res, "sd_bus_message_append_array");
+    }
+    else
+    {
+      open('a', signature_v<value_type>.c_str());
+      for (value_type const& element : value)
+        append_value(element);
+      close();
+    }
+  }
+  else if constexpr (kind == detail::Kind::dict)
+  {
+    static constexpr auto entry_contents = detail::dict_entry_contents_v<T>;
+    open('a', signature_v<T>.c_str() + 1);
+    for (auto const& [key, mapped] : value)
+    {
+      open('e', entry_contents.c_str());
+      append_value(key);
+      append_value(mapped);
+      close();
+    }
+    close();
+  }
+  else if constexpr (kind == detail::Kind::structure)
+  {
+    open('r', detail::struct_contents_v<T>.c_str());
+    if constexpr (detail::is_std_tuple<T>::value)
+      std::apply([this](auto const&... members){ (append_value(members), ...); }, value);
+    else
+      std::apply([this](auto const&... members){ (append_value(members), ...); }, detail::tie_aggregate(value));
+    close();
+  }
+  else if constexpr (kind == detail::Kind::variant)
+  {
+    std::visit([this](auto const& alternative){
+        open('v', signature_v<std::remove_cvref_t<decltype(alternative)>>.c_str());
+        append_value(alternative);
+        close();
+      }, value);
+  }
+  else
+  {
+    using value_type = typename T::value_type;
+    open('a', signature_v<value_type>.c_str());
+    if (value)
+      append_value(*value);
+    close();
+  }
+}
+
 } // namespace dbus
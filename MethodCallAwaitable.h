@@ -0,0 +1,102 @@
+#pragma once
+
+#include "DBusMethodCallPool.h"
+#include "Error.h"
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <tuple>
+#include "debug.h"
+
+namespace dbus {
+
+namespace detail {
+
+template<typename... Results>
+struct result_type { using type = std::tuple<Results...>; };
+
+template<typename Result>
+struct result_type<Result> { using type = Result; };
+
+template<>
+struct result_type<> { using type = void; };
+
+} // namespace detail
+
+// An awaitable method call, see co_call.
+//
+// The call is done by a task of a task::DBusMethodCallPool, so that no task is created per call.
+// The awaiting coroutine is resumed by that task, running in the call handler of the pool
+// (see the constructor of task::DBusMethodCallPool), and not holding the connection lock.
+//
+// co_await returns the decoded reply: nothing, a single value, or a std::tuple when there is more than one
+// result type. If the reply is an error then a dbus::Error is thrown; if the reply couldn't be decoded,
+// or the call couldn't be sent, then the corresponding exception is thrown.
+template<typename... Results>
+class MethodCallAwaitable
+{
+ private:
+  task::DBusMethodCallPool* m_pool;
+  task::DBusMethodCall::params_callback_type m_params_callback;
+  std::chrono::steady_clock::time_point m_deadline;
+  std::tuple<Results...> m_results;
+  std::exception_ptr m_exception;
+
+  // Called with the connection lock held: only decode the reply here.
+  void reply(MessageRead const& message)
+  {
+    if (message.is_method_error())
+    {
+      m_exception = std::make_exception_ptr(Error(message.get_error()));
+      return;
+    }
+    try
+    {
+      std::apply([&message](auto&... results){ (message >> results, ...); }, m_results);
+    }
+    catch (...)
+    {
+      m_exception = std::current_exception();
+    }
+  }
+
+ public:
+  MethodCallAwaitable(task::DBusMethodCallPool* pool, task::DBusMethodCall::params_callback_type params_callback, std::chrono::steady_clock::time_point deadline) :
+    m_pool(pool), m_params_callback(std::move(params_callback)), m_deadline(deadline) { }
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle)
+  {
+    // The coroutine might be resumed (by another thread) before call() returns: don't touch this object afterwards.
+    m_pool->call(std::move(m_params_callback),
+        [this](MessageRead const& message){ reply(message); },
+        [this, handle](std::exception_ptr exception){
+          if (exception)
+            m_exception = exception;
+          handle.resume();
+        },
+        m_deadline);
+  }
+
+  typename detail::result_type<Results...>::type await_resume()
+  {
+    if (m_exception)
+      std::rethrow_exception(m_exception);
+    if constexpr (sizeof...(Results) == 1)
+      return std::move(std::get<0>(m_results));
+    else if constexpr (sizeof...(Results) > 1)
+      return std::move(m_results);
+  }
+};
+
+// Call the destination of pool and co_await the reply, decoded as Results.
+// The call fails with org.freedesktop.DBus.Error.Timeout if no reply was received at deadline.
+template<typename... Results>
+MethodCallAwaitable<Results...> co_call(task::DBusMethodCallPool* pool, task::DBusMethodCall::params_callback_type params_callback,
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+{
+  return { pool, std::move(params_callback), deadline };
+}
+
+} // namespace dbus
@@ -0,0 +1,62 @@
+#include "sys.h"
+#include "MethodCallTemplate.h"
+#include "MethodLatency.h"
+#include "CoalescingKey.h"
+#include "systemd_sd-bus.h"
+#include "utils/AIAlert.h"
+#include <mutex>
+#include <unordered_set>
+
+namespace dbus {
+
+namespace {
+
+// The interned strings. They are never erased: the nodes of an unordered_set don't move, so the pointers stay valid.
+// These are function-local statics, because intern is also used while initializing MethodCallTemplate objects at namespace scope.
+std::mutex& interned_mutex()
+{
+  static std::mutex s_interned_mutex;
+  return s_interned_mutex;
+}
+
+std::unordered_set<std::string>& interned()
+{
+  static std::unordered_set<std::string> s_interned;
+  return s_interned;
+}
+
+char const* validated(char const* name, int (*is_valid)(char const*), char const* what)
+{
+  if (is_valid(name) <= 0)
+    THROW_ALERT("Invalid [WHAT] \"[NAME]\".", AIArgs("[WHAT]", what)("[NAME]", name));
+  return MethodCallTemplate::intern(name);
+}
+
+} // namespace
+
+//static
+char const* MethodCallTemplate::intern(char const* str)
+{
+  return intern(std::string(str))->c_str();
+}
+
+//static
+std::string const* MethodCallTemplate::intern(std::string const& str)
+{
+  std::lock_guard<std::mutex> lock(interned_mutex());
+  return &*interned().insert(str).first;
+}
+
+MethodCallTemplate::MethodCallTemplate(char const* service_name, char const* object_path, char const* interface_name, char const* method_name) :
+  Destination(
+      service_name ? validated(service_name, &sd_bus_service_name_is_valid, "service name") : nullptr,
+      validated(object_path, &sd_bus_object_path_is_valid, "object path"),
+      validated(interface_name, &sd_bus_interface_name_is_valid, "interface name"),
+      validated(method_name, &sd_bus_member_name_is_valid, "method name"))
+{
+  // Interned, so that copies of this object (as Destination) can keep pointing to it.
+  m_key_prefix = intern(coalescing_key_prefix(*this));
+  m_latency.store(&MethodLatency::get(*this), std::memory_order_relaxed);
+}
+
+} // namespace dbus
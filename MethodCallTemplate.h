@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Destination.h"
+#include <string>
+#include "debug.h"
+
+namespace dbus {
+
+// A Destination for a remote method that is called often.
+//
+// The names are validated once, when the template is constructed (an AIAlert::Error is thrown if one is invalid),
+// and interned: templates with equal names share the same strings. Everything that is derived from the names
+// alone, the key prefix used by coalescing and the reply cache and the latency histograms, is computed here
+// instead of for every call.
+//
+// Use it wherever a Destination is expected; it must outlive every task that uses it.
+class MethodCallTemplate : public Destination
+{
+ public:
+  // service_name may be nullptr for peer-to-peer connections.
+  MethodCallTemplate(char const* service_name, char const* object_path, char const* interface_name, char const* method_name);
+
+  MethodCallTemplate(MethodCallTemplate const&) = delete;
+
+  // Return a string equal to str that stays valid till the end of the program. Equal strings return the same pointer.
+  static char const* intern(char const* str);
+  // Same, for a string that may contain zero bytes.
+  static std::string const* intern(std::string const& str);
+};
+
+} // namespace dbus
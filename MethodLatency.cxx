@@ -0,0 +1,98 @@
+#include "sys.h"
+#include "MethodLatency.h"
+#include "Destination.h"
+#include "utils/macros.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <tuple>
+
+namespace dbus {
+
+namespace {
+
+using key_type = std::tuple<std::string, std::string, std::string, std::string>;
+
+// All MethodLatency objects. They are never destroyed, so that references to them stay valid.
+// These are function-local statics, because get can be called during the initialization of other objects at namespace scope.
+std::mutex& registry_mutex()
+{
+  static std::mutex s_registry_mutex;
+  return s_registry_mutex;
+}
+
+std::map<key_type, std::unique_ptr<MethodLatency>>& registry()
+{
+  static std::map<key_type, std::unique_ptr<MethodLatency>> s_registry;
+  return s_registry;
+}
+
+// The service name is nullptr for calls over a peer-to-peer connection.
+char const* service_name_of(Destination const& destination)
+{
+  return destination.service_name() ? destination.service_name() : "";
+}
+
+} // namespace
+
+//static
+char const* MethodLatency::phase_str(phase_type phase)
+{
+  switch (phase)
+  {
+    AI_CASE_RETURN(broker_wait);
+    AI_CASE_RETURN(queue_wait);
+    AI_CASE_RETURN(send);
+    AI_CASE_RETURN(reply);
+    AI_CASE_RETURN(total);
+    case number_of_phases:
+      break;
+  }
+  AI_NEVER_REACHED;
+}
+
+MethodLatency::MethodLatency(Destination const& destination) :
+  m_service_name(service_name_of(destination)), m_object_path(destination.object_path()),
+  m_interface_name(destination.interface_name()), m_method_name(destination.method_name())
+{
+}
+
+//static
+MethodLatency& MethodLatency::get(Destination const& destination)
+{
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  auto ibp = registry().try_emplace(key_type{service_name_of(destination), destination.object_path(), destination.interface_name(), destination.method_name()});
+  if (ibp.second)
+    ibp.first->second = std::make_unique<MethodLatency>(destination);
+  return *ibp.first->second;
+}
+
+MethodLatency& Destination::latency() const
+{
+  MethodLatency* latency = m_latency.load(std::memory_order_acquire);
+  if (AI_UNLIKELY(!latency))
+  {
+    // Racing threads get the same object.
+    latency = &MethodLatency::get(*this);
+    m_latency.store(latency, std::memory_order_release);
+  }
+  return *latency;
+}
+
+//static
+void MethodLatency::for_each(std::function<void(MethodLatency const&)> const& func)
+{
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  for (auto const& entry : registry())
+    func(*entry.second);
+}
+
+void MethodLatency::print_on(std::ostream& os) const
+{
+  os << m_service_name << ' ' << m_object_path << ' ' << m_interface_name << '.' << m_method_name << ':';
+  for (int phase = 0; phase < number_of_phases; ++phase)
+    os << ' ' << phase_str(static_cast<phase_type>(phase)) << ':' << snapshot(static_cast<phase_type>(phase));
+}
+
+} // namespace dbus
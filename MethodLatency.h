@@ -0,0 +1,60 @@
+#pragma once
+
+#include "LatencyHistogram.h"
+#include <functional>
+#include <string>
+#include "debug.h"
+
+namespace dbus {
+
+class Destination;
+
+// The latency histograms of the method calls to one remote method.
+//
+// The time between running a task::DBusMethodCall and receiving its reply is split into phases,
+// so that it is possible to see whether slowness comes from our own task machinery or from the peer.
+class MethodLatency
+{
+ public:
+  enum phase_type {
+    broker_wait,        // From running the task till the connection was set up (see task::Broker).
+    queue_wait,         // From submitting the call till task::DBusHandleIO, holding the connection lock, picked it up.
+    send,               // Creating the message and queuing it with sd_bus_call_async.
+    reply,              // From sending till the reply (or error) was received.
+    total,              // From running the task till receiving the reply.
+    number_of_phases
+  };
+
+  static char const* phase_str(phase_type phase);
+
+ private:
+  std::string m_service_name;
+  std::string m_object_path;
+  std::string m_interface_name;
+  std::string m_method_name;
+  LatencyHistogram m_histograms[number_of_phases];
+
+ public:
+  MethodLatency(Destination const& destination);
+
+  void record(phase_type phase, std::chrono::steady_clock::duration duration) { m_histograms[phase].record(duration); }
+  LatencyHistogramSnapshot snapshot(phase_type phase) const { return m_histograms[phase].snapshot(); }
+
+  std::string const& service_name() const { return m_service_name; }
+  std::string const& object_path() const { return m_object_path; }
+  std::string const& interface_name() const { return m_interface_name; }
+  std::string const& method_name() const { return m_method_name; }
+
+  // Return the histograms of destination, creating them if they don't exist yet.
+  // Destination objects that compare equal (same service, object path, interface and method) share their histograms.
+  static MethodLatency& get(Destination const& destination);
+
+  // Call func for every remote method that histograms exist for.
+  static void for_each(std::function<void(MethodLatency const&)> const& func);
+
+  void print_on(std::ostream& os) const;
+};
+
+inline std::ostream& operator<<(std::ostream& os, MethodLatency const& method_latency) { method_latency.print_on(os); return os; }
+
+} // namespace dbus
@@ -0,0 +1,215 @@
+#include "sys.h"
+#include "ReplyCache.h"
+#include "CoalescingKey.h"
+#include "DBusConnection.h"
+#include "SubmissionQueue.h"
+#include <cstring>
+
+namespace dbus {
+
+namespace {
+
+// Return a sealed copy of reply, or nullptr on failure.
+// The copy is only used by the cache, so that reading it doesn't interfere with the connection that received reply.
+// Must be called while holding the lock of that connection, because the copy holds a reference to its bus.
+sd_bus_message* private_copy(MessageRead const& reply)
+{
+  sd_bus_message* source = const_cast<sd_bus_message*>(static_cast<sd_bus_message const*>(reply));
+  sd_bus_message* copy;
+  int ret = sd_bus_message_new(reply.get_bus(), &copy, SD_BUS_MESSAGE_METHOD_RETURN);
+  if (ret < 0)
+  {
+    Dout(dc::warning, "sd_bus_message_new: " << strerror(-ret));
+    return nullptr;
+  }
+  reply.rewind();
+  ret = sd_bus_message_copy(copy, source, true);
+  if (ret >= 0)
+    ret = sd_bus_message_seal(copy, reply.get_cookie(), 0);
+  if (ret < 0)
+  {
+    Dout(dc::warning, "Failed to copy reply: " << strerror(-ret));
+    sd_bus_message_unref(copy);
+    return nullptr;
+  }
+  return copy;
+}
+
+} // namespace
+
+struct ReplyCache::Entry final : public OutboundRequest
+{
+  std::string const* m_key;                                     // The key of this entry in ReplyCache::m_entries.
+  sd_bus_message* m_reply;                                      // A private copy of the cached reply (we hold the only reference).
+  boost::intrusive_ptr<task::DBusConnection const> m_connection;        // The connection that received the reply.
+  clock_type::time_point m_expires;                             // When the reply must no longer be used.
+  Entry* m_prev;                                                // The next more recently used entry.
+  Entry* m_next;                                                // The next less recently used entry.
+
+  Entry(sd_bus_message* reply, boost::intrusive_ptr<task::DBusConnection const> const& connection, clock_type::time_point expires) :
+    m_key(nullptr), m_reply(reply), m_connection(connection), m_expires(expires) { }
+
+  // Pass this entry to its connection, which deletes it while holding the connection lock.
+  void release()
+  {
+    m_connection->submit(this);
+  }
+
+  // Called by task::DBusHandleIO while it holds the connection lock.
+  void submit(sd_bus* UNUSED_ARG(bus)) override
+  {
+    sd_bus_message_unref(m_reply);
+    delete this;
+  }
+
+  // Called instead of submit when task::DBusHandleIO finishes; the entry must be freed all the same.
+  void discard() override
+  {
+    submit(nullptr);
+  }
+};
+
+ReplyCache::ReplyCache(size_t max_entries, std::chrono::microseconds default_ttl) :
+  m_max_entries(max_entries), m_default_ttl(default_ttl), m_most_recent(nullptr), m_least_recent(nullptr)
+{
+  // A cache must be able to hold at least one reply.
+  ASSERT(max_entries > 0);
+}
+
+ReplyCache::~ReplyCache()
+{
+  invalidate_all();
+}
+
+void ReplyCache::set_ttl(Destination const& destination, std::chrono::microseconds ttl)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_ttls[coalescing_key(destination)] = ttl;
+}
+
+void ReplyCache::unlink(Entry* entry)
+{
+  if (entry->m_prev)
+    entry->m_prev->m_next = entry->m_next;
+  else
+    m_most_recent = entry->m_next;
+  if (entry->m_next)
+    entry->m_next->m_prev = entry->m_prev;
+  else
+    m_least_recent = entry->m_prev;
+}
+
+void ReplyCache::push_front(Entry* entry)
+{
+  entry->m_prev = nullptr;
+  entry->m_next = m_most_recent;
+  if (m_most_recent)
+    m_most_recent->m_prev = entry;
+  else
+    m_least_recent = entry;
+  m_most_recent = entry;
+}
+
+void ReplyCache::erase(std::unordered_map<std::string, Entry*>::iterator iter)
+{
+  Entry* entry = iter->second;
+  unlink(entry);
+  m_entries.erase(iter);
+  entry->release();
+}
+
+bool ReplyCache::lookup(std::string const& key, reply_callback_type const& reply_callback)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto iter = m_entries.find(key);
+  if (iter == m_entries.end())
+    return false;
+  Entry* entry = iter->second;
+  if (clock_type::now() >= entry->m_expires)
+  {
+    erase(iter);
+    return false;
+  }
+  unlink(entry);
+  push_front(entry);
+  // Nothing but the cache refers to entry->m_reply, and the cache only uses it while holding m_mutex:
+  // its reference count and read position can't be changed by another thread. The reference that is
+  // added here is removed again before we return, so the message can't be freed without the connection lock.
+  MessageRead message(entry->m_reply, sd_bus_message_get_bus(entry->m_reply));
+  message.rewind();
+  reply_callback(message);
+  return true;
+}
+
+void ReplyCache::store(std::string const& key, Destination const& destination, MessageRead const& reply,
+    boost::intrusive_ptr<task::DBusConnection const> const& connection)
+{
+  DoutEntering(dc::notice, "ReplyCache::store()");
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::chrono::microseconds ttl = m_default_ttl;
+  if (!m_ttls.empty())
+  {
+    auto ttl_iter = m_ttls.find(coalescing_key(destination));
+    if (ttl_iter != m_ttls.end())
+      ttl = ttl_iter->second;
+  }
+  if (ttl <= std::chrono::microseconds::zero())
+    return;
+  sd_bus_message* copy = private_copy(reply);
+  if (!copy)
+    return;
+  Entry* entry = new Entry(copy, connection, clock_type::now() + ttl);
+  auto ibp = m_entries.try_emplace(key, entry);
+  if (!ibp.second)
+  {
+    // Replace the old reply.
+    Entry* old_entry = ibp.first->second;
+    unlink(old_entry);
+    old_entry->release();
+    ibp.first->second = entry;
+  }
+  // References to the elements of an unordered_map stay valid when it rehashes.
+  entry->m_key = &ibp.first->first;
+  push_front(entry);
+  // Evict the least recently used reply.
+  if (m_entries.size() > m_max_entries)
+    erase(m_entries.find(*m_least_recent->m_key));
+}
+
+void ReplyCache::invalidate(std::string const& key)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto iter = m_entries.find(key);
+  if (iter != m_entries.end())
+    erase(iter);
+}
+
+void ReplyCache::invalidate(Destination const& destination)
+{
+  DoutEntering(dc::notice, "ReplyCache::invalidate(\"" << destination.method_name() << "\")");
+  // Every key of this method starts with this prefix (see coalescing_key).
+  std::string const prefix = coalescing_key(destination);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto iter = m_entries.begin(); iter != m_entries.end();)
+  {
+    auto next = std::next(iter);
+    if (iter->first.compare(0, prefix.size(), prefix) == 0)
+      erase(iter);
+    iter = next;
+  }
+}
+
+void ReplyCache::invalidate_all()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  while (!m_entries.empty())
+    erase(m_entries.begin());
+}
+
+size_t ReplyCache::size()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_entries.size();
+}
+
+} // namespace dbus
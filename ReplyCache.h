@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Message.h"
+#include "InlineFunction.h"
+#include <boost/intrusive_ptr.hpp>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "debug.h"
+
+namespace task {
+class DBusConnection;
+} // namespace task
+
+namespace dbus {
+
+class Destination;
+
+// A client side cache of the replies of idempotent method calls.
+//
+// Replies are keyed by destination and arguments (see task::DBusMethodCall::set_reply_cache).
+// Every remote method has its own time-to-live; methods without one are not cached.
+// When the cache is full the least recently used reply is evicted.
+//
+// The cache stores a private copy of each reply, made while holding the lock of the connection
+// that received it. Nothing else refers to that copy, so a cache hit can read it (and call the
+// reply callback) while holding only the mutex of the cache. Only when a reply is dropped from
+// the cache its copy is passed to the connection, because freeing a message requires the connection lock.
+class ReplyCache
+{
+ public:
+  using reply_callback_type = InlineFunction<void(MessageRead const&)>;
+  using clock_type = std::chrono::steady_clock;
+
+ private:
+  struct Entry;
+
+  size_t const m_max_entries;                                                   // The maximum number of cached replies.
+  std::chrono::microseconds const m_default_ttl;                                // The time-to-live of methods that set_ttl wasn't called for.
+  std::mutex m_mutex;                                                           // Protects the members below.
+  std::unordered_map<std::string, Entry*> m_entries;                            // The cached replies, by key.
+  std::unordered_map<std::string, std::chrono::microseconds> m_ttls;            // The time-to-live of each method, by coalescing_key(destination).
+  Entry* m_most_recent;                                                         // The head of the LRU list.
+  Entry* m_least_recent;                                                        // The tail of the LRU list.
+
+ public:
+  ReplyCache(size_t max_entries, std::chrono::microseconds default_ttl = std::chrono::microseconds::zero());
+  ~ReplyCache();
+
+  // Cache the replies of the method of destination for ttl. A ttl of zero disables caching of that method.
+  void set_ttl(Destination const& destination, std::chrono::microseconds ttl);
+
+  // If a reply for key is cached and not expired, call reply_callback with it and return true.
+  bool lookup(std::string const& key, reply_callback_type const& reply_callback);
+
+  // Cache reply, received by connection, under key.
+  // Called from the reply callback, while holding the lock of connection.
+  void store(std::string const& key, Destination const& destination, MessageRead const& reply, boost::intrusive_ptr<task::DBusConnection const> const& connection);
+
+  // Drop the cached reply for key, if any.
+  void invalidate(std::string const& key);
+
+  // Drop all cached replies of the method of destination.
+  void invalidate(Destination const& destination);
+
+  // Drop all cached replies.
+  void invalidate_all();
+
+  // Return a match callback (see task::DBusMatchSignal::set_match_callback) that drops all cached replies
+  // of the method of destination whenever the signal is received.
+  auto invalidator(Destination const* destination)
+  {
+    return [this, destination](MessageRead const&){ invalidate(*destination); };
+  }
+
+  // Return the number of cached replies.
+  size_t size();
+
+ private:
+  void unlink(Entry* entry);
+  void push_front(Entry* entry);
+  void erase(std::unordered_map<std::string, Entry*>::iterator iter);
+};
+
+} // namespace dbus
@@ -0,0 +1,46 @@
+#include "sys.h"
+#include "RetryPolicy.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace dbus {
+
+bool RetryPolicy::should_retry(std::error_code const& error) const
+{
+  return std::find(m_retry_on.begin(), m_retry_on.end(), error) != m_retry_on.end();
+}
+
+std::chrono::microseconds RetryPolicy::backoff(unsigned int retry) const
+{
+  // Retries are numbered starting at one.
+  ASSERT(retry > 0);
+  double upper_bound = m_initial_backoff.count() * std::pow(m_multiplier, retry - 1);
+  upper_bound = std::min(upper_bound, static_cast<double>(m_max_backoff.count()));
+  // Full jitter.
+  static thread_local std::minstd_rand s_jitter(std::random_device{}());
+  std::uniform_real_distribution<double> jitter(0.0, upper_bound);
+  return std::chrono::microseconds(static_cast<std::chrono::microseconds::rep>(jitter(s_jitter)));
+}
+
+void RetryBudget::deposit()
+{
+  int tokens = m_milli_tokens.load(std::memory_order_relaxed);
+  while (tokens < m_max_milli_tokens &&
+      !m_milli_tokens.compare_exchange_weak(tokens, std::min(tokens + m_milli_ratio, m_max_milli_tokens), std::memory_order_relaxed))
+    ;
+}
+
+bool RetryBudget::withdraw()
+{
+  int tokens = m_milli_tokens.load(std::memory_order_relaxed);
+  do
+  {
+    if (tokens < 1000)
+      return false;
+  }
+  while (!m_milli_tokens.compare_exchange_weak(tokens, tokens - 1000, std::memory_order_relaxed));
+  return true;
+}
+
+} // namespace dbus
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "org.freedesktop.DBus.Error/Errors.h"
+#include <atomic>
+#include <chrono>
+#include <system_error>
+#include <vector>
+#include "debug.h"
+
+namespace dbus {
+
+// When and how often to send a method call again after it failed with an error reply (see task::DBusMethodCall::set_retry_policy).
+//
+// The delay before the n-th retry is chosen at random between zero and min(m_max_backoff, m_initial_backoff * m_multiplier^(n-1)),
+// so that calls that failed at the same time (for example while a service was being activated) are spread out.
+struct RetryPolicy
+{
+  using Errors = errors::org::freedesktop::DBus::Error::Errors;
+
+  std::vector<std::error_code> m_retry_on = {                           // The errors that are worth retrying.
+    Errors::ServiceUnknown, Errors::NameHasNoOwner, Errors::NoReply };
+  unsigned int m_max_attempts = 4;                                      // The maximum number of times a call is sent, including the first time.
+  std::chrono::microseconds m_initial_backoff{10000};                   // The upper bound of the delay before the first retry.
+  std::chrono::microseconds m_max_backoff{1000000};                     // The upper bound of the delay never exceeds this value.
+  double m_multiplier = 2.0;                                            // The factor by which the upper bound grows after every retry.
+
+  // Return true if a call that failed with error should be sent again.
+  bool should_retry(std::error_code const& error) const;
+
+  // Return the time to wait before retry number retry (one for the first retry).
+  std::chrono::microseconds backoff(unsigned int retry) const;
+};
+
+// A budget of retries shared by many calls, so that a peer that is down doesn't receive a multiple of the normal traffic.
+//
+// Every retry costs one token; every call that succeeds adds m_ratio tokens, up to m_max_tokens.
+// Hence, in the long run, no more than m_ratio retries are done per successful call.
+class RetryBudget
+{
+ private:
+  int const m_max_milli_tokens;                                         // The maximum number of tokens, times 1000.
+  int const m_milli_ratio;                                              // The number of tokens added per success, times 1000.
+  std::atomic<int> m_milli_tokens;                                      // The number of available tokens, times 1000.
+
+ public:
+  RetryBudget(unsigned int max_tokens = 10, double ratio = 0.1) :
+    m_max_milli_tokens(max_tokens * 1000), m_milli_ratio(ratio * 1000), m_milli_tokens(m_max_milli_tokens) { }
+
+  // Called when a call succeeded.
+  void deposit();
+
+  // Try to take a token for a retry. Returns false if the budget is exhausted.
+  bool withdraw();
+};
+
+} // namespace dbus
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace dbus {
+
+class UnixFd;
+
+// A string that is computed at compile time.
+template<std::size_t N>
+struct Signature
+{
+  char m_str[N + 1] = {};
+
+  constexpr Signature() = default;
+  constexpr Signature(char const (&str)[N + 1]) { std::copy_n(str, N + 1, m_str); }
+
+  static constexpr std::size_t size() { return N; }
+  constexpr char const* c_str() const { return m_str; }
+  constexpr char operator[](std::size_t i) const { return m_str[i]; }
+  constexpr operator std::string_view() const { return { m_str, N }; }
+
+  template<std::size_t M>
+  constexpr Signature<N + M> operator+(Signature<M> const& rhs) const
+  {
+    Signature<N + M> result;
+    std::copy_n(m_str, N, result.m_str);
+    std::copy_n(rhs.m_str, M + 1, result.m_str + N);
+    return result;
+  }
+};
+
+template<std::size_t N>
+Signature(char const (&)[N]) -> Signature<N - 1>;
+
+namespace detail {
+
+// The type code of the basic D-Bus types, or zero if T isn't one.
+template<typename T>
+consteval char basic_type_code()
+{
+  if constexpr (std::is_same_v<T, uint8_t>)
+    return 'y';
+  else if constexpr (std::is_same_v<T, bool>)
+    return 'b';
+  else if constexpr (std::is_same_v<T, int16_t>)
+    return 'n';
+  else if constexpr (std::is_same_v<T, uint16_t>)
+    return 'q';
+  else if constexpr (std::is_same_v<T, int32_t>)
+    return 'i';
+  else if constexpr (std::is_same_v<T, uint32_t>)
+    return 'u';
+  else if constexpr (std::is_same_v<T, int64_t>)
+    return 'x';
+  else if constexpr (std::is_same_v<T, uint64_t>)
+    return 't';
+  else if constexpr (std::is_same_v<T, double>)
+    return 'd';
+  else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>)
+    return 's';
+  else if constexpr (std::is_same_v<T, UnixFd>)
+    return 'h';
+  else
+    return 0;
+}
+
+// True if T is a basic type whose wire format is its memory representation, so that
+// arrays of T can be copied as a whole (see sd_bus_message_append_array and sd_bus_message_read_array).
+// A D-Bus BOOLEAN is 32 bits, so bool is not one of them.
+template<typename T>
+inline constexpr bool is_fixed_size_v = std::is_arithmetic_v<T> && !std::is_same_v<T, bool> && basic_type_code<T>() != 0;
+
+template<typename T> struct is_std_vector : std::false_type { };
+template<typename T, typename A> struct is_std_vector<std::vector<T, A>> : std::true_type { };
+
+template<typename T> struct is_std_array : std::false_type { };
+template<typename T, std::size_t N> struct is_std_array<std::array<T, N>> : std::true_type { };
+
+template<typename T> struct is_std_map : std::false_type { };
+template<typename K, typename V, typename C, typename A> struct is_std_map<std::map<K, V, C, A>> : std::true_type { };
+template<typename K, typename V, typename H, typename E, typename A> struct is_std_map<std::unordered_map<K, V, H, E, A>> : std::true_type { };
+
+template<typename T> struct is_std_tuple : std::false_type { };
+template<typename... Ts> struct is_std_tuple<std::tuple<Ts...>> : std::true_type { };
+template<typename T1, typename T2> struct is_std_tuple<std::pair<T1, T2>> : std::true_type { };
+
+template<typename T> struct is_std_variant : std::false_type { };
+template<typename... Ts> struct is_std_variant<std::variant<Ts...>> : std::true_type { };
+
+template<typename T> struct is_std_optional : std::false_type { };
+template<typename T> struct is_std_optional<std::optional<T>> : std::true_type { };
+
+// Converts to anything; used to count the members of an aggregate.
+struct any_type
+{
+  template<typename T>
+  operator T&() const&&;
+};
+
+template<typename T, typename... Args>
+consteval std::size_t aggregate_arity()
+{
+  if constexpr (requires { T{ Args{}..., any_type{} }; })
+    return aggregate_arity<T, Args..., any_type>();
+  else
+    return sizeof...(Args);
+}
+
+// Return a std::tuple of references to the members of the aggregate value.
+template<typename T>
+constexpr auto tie_aggregate(T& value)
+{
+  constexpr std::size_t n = aggregate_arity<std::remove_const_t<T>>();
+  static_assert(n <= 12, "Aggregates with more than 12 members are not supported.");
+  if constexpr (n == 0) return std::tuple<>();
+  else if constexpr (n == 1) { auto& [m1] = value; return std::tie(m1); }
+  else if constexpr (n == 2) { auto& [m1, m2] = value; return std::tie(m1, m2); }
+  else if constexpr (n == 3) { auto& [m1, m2, m3] = value; return std::tie(m1, m2, m3); }
+  else if constexpr (n == 4) { auto& [m1, m2, m3, m4] = value; return std::tie(m1, m2, m3, m4); }
+  else if constexpr (n == 5) { auto& [m1, m2, m3, m4, m5] = value; return std::tie(m1, m2, m3, m4, m5); }
+  else if constexpr (n == 6) { auto& [m1, m2, m3, m4, m5, m6] = value; return std::tie(m1, m2, m3, m4, m5, m6); }
+  else if constexpr (n == 7) { auto& [m1, m2, m3, m4, m5, m6, m7] = value; return std::tie(m1, m2, m3, m4, m5, m6, m7); }
+  else if constexpr (n == 8) { auto& [m1, m2, m3, m4, m5, m6, m7, m8] = value; return std::tie(m1, m2, m3, m4, m5, m6, m7, m8); }
+  else if constexpr (n == 9) { auto& [m1, m2, m3, m4, m5, m6, m7, m8, m9] = value; return std::tie(m1, m2, m3, m4, m5, m6, m7, m8, m9); }
+  else if constexpr (n == 10) { auto& [m1, m2, m3, m4, m5, m6, m7, m8, m9, m10] = value; return std::tie(m1, m2, m3, m4, m5, m6, m7, m8, m9, m10); }
+  else if constexpr (n == 11) { auto& [m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11] = value; return std::tie(m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11); }
+  else if constexpr (n == 12) { auto& [m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11, m12] = value; return std::tie(m1, m2, m3, m4, m5, m6, m7, m8, m9, m10, m11, m12); }
+}
+
+template<typename T>
+struct decayed_tuple;
+
+template<typename... Ts>
+struct decayed_tuple<std::tuple<Ts...>> { using type = std::tuple<std::remove_cvref_t<Ts>...>; };
+
+// The member types of an aggregate, as a std::tuple.
+template<typename T>
+using aggregate_tuple_t = typename decayed_tuple<decltype(tie_aggregate(std::declval<T&>()))>::type;
+
+// The types of the members of a STRUCT, as a std::tuple.
+template<typename T>
+struct struct_members { using type = aggregate_tuple_t<T>; };
+
+template<typename... Ts>
+struct struct_members<std::tuple<Ts...>> { using type = std::tuple<std::remove_cvref_t<Ts>...>; };
+
+template<typename T1, typename T2>
+struct struct_members<std::pair<T1, T2>> { using type = std::tuple<std::remove_cvref_t<T1>, std::remove_cvref_t<T2>>; };
+
+enum class Kind
+{
+  unsupported,
+  basic,                // A basic type (see basic_type_code).
+  array,                // std::vector, std::array: ARRAY.
+  dict,                 // std::map, std::unordered_map: ARRAY of DICT_ENTRY.
+  structure,            // std::tuple, std::pair, aggregates: STRUCT.
+  variant,              // std::variant: VARIANT; the alternative is determined at run time.
+  optional              // std::optional: an ARRAY with zero or one elements.
+};
+
+template<typename T>
+consteval Kind kind_of();
+
+template<typename Tuple>
+struct all_supported;
+
+template<typename... Ts>
+struct all_supported<std::tuple<Ts...>>
+{
+  static constexpr bool value = sizeof...(Ts) > 0 && ((kind_of<Ts>() != Kind::unsupported) && ...);
+};
+
+template<typename T>
+consteval Kind kind_of()
+{
+  if constexpr (basic_type_code<T>() != 0)
+    return Kind::basic;
+  else if constexpr (is_std_vector<T>::value || is_std_array<T>::value)
+    return kind_of<typename T::value_type>() != Kind::unsupported ? Kind::array : Kind::unsupported;
+  else if constexpr (is_std_map<T>::value)
+    // The key of a DICT_ENTRY must be a basic type.
+    return kind_of<typename T::key_type>() == Kind::basic && kind_of<typename T::mapped_type>() != Kind::unsupported ? Kind::dict : Kind::unsupported;
+  else if constexpr (is_std_variant<T>::value)
+    return []<typename... Ts>(std::variant<Ts...>*){ return ((kind_of<Ts>() != Kind::unsupported) && ...); }(static_cast<T*>(nullptr)) ? Kind::variant : Kind::unsupported;
+  else if constexpr (is_std_optional<T>::value)
+    return kind_of<typename T::value_type>() != Kind::unsupported ? Kind::optional : Kind::unsupported;
+  else if constexpr (is_std_tuple<T>::value || (std::is_class_v<T> && std::is_aggregate_v<T>))
+    return all_supported<typename struct_members<T>::type>::value ? Kind::structure : Kind::unsupported;
+  else
+    return Kind::unsupported;
+}
+
+} // namespace detail
+
+// Types that can be appended to and read from a message.
+template<typename T>
+concept DBusType = detail::kind_of<std::remove_cvref_t<T>>() != detail::Kind::unsupported;
+
+template<DBusType T>
+consteval auto signature_of();
+
+namespace detail {
+
+template<typename Tuple>
+struct concatenated_signatures;
+
+template<typename... Ts>
+struct concatenated_signatures<std::tuple<Ts...>>
+{
+  static constexpr auto value = (Signature("") + ... + signature_of<Ts>());
+};
+
+// The signature of the members of a STRUCT, without the parentheses.
+template<typename T>
+inline constexpr auto struct_contents_v = concatenated_signatures<typename struct_members<T>::type>::value;
+
+// The signature of the key and value of a DICT_ENTRY, without the braces.
+template<typename T>
+inline constexpr auto dict_entry_contents_v = signature_of<typename T::key_type>() + signature_of<typename T::mapped_type>();
+
+} // namespace detail
+
+// Return the D-Bus signature of T. A type that isn't supported is a compile error.
+template<DBusType T>
+consteval auto signature_of()
+{
+  using U = std::remove_cvref_t<T>;
+  constexpr detail::Kind kind = detail::kind_of<U>();
+  if constexpr (kind == detail::Kind::basic)
+  {
+    Signature<1> signature;
+    signature.m_str[0] = detail::basic_type_code<U>();
+    return signature;
+  }
+  else if constexpr (kind == detail::Kind::array || kind == detail::Kind::optional)
+    return Signature("a") + signature_of<typename U::value_type>();
+  else if constexpr (kind == detail::Kind::dict)
+    return Signature("a{") + detail::dict_entry_contents_v<U> + Signature("}");
+  else if constexpr (kind == detail::Kind::structure)
+    return Signature("(") + detail::struct_contents_v<U> + Signature(")");
+  else
+    return Signature("v");
+}
+
+template<typename T>
+inline constexpr auto signature_v = signature_of<T>();
+
+} // namespace dbus
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "systemd_sd-bus.h"
+#include <atomic>
+#include "debug.h"
+
+namespace dbus {
+
+class SubmissionQueue;
+
+// Base class of objects that can be passed to task::DBusHandleIO::submit.
+class OutboundRequest
+{
+ private:
+  friend class SubmissionQueue;
+  OutboundRequest* m_next;                      // The next request in the SubmissionQueue.
+
+ protected:
+  ~OutboundRequest() = default;
+
+ public:
+  // Called by task::DBusHandleIO while it holds the connection lock.
+  // This function may not throw.
+  virtual void submit(sd_bus* bus) = 0;
+
+  // Called by task::DBusHandleIO, instead of submit, for a request that is still queued or scheduled when it finishes.
+  // Also called while holding the connection lock. This function may not throw.
+  virtual void discard() = 0;
+};
+
+// A lock-free multi-producer, single-consumer queue of OutboundRequest objects.
+//
+// Any thread may push requests; only the task::DBusHandleIO of the connection,
+// while holding the connection lock, drains the queue.
+class SubmissionQueue
+{
+ private:
+  std::atomic<OutboundRequest*> m_head;         // The last pushed request; requests are linked in reverse order.
+
+ public:
+  SubmissionQueue() : m_head(nullptr) { }
+
+  // Add request to the queue. Returns true if the queue was empty.
+  bool push(OutboundRequest* request)
+  {
+    OutboundRequest* head = m_head.load(std::memory_order_relaxed);
+    do
+      request->m_next = head;
+    while (!m_head.compare_exchange_weak(head, request, std::memory_order_release, std::memory_order_relaxed));
+    return !head;
+  }
+
+  bool empty() const
+  {
+    return !m_head.load(std::memory_order_relaxed);
+  }
+
+  // Remove all requests from the queue and call func for each of them, in the order in which they were pushed.
+  template<typename FUNC>
+  void drain(FUNC func)
+  {
+    OutboundRequest* lifo = m_head.exchange(nullptr, std::memory_order_acquire);
+    OutboundRequest* fifo = nullptr;
+    while (lifo)
+    {
+      OutboundRequest* next = lifo->m_next;
+      lifo->m_next = fifo;
+      fifo = lifo;
+      lifo = next;
+    }
+    while (fifo)
+    {
+      // Read m_next before calling func, because func might cause the request to be destroyed.
+      OutboundRequest* next = fifo->m_next;
+      func(fifo);
+      fifo = next;
+    }
+  }
+};
+
+} // namespace dbus
@@ -0,0 +1,63 @@
+#include "sys.h"
+#include "TimerFd.h"
+#include "utils/AIAlert.h"
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace dbus {
+
+void TimerFd::init()
+{
+  DoutEntering(dc::notice, "dbus::TimerFd::init()");
+  m_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (m_fd == -1)
+    THROW_ALERTC(errno, "timerfd_create");
+  fd_init(m_fd);
+}
+
+void TimerFd::arm_at(uint64_t monotonic_usec)
+{
+  // The value zero would disarm the timer.
+  if (monotonic_usec == 0)
+    monotonic_usec = 1;
+  struct itimerspec value = {};
+  value.it_value.tv_sec = monotonic_usec / 1000000;
+  value.it_value.tv_nsec = (monotonic_usec % 1000000) * 1000;
+  if (timerfd_settime(m_fd, TFD_TIMER_ABSTIME, &value, nullptr) == -1)
+    THROW_ALERTC(errno, "timerfd_settime");
+  m_expiration_usec.store(monotonic_usec, std::memory_order_relaxed);
+  start_input_device();
+}
+
+void TimerFd::arm_in(std::chrono::microseconds timeout)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t now_usec = static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+  arm_at(now_usec + timeout.count());
+}
+
+void TimerFd::disarm()
+{
+  if (m_expiration_usec.load(std::memory_order_relaxed) == UINT64_MAX)
+    return;
+  struct itimerspec value = {};
+  timerfd_settime(m_fd, 0, &value, nullptr);
+  m_expiration_usec.store(UINT64_MAX, std::memory_order_relaxed);
+  stop_input_device();
+}
+
+void TimerFd::read_from_fd(int& UNUSED_ARG(allow_deletion_count), int fd)
+{
+  DoutEntering(dc::notice, "dbus::TimerFd::read_from_fd()");
+  uint64_t expirations;
+  if (::read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;     // Spurious wakeup (EAGAIN), for example because the timer was rearmed.
+  m_expiration_usec.store(UINT64_MAX, std::memory_order_relaxed);
+  // Don't keep the EventLoop busy with a timer that isn't armed.
+  stop_input_device();
+  m_task->signal(m_condition);
+}
+
+} // namespace dbus
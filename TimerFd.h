@@ -0,0 +1,49 @@
+#pragma once
+
+#include "evio/RawInputDevice.h"
+#include "statefultask/AIStatefulTask.h"
+#include <atomic>
+#include <chrono>
+#include "debug.h"
+
+namespace dbus {
+
+// A one-shot timer that signals a task when it expires.
+//
+// The timerfd is only monitored by the EventLoop while the timer is armed.
+class TimerFd : public evio::RawInputDevice
+{
+  using condition_type = AIStatefulTask::condition_type;
+
+ private:
+  AIStatefulTask* m_task;                       // The task to signal.
+  condition_type m_condition;                   // The condition to signal it with.
+  int m_fd;                                     // The timerfd.
+  std::atomic<uint64_t> m_expiration_usec;      // The CLOCK_MONOTONIC time at which the timer is armed to expire, or UINT64_MAX if it isn't armed.
+
+ public:
+  TimerFd(AIStatefulTask* task, condition_type condition) : m_task(task), m_condition(condition), m_fd(-1), m_expiration_usec(UINT64_MAX) { }
+
+  // Create the timerfd.
+  void init();
+
+  // Arm the timer to expire at monotonic_usec (microseconds since the CLOCK_MONOTONIC epoch).
+  // Rearming a timer replaces the previous expiration time.
+  void arm_at(uint64_t monotonic_usec);
+
+  // Arm the timer to expire after timeout.
+  void arm_in(std::chrono::microseconds timeout);
+
+  // Stop the timer.
+  void disarm();
+
+  // Return the expiration time that the timer is armed with, or UINT64_MAX if it isn't armed.
+  uint64_t expiration_usec() const { return m_expiration_usec.load(std::memory_order_relaxed); }
+
+ protected:
+  void read_from_fd(int& allow_deletion_count, int fd) override;
+  void hup(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override { DoutEntering(dc::notice, "dbus::TimerFd::hup"); }
+  void err(int& UNUSED_ARG(allow_deletion_count), int UNUSED_ARG(fd)) override { DoutEntering(dc::notice, "dbus::TimerFd::err"); close(); }
+};
+
+} // namespace dbus
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <unistd.h>
+#include <utility>
+#include "debug.h"
+
+namespace dbus {
+
+// An owned file descriptor, as sent and received with the D-Bus type UNIX_FD ('h').
+//
+// Appending a UnixFd to a Message duplicates the fd; reading one from a MessageRead
+// returns a duplicate of the fd that is owned by the message, so it can outlive the message.
+class UnixFd
+{
+ private:
+  int m_fd;
+
+ public:
+  UnixFd() : m_fd(-1) { }
+  // Take ownership of fd.
+  explicit UnixFd(int fd) : m_fd(fd) { }
+  UnixFd(UnixFd&& orig) : m_fd(std::exchange(orig.m_fd, -1)) { }
+  UnixFd(UnixFd const&) = delete;
+  ~UnixFd() { reset(); }
+
+  UnixFd& operator=(UnixFd&& orig)
+  {
+    reset();
+    m_fd = std::exchange(orig.m_fd, -1);
+    return *this;
+  }
+
+  void reset()
+  {
+    if (m_fd != -1)
+    {
+      ::close(m_fd);
+      m_fd = -1;
+    }
+  }
+
+  // Give up ownership.
+  int release() { return std::exchange(m_fd, -1); }
+
+  int get() const { return m_fd; }
+  bool is_valid() const { return m_fd != -1; }
+};
+
+} // namespace dbus
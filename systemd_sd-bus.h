@@ -12,7 +12,9 @@ NAMESPACE_DEBUG_CHANNELS_END
 
 #ifndef SB_BUS_NO_WRAP
 #define sd_bus_add_object wrap_bus_add_object
+#define sd_bus_add_filter wrap_bus_add_filter
 #define sd_bus_call_async wrap_bus_call_async
+#define sd_bus_close wrap_bus_close
 #define sd_bus_error_copy wrap_bus_error_copy
 #define sd_bus_error_get_errno wrap_bus_error_get_errno
 #define sd_bus_error_is_set wrap_bus_error_is_set
@@ -22,11 +24,21 @@ NAMESPACE_DEBUG_CHANNELS_END
 #define sd_bus_error_set_errnofv wrap_bus_error_set_errnofv
 #define sd_bus_get_events wrap_bus_get_events
 #define sd_bus_get_fd wrap_bus_get_fd
+#define sd_bus_get_n_queued_read wrap_bus_get_n_queued_read
+#define sd_bus_get_n_queued_write wrap_bus_get_n_queued_write
+#define sd_bus_get_timeout wrap_bus_get_timeout
 #define sd_bus_get_unique_name wrap_bus_get_unique_name
+#define sd_bus_interface_name_is_valid wrap_bus_interface_name_is_valid
+#define sd_bus_is_open wrap_bus_is_open
 #define sd_bus_match_signal_async wrap_bus_match_signal_async
+#define sd_bus_member_name_is_valid wrap_bus_member_name_is_valid
 #define sd_bus_message_append_array wrap_bus_message_append_array
+#define sd_bus_message_append_array_space wrap_bus_message_append_array_space
 #define sd_bus_message_append_basic wrap_bus_message_append_basic
+#define sd_bus_message_append_string_space wrap_bus_message_append_string_space
 #define sd_bus_message_at_end wrap_bus_message_at_end
+#define sd_bus_message_close_container wrap_bus_message_close_container
+#define sd_bus_message_copy wrap_bus_message_copy
 #define sd_bus_message_enter_container wrap_bus_message_enter_container
 #define sd_bus_message_exit_container wrap_bus_message_exit_container
 #define sd_bus_message_get_allow_interactive_authorization wrap_bus_message_get_allow_interactive_authorization
@@ -48,15 +60,35 @@ NAMESPACE_DEBUG_CHANNELS_END
 #define sd_bus_message_is_method_call wrap_bus_message_is_method_call
 #define sd_bus_message_is_method_error wrap_bus_message_is_method_error
 #define sd_bus_message_is_signal wrap_bus_message_is_signal
+#define sd_bus_message_new wrap_bus_message_new
 #define sd_bus_message_new_method_call wrap_bus_message_new_method_call
+#define sd_bus_message_open_container wrap_bus_message_open_container
 #define sd_bus_message_peek_type wrap_bus_message_peek_type
+#define sd_bus_message_read_array wrap_bus_message_read_array
+#define sd_bus_message_read_basic wrap_bus_message_read_basic
 #define sd_bus_message_ref wrap_bus_message_ref
+#define sd_bus_message_rewind wrap_bus_message_rewind
+#define sd_bus_message_seal wrap_bus_message_seal
+#define sd_bus_message_set_expect_reply wrap_bus_message_set_expect_reply
 #define sd_bus_message_unref wrap_bus_message_unref
+#define sd_bus_new wrap_bus_new
+#define sd_bus_object_path_is_valid wrap_bus_object_path_is_valid
 #define sd_bus_open_system_with_description wrap_bus_open_system_with_description
 #define sd_bus_open_user_with_description wrap_bus_open_user_with_description
 #define sd_bus_process wrap_bus_process
 #define sd_bus_request_name_async wrap_bus_request_name_async
+#define sd_bus_send wrap_bus_send
+#define sd_bus_service_name_is_valid wrap_bus_service_name_is_valid
+#define sd_bus_set_address wrap_bus_set_address
+#define sd_bus_set_bus_client wrap_bus_set_bus_client
+#define sd_bus_set_connected_signal wrap_bus_set_connected_signal
+#define sd_bus_set_description wrap_bus_set_description
+#define sd_bus_set_fd wrap_bus_set_fd
+#define sd_bus_set_server wrap_bus_set_server
+#define sd_bus_set_trusted wrap_bus_set_trusted
 #define sd_bus_slot_unref wrap_bus_slot_unref
+#define sd_bus_start wrap_bus_start
+#define sd_bus_unref wrap_bus_unref
 #define sd_bus_error_free wrap_bus_error_free
 #define sd_bus_message_read wrap_bus_message_read
 #define sd_bus_reply_method_return wrap_bus_reply_method_return
@@ -64,6 +96,7 @@ NAMESPACE_DEBUG_CHANNELS_END
 
 #define SD_BUS_FOREACH_NON_VOID_FUNCTION(X) \
   X(int, bus_add_object, (sd_bus* bus, sd_bus_slot** slot, char const* path, sd_bus_message_handler_t callback, void* userdata), bus, slot, path, callback, userdata) \
+  X(int, bus_add_filter, (sd_bus* bus, sd_bus_slot** slot, sd_bus_message_handler_t callback, void* userdata), bus, slot, callback, userdata) \
   X(int, bus_call_async, (sd_bus* bus, sd_bus_slot** slot, sd_bus_message* m, sd_bus_message_handler_t callback, void* userdata, uint64_t usec), bus, slot, m, callback, userdata, usec) \
   X(int, bus_error_copy, (sd_bus_error* dest, sd_bus_error const* e), dest, e) \
   X(int, bus_error_get_errno, (sd_bus_error const* e), e) \
@@ -74,14 +107,24 @@ NAMESPACE_DEBUG_CHANNELS_END
   X(int, bus_error_set_errnofv, (sd_bus_error* e, int error, char const* format, va_list ap), e, error, format, ap) \
   X(int, bus_get_events, (sd_bus* bus), bus) \
   X(int, bus_get_fd, (sd_bus* bus), bus) \
+  X(int, bus_get_n_queued_read, (sd_bus* bus, uint64_t* ret), bus, ret) \
+  X(int, bus_get_n_queued_write, (sd_bus* bus, uint64_t* ret), bus, ret) \
+  X(int, bus_get_timeout, (sd_bus* bus, uint64_t* timeout_usec), bus, timeout_usec) \
   X(int, bus_get_unique_name, (sd_bus* bus, char const** unique), bus, unique) \
+  X(int, bus_interface_name_is_valid, (char const* p), p) \
+  X(int, bus_is_open, (sd_bus* bus), bus) \
   X(int, bus_match_signal_async, \
       (sd_bus* bus, sd_bus_slot** ret, char const* sender, char const* path, char const* interface, char const* member, \
        sd_bus_message_handler_t callback, sd_bus_message_handler_t install_callback, void* userdata), \
       bus, ret, sender, path, interface, member, callback, install_callback, userdata) \
+  X(int, bus_member_name_is_valid, (char const* p), p) \
   X(int, bus_message_append_array, (sd_bus_message* m, char type, void const* ptr, size_t size), m, type, ptr, size) \
+  X(int, bus_message_append_array_space, (sd_bus_message* m, char type, size_t size, void** ptr), m, type, size, ptr) \
   X(int, bus_message_append_basic, (sd_bus_message* m, char type, void const* p), m, type, p) \
+  X(int, bus_message_append_string_space, (sd_bus_message* m, size_t size, char** s), m, size, s) \
   X(int, bus_message_at_end, (sd_bus_message* m, int complete), m, complete) \
+  X(int, bus_message_close_container, (sd_bus_message* m), m) \
+  X(int, bus_message_copy, (sd_bus_message* m, sd_bus_message* source, int all), m, source, all) \
   X(int, bus_message_enter_container, (sd_bus_message* m, char type, char const* contents), m, type, contents) \
   X(int, bus_message_exit_container, (sd_bus_message* m), m) \
   X(int, bus_message_get_allow_interactive_authorization, (sd_bus_message* m), m) \
@@ -103,21 +146,42 @@ NAMESPACE_DEBUG_CHANNELS_END
   X(int, bus_message_is_method_call, (sd_bus_message* m, char const* interface, char const* member), m, interface, member) \
   X(int, bus_message_is_method_error, (sd_bus_message* m, char const* name), m, name) \
   X(int, bus_message_is_signal, (sd_bus_message* m, char const* interface, char const* member), m, interface, member) \
+  X(int, bus_message_new, (sd_bus* bus, sd_bus_message** m, uint8_t type), bus, m, type) \
   X(int, bus_message_new_method_call, \
       (sd_bus* bus, sd_bus_message** m, char const* destination, char const* path, char const* interface, char const* member), \
       bus, m, destination, path, interface, member) \
+  X(int, bus_message_open_container, (sd_bus_message* m, char type, char const* contents), m, type, contents) \
   X(int, bus_message_peek_type, (sd_bus_message* m, char* type, char const** contents), m, type, contents) \
+  X(int, bus_message_read_array, (sd_bus_message* m, char type, void const** ptr, size_t* size), m, type, ptr, size) \
+  X(int, bus_message_read_basic, (sd_bus_message* m, char type, void* p), m, type, p) \
   X(sd_bus_message*, bus_message_ref, (sd_bus_message* m), m) \
+  X(int, bus_message_rewind, (sd_bus_message* m, int complete), m, complete) \
+  X(int, bus_message_seal, (sd_bus_message* m, uint64_t cookie, uint64_t timeout_usec), m, cookie, timeout_usec) \
+  X(int, bus_message_set_expect_reply, (sd_bus_message* m, int b), m, b) \
   X(sd_bus_message*, bus_message_unref, (sd_bus_message* m), m) \
+  X(int, bus_new, (sd_bus** ret), ret) \
+  X(int, bus_object_path_is_valid, (char const* p), p) \
   X(int, bus_open_system_with_description, (sd_bus** ret, char const* description), ret, description) \
   X(int, bus_open_user_with_description, (sd_bus** ret, char const* description), ret, description) \
   X(int, bus_process, (sd_bus* bus, sd_bus_message* *ret), bus, ret) \
   X(int, bus_request_name_async, \
       (sd_bus* bus, sd_bus_slot** ret_slot, char const* name, uint64_t flags, sd_bus_message_handler_t callback, void* userdata), \
       bus, ret_slot, name, flags, callback, userdata) \
-  X(sd_bus_slot*, bus_slot_unref, (sd_bus_slot* slot), slot)
+  X(int, bus_send, (sd_bus* bus, sd_bus_message* m, uint64_t* cookie), bus, m, cookie) \
+  X(int, bus_service_name_is_valid, (char const* p), p) \
+  X(int, bus_set_address, (sd_bus* bus, char const* address), bus, address) \
+  X(int, bus_set_bus_client, (sd_bus* bus, int b), bus, b) \
+  X(int, bus_set_connected_signal, (sd_bus* bus, int b), bus, b) \
+  X(int, bus_set_description, (sd_bus* bus, char const* description), bus, description) \
+  X(int, bus_set_fd, (sd_bus* bus, int input_fd, int output_fd), bus, input_fd, output_fd) \
+  X(int, bus_set_server, (sd_bus* bus, int b, sd_id128_t server_id), bus, b, server_id) \
+  X(int, bus_set_trusted, (sd_bus* bus, int b), bus, b) \
+  X(sd_bus_slot*, bus_slot_unref, (sd_bus_slot* slot), slot) \
+  X(int, bus_start, (sd_bus* bus), bus) \
+  X(sd_bus*, bus_unref, (sd_bus* bus), bus)
 
 #define SD_BUS_FOREACH_VOID_FUNCTION(X) \
+  X(void, bus_close, (sd_bus* bus), (bus)) \
   X(void, bus_error_free, (sd_bus_error* e), (e))
 
 #define SD_BUS_FOREACH_ELIPSIS_FUNCTION(X) \
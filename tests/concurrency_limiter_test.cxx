@@ -0,0 +1,191 @@
+#include "sys.h"
+#include "dbus-task/ConcurrencyLimiter.h"
+#include "statefultask/AIStatefulTask.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "threadpool/AIThreadPool.h"
+#include "debug.h"
+
+#include <array>
+#include <chrono>
+
+using namespace std::chrono_literals;
+
+// A task that stands in for a task::DBusMethodCall: it obtains a permit and holds it until complete is called.
+// It uses an immediate handler, so that it runs in the thread that signals it and the test is deterministic.
+class Caller final : public AIStatefulTask
+{
+ public:
+  static constexpr condition_type have_permit = 1;
+  static constexpr condition_type completed = 2;
+
+ private:
+  dbus::ConcurrencyLimiter& m_limiter;
+  bool m_holds_permit;
+
+ protected:
+  /// The base class of this task.
+  using direct_base_type = AIStatefulTask;
+
+  /// The different states of the stateful task.
+  enum Caller_state_type {
+    Caller_acquire = direct_base_type::state_end,
+    Caller_holding,
+    Caller_done
+  };
+
+ public:
+  /// One beyond the largest state of this task.
+  static constexpr state_type state_end = Caller_done + 1;
+
+  Caller(dbus::ConcurrencyLimiter& limiter) : AIStatefulTask(CWDEBUG_ONLY(false)), m_limiter(limiter), m_holds_permit(false) { }
+
+  bool holds_permit() const { return m_holds_permit; }
+
+  // Let the call finish; latency is the time it took.
+  void complete(std::chrono::steady_clock::duration latency, bool overloaded = false)
+  {
+    ASSERT(m_holds_permit);
+    m_holds_permit = false;
+    m_limiter.release(latency, overloaded);
+    signal(completed);
+  }
+
+ protected:
+  ~Caller() override = default;
+
+  char const* condition_str_impl(condition_type condition) const override
+  {
+    switch (condition)
+    {
+      AI_CASE_RETURN(have_permit);
+      AI_CASE_RETURN(completed);
+    }
+    return direct_base_type::condition_str_impl(condition);
+  }
+
+  char const* state_str_impl(state_type run_state) const override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(Caller_acquire);
+      AI_CASE_RETURN(Caller_holding);
+      AI_CASE_RETURN(Caller_done);
+    }
+    AI_NEVER_REACHED;
+  }
+
+  char const* task_name_impl() const override { return "Caller"; }
+
+  void multiplex_impl(state_type run_state) override
+  {
+    switch (run_state)
+    {
+      case Caller_acquire:
+        set_state(Caller_holding);
+        if (!m_limiter.acquire(this, have_permit))
+        {
+          wait(have_permit);
+          break;
+        }
+        [[fallthrough]];
+      case Caller_holding:
+        m_holds_permit = true;
+        set_state(Caller_done);
+        wait(completed);
+        break;
+      case Caller_done:
+        finish();
+        break;
+    }
+  }
+};
+
+int main()
+{
+  Debug(debug::init());
+
+  // Create a AIMemoryPagePool object (must be created before thread_pool).
+  [[maybe_unused]] AIMemoryPagePool mpp;
+  AIThreadPool thread_pool(1);
+  [[maybe_unused]] AIQueueHandle queue = thread_pool.new_queue(1);
+
+  dbus::ConcurrencyPolicy policy;
+  policy.m_initial_limit = 2;
+  policy.m_min_limit = 1;
+  policy.m_max_limit = 3;
+  policy.m_latency_threshold = 100ms;
+  policy.m_backoff = 0.5;
+  dbus::ConcurrencyLimiter limiter(policy);
+
+  std::array<boost::intrusive_ptr<Caller>, 8> callers;
+  int finished = 0;
+  auto run = [&](int i){
+    callers[i] = statefultask::create<Caller>(limiter);
+    callers[i]->run(AIStatefulTask::Handler::immediate, [&finished](bool UNUSED_ARG(success)){ ++finished; });
+  };
+
+  // Only the first two calls may proceed; the others wait in a queue.
+  for (int i = 0; i < 5; ++i)
+    run(i);
+  ASSERT(callers[0]->holds_permit() && callers[1]->holds_permit());
+  ASSERT(!callers[2]->holds_permit() && !callers[3]->holds_permit() && !callers[4]->holds_permit());
+  ASSERT(limiter.limit() == 2 && limiter.in_flight() == 2 && limiter.queued() == 3);
+
+  // Completing a call passes its permit on, in FIFO order.
+  // Fast calls while the limit is reached grow the limit by 1/limit: 2 -> 2.5.
+  callers[0]->complete(1ms);
+  ASSERT(callers[2]->holds_permit() && !callers[3]->holds_permit());
+  ASSERT(limiter.limit() == 2 && limiter.in_flight() == 2 && limiter.queued() == 2);
+  // 2.5 -> 2.9.
+  callers[1]->complete(1ms);
+  ASSERT(callers[3]->holds_permit() && !callers[4]->holds_permit());
+  ASSERT(limiter.limit() == 2 && limiter.in_flight() == 2 && limiter.queued() == 1);
+  // 2.9 -> 3.24: now three calls may be in flight, so the last waiting call proceeds.
+  callers[2]->complete(1ms);
+  ASSERT(callers[4]->holds_permit());
+  ASSERT(limiter.limit() == 3 && limiter.in_flight() == 2 && limiter.queued() == 0);
+  ASSERT(finished == 3);
+
+  // The limit doesn't grow beyond the maximum, and only grows while it is reached.
+  run(5);
+  ASSERT(callers[5]->holds_permit() && limiter.in_flight() == 3);
+  callers[5]->complete(1ms);
+  callers[4]->complete(1ms);
+  ASSERT(limiter.limit() == 3 && limiter.in_flight() == 1);
+
+  // A slow call halves the limit: 3 -> 1.5.
+  callers[3]->complete(200ms);
+  ASSERT(limiter.limit() == 1 && limiter.in_flight() == 0);
+  run(6);
+  run(7);
+  ASSERT(callers[6]->holds_permit() && !callers[7]->holds_permit());
+  ASSERT(limiter.in_flight() == 1 && limiter.queued() == 1);
+  // An overloaded peer decreases it too, but only once per round trip.
+  callers[6]->complete(1ms, true);
+  ASSERT(limiter.limit() == 1);
+  ASSERT(callers[7]->holds_permit() && limiter.in_flight() == 1 && limiter.queued() == 0);
+
+  // A task that was already given a permit can't be cancelled: it has to release it.
+  ASSERT(!limiter.cancel(callers[7].get()));
+  // 1.5 -> 2.17.
+  callers[7]->complete(1ms);
+  ASSERT(limiter.limit() == 2 && limiter.in_flight() == 0);
+
+  // A waiting task can be cancelled.
+  run(0);
+  run(1);
+  run(2);
+  ASSERT(callers[0]->holds_permit() && callers[1]->holds_permit() && !callers[2]->holds_permit() && limiter.queued() == 1);
+  ASSERT(limiter.cancel(callers[2].get()));
+  ASSERT(limiter.queued() == 0);
+  callers[2]->abort();
+  // Releasing the permit of an aborted call doesn't change the limit.
+  callers[1]->abort();
+  limiter.release();
+  ASSERT(limiter.limit() == 2 && limiter.in_flight() == 1);
+  callers[0]->complete(1ms);
+  ASSERT(limiter.in_flight() == 0);
+
+  ASSERT(finished == 11);
+  Dout(dc::notice, "Success!");
+}
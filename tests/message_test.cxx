@@ -0,0 +1,65 @@
+#include "sys.h"
+#include "dbus-task/Message.h"
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "debug.h"
+
+// Write values into a message and read them back, without sending it anywhere.
+int main()
+{
+  Debug(debug::init());
+
+  // sd-bus only creates messages for a bus that was started; give it one end of a socket pair.
+  int fds[2];
+  int ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
+  ASSERT(ret == 0);
+  sd_bus* bus;
+  ret = sd_bus_new(&bus);
+  ASSERT(ret >= 0);
+  ret = sd_bus_set_fd(bus, fds[0], fds[0]);
+  ASSERT(ret >= 0);
+  ret = sd_bus_start(bus);
+  ASSERT(ret >= 0);
+
+  {
+    sd_bus_message* m;
+    ret = sd_bus_message_new_method_call(bus, &m, "org.example.Test", "/org/example/Test", "org.example.Test", "roundtrip");
+    ASSERT(ret >= 0);
+    dbus::Message message(m, bus);
+    sd_bus_message_unref(m);
+
+    std::vector<bool> const booleans = { true, false, false, true, true };
+    std::array<bool, 3> const boolean_array = { false, true, false };
+    std::map<std::string, std::vector<bool>> const flags = { { "a", { true } }, { "b", { } }, { "c", { false, true } } };
+    std::vector<int32_t> const numbers = { 1, -2, 3 };
+    message.append(booleans).append(boolean_array).append(flags).append(numbers);
+    message.append(booleans.begin(), booleans.end());
+
+    ret = sd_bus_message_seal(message, 1, 0);
+    ASSERT(ret >= 0);
+    ret = sd_bus_message_rewind(message, 1);
+    ASSERT(ret >= 0);
+    ASSERT(message.has_signature("abaaba{sab}aiab"));
+
+    std::vector<bool> booleans_read = { false };        // Reading replaces the old contents.
+    std::array<bool, 3> boolean_array_read;
+    std::map<std::string, std::vector<bool>> flags_read;
+    std::vector<int32_t> numbers_read;
+    std::vector<bool> booleans_read2;
+    message >> booleans_read >> boolean_array_read >> flags_read >> numbers_read >> booleans_read2;
+    ASSERT(booleans_read == booleans);
+    ASSERT(boolean_array_read == boolean_array);
+    ASSERT(flags_read == flags);
+    ASSERT(numbers_read == numbers);
+    ASSERT(booleans_read2 == booleans);
+  }
+
+  sd_bus_unref(bus);
+  close(fds[1]);
+
+  Dout(dc::notice, "Success!");
+}
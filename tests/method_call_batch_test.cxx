@@ -0,0 +1,116 @@
+#include "sys.h"
+#include "dbus-task/DBusConnection.h"
+#include "dbus-task/DBusMethodCallBatch.h"
+#include "dbus-task/Message.h"
+#include "dbus-task/DBusConnectionBrokerKey.h"
+#include "statefultask/AIStatefulTask.h"
+#include "statefultask/DefaultMemoryPagePool.h"
+#include "statefultask/Broker.h"
+#include "evio/EventLoop.h"
+#include "resolver-task/DnsResolver.h"
+#include "utils/threading/Gate.h"
+#include "threadpool/AIThreadPool.h"
+#include "debug.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Requires the server of server_side_concatenate_test to be running.
+
+constexpr int batch_size = 5;
+constexpr size_t failing_call = 2;
+
+namespace utils { using namespace threading; }
+
+int main()
+{
+  Debug(debug::init());
+  Dout(dc::notice, "Entering main()");
+
+  // Create a AIMemoryPagePool object (must be created before thread_pool).
+  [[maybe_unused]] AIMemoryPagePool mpp;
+
+  AIThreadPool thread_pool(4, 8);
+  [[maybe_unused]] AIQueueHandle high_priority_queue = thread_pool.new_queue(4, 1);
+                   AIQueueHandle low_priority_queue  = thread_pool.new_queue(4);
+
+  try
+  {
+    evio::EventLoop event_loop(low_priority_queue COMMA_CWDEBUG_ONLY("\e[36m", "\e[0m"));
+    resolver::Scope resolver_scope(low_priority_queue, false);
+
+    using statefultask::create;
+
+    auto broker = create<task::Broker<task::DBusConnection>>(CWDEBUG_ONLY(true));
+    broker->run(low_priority_queue);
+
+    dbus::DBusConnectionBrokerKey broker_key;
+    dbus::Destination const destination("org.sdbuscpp.concatenator", "/org/sdbuscpp/concatenator", "org.sdbuscpp.Concatenator", "concatenate");
+    std::string const separator = ":";
+
+    // A batch where every call succeeds.
+    {
+      utils::Gate gate;
+      std::atomic_int replies(0);
+      bool batch_success = false;
+      auto batch = create<task::DBusMethodCallBatch>(CWDEBUG_ONLY(true));
+      batch->set_destination(broker, &broker_key, &destination);
+      for (int32_t k = 0; k < batch_size; ++k)
+        batch->add_params_callback([&separator, k](dbus::Message& message) {
+          std::vector<int32_t> numbers = { k, k + 1 };
+          message.append(numbers.begin(), numbers.end()).append(separator);
+        });
+      batch->set_reply_callback([&](size_t index, dbus::MessageRead const& message) {
+        ASSERT(!message.is_method_error());
+        std::string result;
+        message >> result;
+        ASSERT(result == std::to_string(index) + ":" + std::to_string(index + 1));
+        ++replies;
+      });
+      batch->run(low_priority_queue, [&](bool success){ batch_success = success; gate.open(); });
+      gate.wait();
+      ASSERT(batch_success);
+      ASSERT(replies == batch_size);
+      Dout(dc::notice, "Successful batch: PASS");
+    }
+
+    // A batch where creating one of the messages fails (a string may not contain a NUL character),
+    // after the calls before it were already sent.
+    {
+      utils::Gate gate;
+      std::atomic_int replies(0);
+      bool batch_success = true;
+      auto batch = create<task::DBusMethodCallBatch>(CWDEBUG_ONLY(true));
+      batch->set_destination(broker, &broker_key, &destination);
+      for (int32_t k = 0; k < batch_size; ++k)
+        batch->add_params_callback([&separator, k](dbus::Message& message) {
+          std::vector<int32_t> numbers = { k, k + 1 };
+          message.append(numbers.begin(), numbers.end());
+          if (k == failing_call)
+            message.append(std::string("\0", 1));
+          else
+            message.append(separator);
+        });
+      batch->set_reply_callback([&](size_t UNUSED_ARG(index), dbus::MessageRead const& UNUSED_ARG(message)) { ++replies; });
+      batch->run(low_priority_queue, [&](bool success){ batch_success = success; gate.open(); });
+      gate.wait();
+      // The failure is reported to the batch callback, instead of waiting forever for the calls that weren't sent.
+      ASSERT(!batch_success);
+      // The calls that were sent before the failure were cancelled.
+      ASSERT(replies == 0);
+      Dout(dc::notice, "Failing batch: PASS");
+    }
+
+    broker->abort();
+    broker.reset();
+
+    event_loop.join();
+  }
+  catch (AIAlert::Error const& error)
+  {
+    Dout(dc::warning, error << " [caught in method_call_batch_test.cxx].");
+  }
+
+  Dout(dc::notice, "Leaving main()");
+}
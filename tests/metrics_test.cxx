@@ -0,0 +1,144 @@
+#include "sys.h"
+#include "dbus-task/LatencyHistogram.h"
+#include "dbus-task/ConnectionMetrics.h"
+#include <systemd/sd-bus.h>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "debug.h"
+
+using Snapshot = dbus::LatencyHistogramSnapshot;
+using namespace std::chrono_literals;
+
+int main()
+{
+  Debug(debug::init());
+
+  // Bucket assignment.
+  // Small values have a bucket of their own.
+  for (uint64_t value = 0; value < 2 * Snapshot::sub_buckets; ++value)
+  {
+    ASSERT(Snapshot::bucket(value) == static_cast<int>(value));
+    ASSERT(Snapshot::bucket_width(value) == 1);
+  }
+  ASSERT(Snapshot::bucket(64) == 64 && Snapshot::bucket(65) == 64 && Snapshot::bucket(66) == 65);
+  ASSERT(Snapshot::bucket_lower_bound(64) == 64 && Snapshot::bucket_width(64) == 2);
+  ASSERT(Snapshot::bucket(1000) == Snapshot::bucket(1007) && Snapshot::bucket(1008) == Snapshot::bucket(1000) + 1);
+  // Every value lies within its bucket, and buckets are consecutive.
+  int previous = 0;
+  for (uint64_t value = 0; value < (uint64_t{1} << 20); value += 1 + value / 1000)
+  {
+    int bucket = Snapshot::bucket(value);
+    ASSERT(Snapshot::bucket_lower_bound(bucket) <= value && value < Snapshot::bucket_lower_bound(bucket) + Snapshot::bucket_width(bucket));
+    ASSERT(bucket == previous || bucket == previous + 1);
+    previous = bucket;
+  }
+  // The resolution is about 3%.
+  for (int bucket = 2 * Snapshot::sub_buckets; bucket < Snapshot::number_of_buckets; ++bucket)
+    ASSERT(Snapshot::bucket_width(bucket) * Snapshot::sub_buckets <= Snapshot::bucket_lower_bound(bucket));
+  // Values that are too large end up in the last bucket.
+  ASSERT(Snapshot::bucket((uint64_t{1} << Snapshot::max_value_bits) - 1) == Snapshot::number_of_buckets - 1);
+  ASSERT(Snapshot::bucket(uint64_t{1} << Snapshot::max_value_bits) == Snapshot::number_of_buckets - 1);
+  ASSERT(Snapshot::bucket(UINT64_MAX) == Snapshot::number_of_buckets - 1);
+
+  // Recording.
+  {
+    dbus::LatencyHistogram histogram;
+    ASSERT(histogram.snapshot().count() == 0);
+    ASSERT(histogram.snapshot().percentile(0.5) == 0);
+    for (int usec = 1; usec <= 1000; ++usec)
+      histogram.record(std::chrono::microseconds(usec));
+    Snapshot snapshot = histogram.snapshot();
+    ASSERT(snapshot.count() == 1000);
+    ASSERT(snapshot.max() == 1000);
+    ASSERT(snapshot.mean() == 500.5);
+    // Percentiles are accurate within the resolution of the buckets.
+    ASSERT(snapshot.percentile(0.0) == 1);
+    ASSERT(snapshot.percentile(0.5) >= 485 && snapshot.percentile(0.5) <= 515);
+    ASSERT(snapshot.percentile(0.99) >= 960 && snapshot.percentile(0.99) <= 1000);
+    ASSERT(snapshot.percentile(1.0) == 1000);
+    // Durations are truncated to microseconds; negative durations are recorded as zero.
+    histogram.record(999ns);
+    histogram.record(-5us);
+    snapshot = histogram.snapshot();
+    ASSERT(snapshot.count() == 1002);
+    ASSERT(snapshot.percentile(0.0) == 0);
+
+    // Adding snapshots.
+    dbus::LatencyHistogram other;
+    other.record(2s);
+    snapshot += other.snapshot();
+    ASSERT(snapshot.count() == 1003);
+    ASSERT(snapshot.max() == 2000000);
+    ASSERT(snapshot.percentile(1.0) == 2000000);
+    Dout(dc::notice, "histogram: " << snapshot);
+  }
+
+  // Connection metrics.
+  {
+    dbus::ConnectionMetrics metrics;
+    metrics.set_description("metrics_test");
+    using S = dbus::ConnectionMetricsSnapshot;
+    ASSERT(dbus::ConnectionMetrics::index(SD_BUS_MESSAGE_METHOD_CALL) == S::method_call);
+    ASSERT(dbus::ConnectionMetrics::index(SD_BUS_MESSAGE_METHOD_RETURN) == S::method_return);
+    ASSERT(dbus::ConnectionMetrics::index(SD_BUS_MESSAGE_METHOD_ERROR) == S::method_error);
+    ASSERT(dbus::ConnectionMetrics::index(SD_BUS_MESSAGE_SIGNAL) == S::signal);
+
+    metrics.sent(SD_BUS_MESSAGE_METHOD_CALL);
+    metrics.sent(SD_BUS_MESSAGE_METHOD_CALL);
+    metrics.received(SD_BUS_MESSAGE_METHOD_RETURN);
+    metrics.received(SD_BUS_MESSAGE_SIGNAL);
+    metrics.received(SD_BUS_MESSAGE_SIGNAL);
+    metrics.received(SD_BUS_MESSAGE_SIGNAL);
+    metrics.wakeup(5);
+    metrics.wakeup(3);
+    metrics.budget_exhausted();
+    metrics.lock_requested(true);
+    metrics.lock_requested(false);
+    metrics.io_lock_waited(1500us);
+    metrics.io_lock_held(250us);
+    metrics.io_lock_held(250us);
+    metrics.reply_pending();
+    metrics.reply_pending();
+    metrics.reply_done();
+    metrics.queue_depths(7, 2);
+    metrics.reconnected();
+
+    S snapshot = metrics.snapshot();
+    ASSERT(snapshot.m_messages_out[S::method_call] == 2 && snapshot.m_messages_out[S::method_return] == 0);
+    ASSERT(snapshot.m_messages_in[S::method_return] == 1 && snapshot.m_messages_in[S::signal] == 3 && snapshot.m_messages_in[S::method_call] == 0);
+    ASSERT(snapshot.m_wakeups == 2);
+    ASSERT(snapshot.m_process_iterations == 8);
+    ASSERT(snapshot.m_max_iterations_per_wakeup == 5);
+    ASSERT(snapshot.m_budget_exhausted == 1 && metrics.budget_exhausted_count() == 1);
+    ASSERT(snapshot.m_lock_acquisitions == 2 && snapshot.m_lock_handoffs == 1);
+    ASSERT(snapshot.m_io_lock_wait_usec == 1500 && snapshot.m_io_lock_hold_usec == 500);
+    ASSERT(snapshot.m_outstanding_replies == 1);
+    ASSERT(snapshot.m_read_queue_depth == 7 && snapshot.m_write_queue_depth == 2);
+    ASSERT(snapshot.m_reconnects == 1);
+
+    // The totals of two connections; the maximum iterations per wakeup is not added.
+    dbus::ConnectionMetrics other;
+    other.wakeup(4);
+    other.reply_pending();
+    snapshot += other.snapshot();
+    ASSERT(snapshot.m_wakeups == 3 && snapshot.m_process_iterations == 12 && snapshot.m_max_iterations_per_wakeup == 5);
+    ASSERT(snapshot.m_outstanding_replies == 2);
+
+    // Both objects are registered.
+    int found = 0;
+    dbus::ConnectionMetrics::for_each([&](std::string const& description, S const& registered){
+      if (description == "metrics_test")
+      {
+        ASSERT(registered.m_wakeups == 2);
+        ++found;
+      }
+      else if (description.empty() && registered.m_process_iterations == 4)
+        ++found;
+    });
+    ASSERT(found == 2);
+    Dout(dc::notice, "metrics: " << snapshot);
+  }
+
+  Dout(dc::notice, "Success!");
+}
@@ -0,0 +1,65 @@
+#include "sys.h"
+#include "dbus-task/RetryPolicy.h"
+#include <chrono>
+#include "debug.h"
+
+using namespace std::chrono_literals;
+
+int main()
+{
+  Debug(debug::init());
+
+  dbus::RetryPolicy policy;
+  policy.m_initial_backoff = 1000us;
+  policy.m_max_backoff = 5000us;
+  policy.m_multiplier = 2.0;
+
+  // Only the listed errors are retried.
+  using Errors = dbus::RetryPolicy::Errors;
+  ASSERT(policy.should_retry(Errors::ServiceUnknown));
+  ASSERT(policy.should_retry(Errors::NoReply));
+  ASSERT(!policy.should_retry(Errors::AccessDenied));
+
+  // The upper bound of the backoff of retry n is min(m_max_backoff, m_initial_backoff * m_multiplier^(n-1)).
+  std::chrono::microseconds const upper_bound[] = { 1000us, 2000us, 4000us, 5000us, 5000us };
+  int constexpr samples = 10000;
+  for (unsigned int retry = 1; retry <= std::size(upper_bound); ++retry)
+  {
+    std::chrono::microseconds min = std::chrono::microseconds::max();
+    std::chrono::microseconds max = std::chrono::microseconds::zero();
+    for (int i = 0; i < samples; ++i)
+    {
+      std::chrono::microseconds delay = policy.backoff(retry);
+      ASSERT(delay >= 0us && delay <= upper_bound[retry - 1]);
+      min = std::min(min, delay);
+      max = std::max(max, delay);
+    }
+    Dout(dc::notice, "Retry " << retry << ": backoff between " << min.count() << " and " << max.count() << " us.");
+    // Full jitter: the delays are spread over the whole range.
+    ASSERT(min < upper_bound[retry - 1] / 10);
+    ASSERT(max > upper_bound[retry - 1] * 9 / 10);
+  }
+
+  // A budget of three tokens, that gains half a token per successful call.
+  dbus::RetryBudget budget(3, 0.5);
+  ASSERT(budget.withdraw());
+  ASSERT(budget.withdraw());
+  ASSERT(budget.withdraw());
+  // Exhausted.
+  ASSERT(!budget.withdraw());
+  // One success is not enough for a retry...
+  budget.deposit();
+  ASSERT(!budget.withdraw());
+  // ...two are.
+  budget.deposit();
+  ASSERT(budget.withdraw());
+  ASSERT(!budget.withdraw());
+  // The budget never grows beyond its maximum.
+  for (int i = 0; i < 100; ++i)
+    budget.deposit();
+  for (int i = 0; i < 3; ++i)
+    ASSERT(budget.withdraw());
+  ASSERT(!budget.withdraw());
+
+  Dout(dc::notice, "Success!");
+}
@@ -0,0 +1,73 @@
+#include "sys.h"
+#include "dbus-task/Signature.h"
+#include <array>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <variant>
+#include <vector>
+#include "debug.h"
+
+// Everything is tested at compile time; this program only has to compile.
+
+template<typename T>
+constexpr bool has_signature(std::string_view expected)
+{
+  return std::string_view(dbus::signature_v<T>) == expected;
+}
+
+struct Point
+{
+  int32_t x;
+  int32_t y;
+};
+
+struct Sample
+{
+  uint32_t id;
+  std::array<double, 3> position;
+  std::string name;
+};
+
+struct Nested
+{
+  Point origin;
+  std::vector<Point> points;
+};
+
+// Basic types.
+static_assert(has_signature<uint8_t>("y"));
+static_assert(has_signature<bool>("b"));
+static_assert(has_signature<int32_t>("i"));
+static_assert(has_signature<uint64_t>("t"));
+static_assert(has_signature<double>("d"));
+static_assert(has_signature<std::string>("s"));
+
+// Containers.
+static_assert(has_signature<std::vector<std::string>>("as"));
+static_assert(has_signature<std::array<int16_t, 4>>("an"));
+static_assert(has_signature<std::map<std::string, std::variant<int32_t, std::string>>>("a{sv}"));
+static_assert(has_signature<std::map<uint32_t, std::vector<double>>>("a{uad}"));
+static_assert(has_signature<std::optional<int32_t>>("ai"));
+
+// Structs.
+static_assert(has_signature<std::tuple<int32_t, std::vector<std::string>, std::vector<std::tuple<uint8_t, double>>>>("(iasa(yd))"));
+static_assert(has_signature<std::pair<std::string, bool>>("(sb)"));
+static_assert(has_signature<Point>("(ii)"));
+static_assert(has_signature<Sample>("(uads)"));
+static_assert(has_signature<Nested>("((ii)a(ii))"));
+
+// Unsupported types.
+static_assert(!dbus::DBusType<float>);
+static_assert(!dbus::DBusType<char const*>);
+static_assert(!dbus::DBusType<std::map<std::vector<int32_t>, int32_t>>);     // The key of a DICT_ENTRY must be a basic type.
+static_assert(!dbus::DBusType<std::vector<float>>);
+static_assert(!dbus::DBusType<std::tuple<>>);                                  // A STRUCT must have at least one member.
+
+int main()
+{
+  Debug(debug::init());
+  Dout(dc::notice, "Success!");
+}
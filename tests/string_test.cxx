@@ -0,0 +1,37 @@
+#include "sys.h"
+#include "dbus-task/Message.h"
+#include <string_view>
+#include "debug.h"
+
+using namespace std::string_view_literals;
+
+int main()
+{
+  Debug(debug::init());
+
+  // Valid strings.
+  ASSERT(dbus::is_valid_string(""));
+  ASSERT(dbus::is_valid_string("hello"));
+  ASSERT(dbus::is_valid_string("caf\xc3\xa9"));                         // U+00E9
+  ASSERT(dbus::is_valid_string("\xe2\x82\xac"));                        // U+20AC
+  ASSERT(dbus::is_valid_string("\xf0\x9f\x98\x80"));                    // U+1F600
+  ASSERT(dbus::is_valid_string("\xf4\x8f\xbf\xbd"));                    // U+10FFFD
+
+  // A string_view may contain zero bytes, a D-Bus string may not.
+  ASSERT(!dbus::is_valid_string("ab\0cd"sv));
+  // Invalid UTF-8.
+  ASSERT(!dbus::is_valid_string("\x80"));                               // Continuation byte without lead byte.
+  ASSERT(!dbus::is_valid_string("\xc3"));                               // Truncated sequence.
+  ASSERT(!dbus::is_valid_string("\xe2\x82"));                           // Truncated sequence.
+  ASSERT(!dbus::is_valid_string("\xc3\x28"));                           // Invalid continuation byte.
+  ASSERT(!dbus::is_valid_string("\xf8\x88\x80\x80\x80"));               // Five byte sequence.
+  ASSERT(!dbus::is_valid_string("\xc0\xaf"));                           // Overlong encoding of '/'.
+  ASSERT(!dbus::is_valid_string("\xe0\x80\xaf"));                       // Overlong encoding of '/'.
+  // Code points that aren't allowed.
+  ASSERT(!dbus::is_valid_string("\xed\xa0\x80"));                       // U+D800, a UTF-16 surrogate.
+  ASSERT(!dbus::is_valid_string("\xf4\x90\x80\x80"));                   // U+110000
+  ASSERT(!dbus::is_valid_string("\xef\xb7\x90"));                       // U+FDD0
+  ASSERT(!dbus::is_valid_string("\xef\xbf\xbe"));                       // U+FFFE
+
+  Dout(dc::notice, "Success!");
+}